@@ -0,0 +1,62 @@
+#version 450
+
+#extension GL_ARB_shader_draw_parameters: require
+#extension GL_EXT_nonuniform_qualifier: require
+
+// Depth pre-pass, only pulls the vertex positions. There is no fragment shader.
+
+// Has to compute gl_Position exactly like simple.vert
+invariant gl_Position;
+
+layout(set=0, binding=0) readonly buffer SceneBuffers {
+    mat4 projection_matrix;
+    mat4 view_matrix;
+} scene_buffers[];
+
+// Vertex is 3 floats position, 4 bytes normal, 2 floats tex coord
+layout(set=0, binding=0) readonly buffer VertexBuffers {
+    float vertex_floats[];
+} vertex_buffers[];
+
+layout(set=0, binding=0) readonly buffer MatrixBuffers {
+    mat4 matrices[];
+} matrix_buffers[];
+
+layout(set=0, binding=0) readonly buffer IndexBuffers {
+    uint indices[];
+} index_buffers[];
+
+// Same block as simple.vert, the scene pipelines share their layout
+layout(push_constant) uniform DrawData {
+    uint draw_offset;
+    uint scene_buffer;
+    uint vertex_buffer;
+    uint material_buffer;
+    uint instance_buffer;
+    uint visible_instance_buffer;
+    uint draw_material_buffer;
+    uint light_buffer;
+    uint cluster_count_buffer;
+    uint cluster_light_buffer;
+    uint normal_buffer;
+};
+
+const uint VERTEX_FLOATS = 6;
+
+void main() {
+    uint base = gl_VertexIndex * VERTEX_FLOATS;
+    vec4 position = vec4(
+        vertex_buffers[vertex_buffer].vertex_floats[base + 0],
+        vertex_buffers[vertex_buffer].vertex_floats[base + 1],
+        vertex_buffers[vertex_buffer].vertex_floats[base + 2],
+        1.0
+    );
+
+    uint instance = index_buffers[visible_instance_buffer].indices[gl_InstanceIndex];
+    mat4 model_matrix = matrix_buffers[instance_buffer].matrices[instance];
+
+    vec4 world_pos = model_matrix * position;
+    vec4 view_pos = scene_buffers[scene_buffer].view_matrix * world_pos;
+
+    gl_Position = scene_buffers[scene_buffer].projection_matrix * view_pos;
+}
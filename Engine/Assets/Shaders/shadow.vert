@@ -0,0 +1,37 @@
+#version 450
+
+#extension GL_EXT_nonuniform_qualifier: require
+
+// Shadow casters into one cascade, only pulls the vertex positions. There is no fragment shader.
+
+// Vertex is 3 floats position, 4 bytes normal, 2 floats tex coord
+layout(set=0, binding=0) readonly buffer VertexBuffers {
+    float vertex_floats[];
+} vertex_buffers[];
+
+layout(set=0, binding=0) readonly buffer MatrixBuffers {
+    mat4 matrices[];
+} matrix_buffers[];
+
+// Has to match ShadowConstants. Every draw reads its instances from first_instance on.
+layout(push_constant) uniform ShadowData {
+    mat4 view_projection;
+    uint vertex_buffer;
+    uint instance_buffer;
+};
+
+const uint VERTEX_FLOATS = 6;
+
+void main() {
+    uint base = gl_VertexIndex * VERTEX_FLOATS;
+    vec4 position = vec4(
+        vertex_buffers[vertex_buffer].vertex_floats[base + 0],
+        vertex_buffers[vertex_buffer].vertex_floats[base + 1],
+        vertex_buffers[vertex_buffer].vertex_floats[base + 2],
+        1.0
+    );
+
+    mat4 model_matrix = matrix_buffers[instance_buffer].matrices[gl_InstanceIndex];
+
+    gl_Position = view_projection * (model_matrix * position);
+}
@@ -1,9 +1,223 @@
 #version 450
 
-layout (location=0) in vec4 frag_color;
+#extension GL_EXT_nonuniform_qualifier: require
+
+layout (location=0) in vec3 in_world_pos;
+layout (location=1) in vec3 in_normal;
+layout (location=2) in float in_view_depth;
+layout (location=3) flat in uint in_material;
+layout (location=4) in vec3 in_vertex_light;
+layout (location=5) in vec3 in_vertex_diffuse;
 
 layout (location=0) out vec4 out_color;
 
+// Has to match LightClusters
+#define GRID_X 16
+#define GRID_Y 9
+#define GRID_Z 24
+#define MAX_LIGHTS_PER_CLUSTER 128
+
+// Has to match CascadedShadowMaps
+#define CASCADE_COUNT 4
+#define SHADOW_MAP_SIZE 2048.0
+
+// Has to match SceneDebugView
+#define DEBUG_VIEW_NONE 0
+#define DEBUG_VIEW_NORMALS 1
+#define DEBUG_VIEW_LIGHT_COUNT 2
+#define DEBUG_VIEW_CASCADES 3
+
+// Set per frame by SceneRenderer, the compiler folds every branch on them. MAX_LIGHTS bounds
+// the lights of a fragment, 0 leaves out the point lights and the cluster lookup entirely.
+layout(constant_id = 0) const uint MAX_LIGHTS = MAX_LIGHTS_PER_CLUSTER;
+layout(constant_id = 1) const uint DEBUG_VIEW = DEBUG_VIEW_NONE;
+// Off lights every material per pixel
+layout(constant_id = 2) const bool VERTEX_SHADING = true;
+
+// Has to match MaterialShading
+#define SHADING_PER_VERTEX 1
+
+struct Material {
+    vec4 ambient;
+    vec4 diffuse;
+    vec4 specular;
+    float shininess; 
+    uint shading;
+};
+
+struct DirectionalLight {
+	vec4 ambient;
+	vec4 diffuse;
+	vec3 dir;
+};
+
+struct PointLight {
+	vec4 ambient;
+	vec4 diffuse;
+	vec3 pos;
+	float radius;
+};
+
+layout(set=0, binding=0) readonly buffer SceneBuffers {
+    mat4 projection_matrix;
+    mat4 view_matrix;
+    DirectionalLight dir_light;
+    vec2 screen_size;
+    float z_near;
+    float z_far;
+    mat4 cascade_view_projections[CASCADE_COUNT];
+    vec4 cascade_splits;
+    uint shadow_map;
+} scene_buffers[];
+
+// Bindless textures, the shadow map is a compare sampler over all cascade layers
+layout(set=0, binding=1) uniform sampler2DArrayShadow shadow_maps[];
+
+layout(set=0, binding=0) readonly buffer MaterialBuffers {
+    Material materials[];
+} material_buffers[];
+
+layout(set=0, binding=0) readonly buffer LightBuffers {
+    PointLight lights[];
+} light_buffers[];
+
+layout(set=0, binding=0) readonly buffer IndexBuffers {
+    uint indices[];
+} index_buffers[];
+
+layout(push_constant) uniform DrawData {
+    uint draw_offset;
+    uint scene_buffer;
+    uint vertex_buffer;
+    uint material_buffer;
+    uint instance_buffer;
+    uint visible_instance_buffer;
+    uint draw_material_buffer;
+    uint light_buffer;
+    uint cluster_count_buffer;
+    uint cluster_light_buffer;
+    uint normal_buffer;
+};
+
+vec3 CalculateDirLight(DirectionalLight light, Material mat, vec3 normal, float shadow) {
+	vec3 ray = normalize(light.dir);
+	
+    vec4 ambient = light.ambient * mat.ambient;
+    float diff = max(dot(normal, ray), 0.0);
+    vec4 diffuse = light.diffuse * (diff * mat.diffuse) * shadow;
+
+	return (ambient + diffuse).xyz;
+}
+
+// CASCADE_COUNT past the last cascade
+uint CascadeIndex(float view_depth) {
+    vec4 splits = scene_buffers[scene_buffer].cascade_splits;
+
+    uint cascade = 0;
+    while (cascade < CASCADE_COUNT && view_depth > splits[cascade]) {
+        cascade++;
+    }
+    return cascade;
+}
+
+// 1 where the directional light reaches the fragment, everything past the last cascade is lit
+float CalculateShadow(vec3 world_pos, float view_depth) {
+    uint cascade = CascadeIndex(view_depth);
+    if (cascade == CASCADE_COUNT) {
+        return 1.0;
+    }
+
+    vec4 light_pos = scene_buffers[scene_buffer].cascade_view_projections[cascade] * vec4(world_pos, 1.0);
+    vec3 coord = light_pos.xyz / light_pos.w;
+    vec2 uv = coord.xy * 0.5 + 0.5;
+
+    // Four bilinear compares, 3x3 texels in total
+    uint shadow_map = scene_buffers[scene_buffer].shadow_map;
+    float texel = 1.0 / SHADOW_MAP_SIZE;
+    float lit = 0.0;
+    for (int y = 0; y < 2; y++) {
+        for (int x = 0; x < 2; x++) {
+            vec2 offset = (vec2(x, y) - 0.5) * texel;
+            lit += texture(shadow_maps[shadow_map], vec4(uv + offset, float(cascade), coord.z));
+        }
+    }
+
+    return lit * 0.25;
+}
+
+vec3 CalculatePointLight(PointLight light, Material mat, vec3 normal, vec3 frag_pos) {
+	vec3 to_light = light.pos - frag_pos;
+	float distance_squared = dot(to_light, to_light);
+	vec3 ray = to_light * inversesqrt(max(distance_squared, 1e-8));
+
+	// Reaches 0 at the radius the light was binned with
+	float falloff = clamp(1.0 - distance_squared / (light.radius * light.radius), 0.0, 1.0);
+	falloff *= falloff;
+	
+	vec4 ambient = light.ambient * mat.ambient;
+	float diff = max(dot(normal, ray), 0.0);
+	vec4 diffuse = light.diffuse * (diff * mat.diffuse);
+
+	return (ambient + diffuse).xyz * falloff;
+}
+
+// Inverse of the froxel layout in cluster.comp
+uint ClusterIndex(vec2 frag_coord, float view_depth) {
+    vec2 screen_size = scene_buffers[scene_buffer].screen_size;
+    float z_near = scene_buffers[scene_buffer].z_near;
+    float z_far = scene_buffers[scene_buffer].z_far;
+
+    uvec2 tile = min(uvec2(frag_coord / screen_size * vec2(GRID_X, GRID_Y)), uvec2(GRID_X - 1, GRID_Y - 1));
+    float slice = log(max(view_depth, z_near) / z_near) / log(z_far / z_near) * GRID_Z;
+    uint z = min(uint(slice), GRID_Z - 1);
+
+    return (z * GRID_Y + tile.y) * GRID_X + tile.x;
+}
+
 void main() {
-	out_color = frag_color;
+    Material m = material_buffers[material_buffer].materials[in_material];
+    vec3 norm = normalize(in_normal);
+
+    float shadow = CalculateShadow(in_world_pos, in_view_depth);
+
+    // Lit by simple.vert, only the shadow is per fragment
+    bool vertex_shaded = VERTEX_SHADING && m.shading == SHADING_PER_VERTEX;
+
+    vec3 result;
+    uint light_count = 0;
+    if (vertex_shaded) {
+        result = in_vertex_light + in_vertex_diffuse * shadow;
+    } else {
+        result = CalculateDirLight(scene_buffers[scene_buffer].dir_light, m, norm, shadow);
+    }
+
+    if (MAX_LIGHTS > 0 && !vertex_shaded) {
+        uint cluster = ClusterIndex(gl_FragCoord.xy, in_view_depth);
+        light_count = min(index_buffers[cluster_count_buffer].indices[cluster], MAX_LIGHTS);
+        uint first_light = cluster * MAX_LIGHTS_PER_CLUSTER;
+
+        // Constant trip count, the driver can unroll it
+        for (uint i = 0; i < MAX_LIGHTS; i++) {
+            if (i >= light_count) {
+                break;
+            }
+
+            uint light_index = index_buffers[cluster_light_buffer].indices[first_light + i];
+            result += CalculatePointLight(light_buffers[light_buffer].lights[light_index], m, norm, in_world_pos);
+        }
+    }
+
+	out_color = vec4(result, 1.0);
+
+    if (DEBUG_VIEW == DEBUG_VIEW_NORMALS) {
+        out_color = vec4(norm * 0.5 + 0.5, 1.0);
+    } else if (DEBUG_VIEW == DEBUG_VIEW_LIGHT_COUNT) {
+        // Blue without lights, red from 16 on
+        out_color = vec4(mix(vec3(0.0, 0.0, 1.0), vec3(1.0, 0.0, 0.0), min(float(light_count) / 16.0, 1.0)), 1.0);
+    } else if (DEBUG_VIEW == DEBUG_VIEW_CASCADES) {
+        const vec3 cascade_colors[CASCADE_COUNT + 1] = vec3[](
+            vec3(1.0, 0.2, 0.2), vec3(0.2, 1.0, 0.2), vec3(0.2, 0.2, 1.0), vec3(1.0, 1.0, 0.2), vec3(1.0)
+        );
+        out_color = vec4(result * cascade_colors[CascadeIndex(in_view_depth)], 1.0);
+    }
 }
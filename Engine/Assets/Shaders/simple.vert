@@ -1,8 +1,33 @@
 #version 450
 
 #extension GL_EXT_shader_explicit_arithmetic_types: require
-
-layout (location=0) out vec4 frag_color;
+#extension GL_ARB_shader_draw_parameters: require
+#extension GL_EXT_nonuniform_qualifier: require
+
+// Lighting happens per fragment, see simple.frag, unless the material is SHADING_PER_VERTEX
+layout (location=0) out vec3 out_world_pos;
+layout (location=1) out vec3 out_normal;
+layout (location=2) out float out_view_depth;
+layout (location=3) flat out uint out_material;
+// Per vertex shading only, the directional diffuse is shadowed per fragment
+layout (location=4) out vec3 out_vertex_light;
+layout (location=5) out vec3 out_vertex_diffuse;
+
+// Has to match LightClusters
+#define GRID_X 16
+#define GRID_Y 9
+#define GRID_Z 24
+#define MAX_LIGHTS_PER_CLUSTER 128
+
+// Has to match MaterialShading
+#define SHADING_PER_VERTEX 1
+
+// Has to match SceneSpecialization, see simple.frag
+layout(constant_id = 0) const uint MAX_LIGHTS = MAX_LIGHTS_PER_CLUSTER;
+layout(constant_id = 2) const bool VERTEX_SHADING = true;
+
+// depth.vert computes the same position, the pass after the depth pre-pass tests for equality
+invariant gl_Position;
 
 struct Vertex {
     float px, py, pz;
@@ -14,7 +39,8 @@ struct Material {
     vec4 ambient;
     vec4 diffuse;
     vec4 specular;
-    float shininess; 
+    float shininess;
+    uint shading;
 };
 
 struct DirectionalLight {
@@ -27,66 +53,138 @@ struct PointLight {
 	vec4 ambient;
 	vec4 diffuse;
 	vec3 pos;
+	float radius;
 };
 
-layout(binding=0) readonly buffer SceneData {
+// Bindless set, every block aliases the storage buffer array of BindlessDescriptors
+layout(set=0, binding=0) readonly buffer SceneBuffers {
     mat4 projection_matrix;
     mat4 view_matrix;
     DirectionalLight dir_light;
-    uint8_t num_point_lights;
-    PointLight point_lights[10];
-};
+    vec2 screen_size;
+    float z_near;
+    float z_far;
+} scene_buffers[];
 
-layout(binding=1) readonly buffer VertexData {
+layout(set=0, binding=0) readonly buffer VertexBuffers {
     Vertex vertices[];
-};
+} vertex_buffers[];
 
-layout(binding=2) readonly buffer MaterialData {
-    Material materials[];
-};
+layout(set=0, binding=0) readonly buffer MatrixBuffers {
+    mat4 matrices[];
+} matrix_buffers[];
+
+layout(set=0, binding=0) readonly buffer IndexBuffers {
+    uint indices[];
+} index_buffers[];
 
-layout(push_constant) uniform MeshData {
-    mat4 model_matrix;
-    uint material_index;
+// Inverse transposes of the instance matrices, see SceneRenderer::BuildDrawSlots
+layout(set=0, binding=0) readonly buffer NormalBuffers {
+    mat3 normal_matrices[];
+} normal_buffers[];
+
+layout(set=0, binding=0) readonly buffer MaterialBuffers {
+    Material materials[];
+} material_buffers[];
+
+layout(set=0, binding=0) readonly buffer LightBuffers {
+    PointLight lights[];
+} light_buffers[];
+
+// Slots of the buffers this draw reads. visible_instance_buffer is written by cull.comp,
+// every draw reads its range through gl_InstanceIndex. draw_material_buffer is written by
+// compact.comp, one entry per indirect draw. draw_offset is the first draw slot of the
+// chunk, gl_DrawIDARB starts at 0 in every indirect draw. Has to match simple.frag.
+layout(push_constant) uniform DrawData {
+    uint draw_offset;
+    uint scene_buffer;
+    uint vertex_buffer;
+    uint material_buffer;
+    uint instance_buffer;
+    uint visible_instance_buffer;
+    uint draw_material_buffer;
+    uint light_buffer;
+    uint cluster_count_buffer;
+    uint cluster_light_buffer;
+    uint normal_buffer;
 };
 
-vec3 CalculateDirLight(DirectionalLight light, Material mat, vec3 normal) {
-	vec3 ray = normalize(light.dir);
-	
-    vec4 ambient = light.ambient * mat.ambient;
-    float diff = max(dot(normal, ray), 0.0);
-    vec4 diffuse = light.diffuse * (diff * mat.diffuse);
+// Same as in simple.frag
+vec3 CalculatePointLight(PointLight light, Material mat, vec3 normal, vec3 world_pos) {
+	vec3 to_light = light.pos - world_pos;
+	float distance_squared = dot(to_light, to_light);
+	vec3 ray = to_light * inversesqrt(max(distance_squared, 1e-8));
 
-	return (ambient + diffuse).xyz;
-}
+	float falloff = clamp(1.0 - distance_squared / (light.radius * light.radius), 0.0, 1.0);
+	falloff *= falloff;
 
-vec3 CalculatePointLight(PointLight light, Material mat, vec3 normal, vec3 frag_pos) {
-	vec3 ray = normalize(light.pos - frag_pos);
-	
 	vec4 ambient = light.ambient * mat.ambient;
 	float diff = max(dot(normal, ray), 0.0);
 	vec4 diffuse = light.diffuse * (diff * mat.diffuse);
 
-	return (ambient + diffuse).xyz;
+	return (ambient + diffuse).xyz * falloff;
 }
 
-void main() {
-    Vertex v = vertices[gl_VertexIndex];
-    Material m = materials[material_index];
+// The froxel the vertex lands in, see ClusterIndex in simple.frag
+uint VertexClusterIndex(vec4 clip_pos, float view_depth) {
+    vec2 screen_size = scene_buffers[scene_buffer].screen_size;
+    float z_near = scene_buffers[scene_buffer].z_near;
+    float z_far = scene_buffers[scene_buffer].z_far;
 
-    vec4 position = vec4(v.px, v.py, v.pz, 1.0);
-    vec4 normal = vec4(vec3(v.nx, v.ny, v.nz) / 127.0 - 1.0, 1.0);
-    vec2 tex_coord = vec2(v.tu, v.tv);
+    // Vertices off screen or behind the camera take the closest tile
+    vec2 ndc = clamp(clip_pos.xy / max(clip_pos.w, 1e-6), -1.0, 1.0);
+    uvec2 tile = min(uvec2((ndc * 0.5 + 0.5) * vec2(GRID_X, GRID_Y)), uvec2(GRID_X - 1, GRID_Y - 1));
+    float slice = log(max(view_depth, z_near) / z_near) / log(z_far / z_near) * GRID_Z;
+    uint z = min(uint(slice), GRID_Z - 1);
 
-    vec4 world_pos = model_matrix * position;
-	vec3 norm = normalize(mat3(transpose(inverse(model_matrix))) * normal.xyz);
+    return (z * GRID_Y + tile.y) * GRID_X + tile.x;
+}
 
-    vec3 result = CalculateDirLight(dir_light, m, norm);
+void main() {
+    Vertex v = vertex_buffers[vertex_buffer].vertices[gl_VertexIndex];
+    uint instance = index_buffers[visible_instance_buffer].indices[gl_InstanceIndex];
+    mat4 model_matrix = matrix_buffers[instance_buffer].matrices[instance];
+    mat3 normal_matrix = normal_buffers[normal_buffer].normal_matrices[instance];
 
-	for (int i = 0; i < num_point_lights; i++) {
-		result += CalculatePointLight(point_lights[i], m, norm, world_pos.xyz);
-	}
+    vec4 position = vec4(v.px, v.py, v.pz, 1.0);
+    vec3 normal = vec3(v.nx, v.ny, v.nz) / 127.0 - 1.0;
 
-	gl_Position = projection_matrix * view_matrix * world_pos;
-    frag_color = vec4(result, 1.0);
+    vec4 world_pos = model_matrix * position;
+    vec4 view_pos = scene_buffers[scene_buffer].view_matrix * world_pos;
+
+    out_world_pos = world_pos.xyz;
+	out_normal = normal_matrix * normal;
+    out_view_depth = -view_pos.z;
+    out_material = index_buffers[draw_material_buffer].indices[draw_offset + gl_DrawIDARB];
+
+	gl_Position = scene_buffers[scene_buffer].projection_matrix * view_pos;
+
+    out_vertex_light = vec3(0.0);
+    out_vertex_diffuse = vec3(0.0);
+
+    // The material is the same for the whole draw, so this branch is uniform
+    Material m = material_buffers[material_buffer].materials[out_material];
+    if (VERTEX_SHADING && m.shading == SHADING_PER_VERTEX) {
+        vec3 norm = normalize(out_normal);
+
+        DirectionalLight dir_light = scene_buffers[scene_buffer].dir_light;
+        float diff = max(dot(norm, normalize(dir_light.dir)), 0.0);
+        out_vertex_light = (dir_light.ambient * m.ambient).xyz;
+        out_vertex_diffuse = (dir_light.diffuse * (diff * m.diffuse)).xyz;
+
+        if (MAX_LIGHTS > 0) {
+            uint cluster = VertexClusterIndex(gl_Position, out_view_depth);
+            uint light_count = min(index_buffers[cluster_count_buffer].indices[cluster], MAX_LIGHTS);
+            uint first_light = cluster * MAX_LIGHTS_PER_CLUSTER;
+
+            for (uint i = 0; i < MAX_LIGHTS; i++) {
+                if (i >= light_count) {
+                    break;
+                }
+
+                uint light_index = index_buffers[cluster_light_buffer].indices[first_light + i];
+                out_vertex_light += CalculatePointLight(light_buffers[light_buffer].lights[light_index], m, norm, out_world_pos);
+            }
+        }
+    }
 }
@@ -9,6 +9,7 @@
 
 #include <any>
 #include <set>
+#include <span>
 #include <string>
 #include <typeindex>
 #include <queue>
@@ -35,6 +36,9 @@ using queue = std::queue<T>;
 template <typename T>
 using set = std::set<T>;
 
+template <typename T>
+using span = std::span<T>;
+
 typedef uint64_t u64;
 typedef uint32_t u32;
 typedef uint16_t u16;
@@ -0,0 +1,168 @@
+#include "JobSystem.h"
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+
+u32 JobSystem::thread_count = 1;
+
+// Lives on the stack of ParallelFor, which only returns once no worker refers to it
+struct Job {
+    const std::function<void(u32, u32, u32)> *function;
+    u32 count;
+    u32 group_size;
+    u32 group_count;
+    std::atomic<u32> next_group = 0;
+    std::atomic<u32> finished_groups = 0;
+    // Workers that joined and may still take groups, guarded by job_mutex
+    u32 busy_workers = 0;
+};
+
+static array<std::thread> workers;
+static std::mutex job_mutex;
+static std::condition_variable job_started;
+static std::condition_variable job_finished;
+
+static Job *current_job = 0;
+// Guarded by job_mutex as well, workers are woken through job_started for both
+static std::deque<std::function<void()>> tasks;
+static u64 job_generation = 0;
+static bool running = false;
+
+static void RunGroups(Job *job, u32 thread) {
+    while (true) {
+        u32 group = job->next_group.fetch_add(1);
+        if (group >= job->group_count) {
+            return;
+        }
+
+        u32 begin = group * job->group_size;
+        u32 end = std::min(begin + job->group_size, job->count);
+        (*job->function)(begin, end, thread);
+
+        if (job->finished_groups.fetch_add(1) + 1 == job->group_count) {
+            std::lock_guard<std::mutex> lock(job_mutex);
+            job_finished.notify_one();
+        }
+    }
+}
+
+static void WorkerMain(u32 thread) {
+    u64 seen_generation = 0;
+
+    while (true) {
+        std::unique_lock<std::mutex> lock(job_mutex);
+        job_started.wait(lock, [&] { return !running || (current_job && job_generation != seen_generation) || !tasks.empty(); });
+
+        if (!running) {
+            return;
+        }
+
+        // Frame work first, the frame waits for it
+        if (!current_job || job_generation == seen_generation) {
+            std::function<void()> task = std::move(tasks.front());
+            tasks.pop_front();
+            lock.unlock();
+
+            task();
+            continue;
+        }
+
+        seen_generation = job_generation;
+
+        Job *job = current_job;
+        job->busy_workers++;
+        lock.unlock();
+
+        RunGroups(job, thread);
+
+        lock.lock();
+        if (!--job->busy_workers) {
+            job_finished.notify_one();
+        }
+    }
+}
+
+void JobSystem::Create(u32 thread_count) {
+    if (!thread_count) {
+        thread_count = std::max(std::thread::hardware_concurrency(), 1u);
+    }
+
+    JobSystem::thread_count = std::min(thread_count, MAX_THREADS);
+
+    running = true;
+
+    for (u32 i = 1; i < JobSystem::thread_count; ++i) {
+        workers.emplace_back(WorkerMain, i);
+    }
+
+    LogInfo("Job system running on %u threads", JobSystem::thread_count);
+}
+
+void JobSystem::Destroy() {
+    {
+        std::lock_guard<std::mutex> lock(job_mutex);
+        running = false;
+    }
+    job_started.notify_all();
+
+    for (std::thread &worker : workers) {
+        worker.join();
+    }
+
+    workers.clear();
+    tasks.clear();
+    thread_count = 1;
+}
+
+void JobSystem::Submit(std::function<void()> task) {
+    if (workers.empty()) {
+        task();
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(job_mutex);
+        tasks.push_back(std::move(task));
+    }
+    job_started.notify_one();
+}
+
+void JobSystem::ParallelFor(u32 count, u32 group_size, const std::function<void(u32, u32, u32)> &function) {
+    if (!count) {
+        return;
+    }
+
+    group_size = std::max(group_size, 1u);
+    u32 group_count = (count + group_size - 1) / group_size;
+
+    // Not worth waking anyone up
+    if (group_count == 1 || workers.empty()) {
+        function(0, count, 0);
+        return;
+    }
+
+    Job job;
+    job.function = &function;
+    job.count = count;
+    job.group_size = group_size;
+    job.group_count = group_count;
+
+    {
+        std::lock_guard<std::mutex> lock(job_mutex);
+        current_job = &job;
+        job_generation++;
+    }
+    job_started.notify_all();
+
+    RunGroups(&job, 0);
+
+    std::unique_lock<std::mutex> lock(job_mutex);
+    job_finished.wait(lock, [&] { return job.finished_groups == job.group_count && !job.busy_workers; });
+
+    // Workers that wake up from now on find nothing to do
+    current_job = 0;
+}
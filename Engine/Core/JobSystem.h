@@ -0,0 +1,33 @@
+#ifndef JOB_SYSTEM_H
+#define JOB_SYSTEM_H
+
+#include "../Common.h"
+
+#include <functional>
+
+// Worker threads for data parallel work inside a frame. The calling thread takes part in
+// every ParallelFor as thread 0, workers are 1 to thread_count - 1, so per thread data can
+// be indexed with the thread argument. ParallelFor must not be called from inside a job.
+//
+// Idle workers also run tasks, long work that may span frames such as pipeline compilation.
+// A worker busy with a task skips the ParallelFor calls meanwhile, the rest still share them.
+struct JobSystem {
+    static const u32 MAX_THREADS = 16;
+
+    static u32 thread_count;
+
+    // 0 uses one thread per hardware thread
+    static void Create(u32 thread_count=0);
+    static void Destroy();
+
+    // Splits [0, count) into ranges of group_size and runs them on all threads,
+    // returns once every range is done
+    static void ParallelFor(u32 count, u32 group_size, const std::function<void(u32 begin, u32 end, u32 thread)> &function);
+
+    // Queues the task for the next idle worker and returns. Without workers it runs right away.
+    // Tasks must not use per thread data. Tasks still queued at Destroy are dropped, so owners
+    // of tasks wait for them to finish before that.
+    static void Submit(std::function<void()> task);
+};
+
+#endif
@@ -0,0 +1,51 @@
+#include "ClusteredLighting.h"
+
+void ProjectionDepthRange(const glm::mat4 &projection, f32 *z_near, f32 *z_far) {
+    // m22 = f / (n - f) and m32 = n * f / (n - f)
+    *z_near = projection[3][2] / projection[2][2];
+    *z_far = projection[3][2] / (projection[2][2] + 1.0f);
+}
+
+void LightClusters::Create() {
+    // 0 scene data, 1 lights, 2 cluster counts, 3 cluster lights
+    const VkDescriptorType bindings[] = {
+        VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+        VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER
+    };
+
+    CreateComputePipeline(&pipeline, "Engine/Assets/Shaders/cluster.comp.spv", bindings, sizeof(LightClusterConstants));
+
+    // The grid has a fixed size, the buffers never grow
+    cluster_counts.Reserve((VkDeviceSize) CLUSTER_COUNT * sizeof(u32), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT);
+    cluster_lights.Reserve((VkDeviceSize) CLUSTER_COUNT * MAX_LIGHTS_PER_CLUSTER * sizeof(u32), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT);
+}
+
+void LightClusters::Destroy() {
+    cluster_counts.Destroy();
+    cluster_lights.Destroy();
+
+    pipeline.Destroy();
+}
+
+void LightClusters::Build(VkCommandBuffer cmd_buf, VkDescriptorBufferInfo scene, VkDescriptorBufferInfo lights, u32 light_count) {
+    // The previous frame may still be shading with the lists
+    CullBarrier(cmd_buf,
+        VK_PIPELINE_STAGE_2_FRAGMENT_SHADER_BIT, VK_ACCESS_2_NONE,
+        VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT, VK_ACCESS_2_NONE
+    );
+
+    LightClusterConstants constants;
+    constants.light_count = light_count;
+
+    VkDescriptorBufferInfo buffers[4] = { scene, lights, cluster_counts.Info(), cluster_lights.Info() };
+
+    vkCmdBindPipeline(cmd_buf, VK_PIPELINE_BIND_POINT_COMPUTE, pipeline.handle);
+    PushStorageBuffers(cmd_buf, pipeline.layout, buffers, ARRAY_SIZE(buffers));
+    vkCmdPushConstants(cmd_buf, pipeline.layout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(LightClusterConstants), &constants);
+    vkCmdDispatch(cmd_buf, CLUSTER_COUNT, 1, 1);
+
+    CullBarrier(cmd_buf,
+        VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT, VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT,
+        VK_PIPELINE_STAGE_2_FRAGMENT_SHADER_BIT, VK_ACCESS_2_SHADER_STORAGE_READ_BIT
+    );
+}
@@ -0,0 +1,44 @@
+#ifndef CLUSTERED_LIGHTING_H
+#define CLUSTERED_LIGHTING_H
+
+#include "Common.h"
+#include "Vulkan/VulkanRenderer.h"
+#include "Graphics/GPUCulling.h"
+
+// Mirrors ClusterData in cluster.comp
+struct LightClusterConstants {
+    u32 light_count;
+};
+
+// Near and far plane of a [0, 1] depth perspective projection
+void ProjectionDepthRange(const glm::mat4 &projection, f32 *z_near, f32 *z_far);
+
+// Clustered forward lighting. The view frustum is split into a GRID_X * GRID_Y * GRID_Z grid
+// of froxels, screen tiles with exponentially growing depth slices. cluster.comp runs one
+// workgroup per froxel and lists the point lights whose radius reaches its view space box,
+// the fragment shader finds its froxel and only shades with those lights.
+//
+// A froxel keeps at most MAX_LIGHTS_PER_CLUSTER lights, so the shading cost per fragment is
+// bounded no matter how many lights there are. The grid size is repeated in the shaders.
+struct LightClusters {
+    static const u32 GRID_X = 16;
+    static const u32 GRID_Y = 9;
+    static const u32 GRID_Z = 24;
+    static const u32 CLUSTER_COUNT = GRID_X * GRID_Y * GRID_Z;
+    static const u32 MAX_LIGHTS_PER_CLUSTER = 128;
+
+    ComputePipeline pipeline;
+
+    // Light count of every froxel, and MAX_LIGHTS_PER_CLUSTER light indices per froxel
+    CullBuffer cluster_counts;
+    CullBuffer cluster_lights;
+
+    void Create();
+    void Destroy();
+
+    // Has to be called outside of dynamic rendering, before the draws that shade with it.
+    // scene is the SceneData of the frame, lights holds light_count PointLights.
+    void Build(VkCommandBuffer cmd_buf, VkDescriptorBufferInfo scene, VkDescriptorBufferInfo lights, u32 light_count);
+};
+
+#endif
@@ -0,0 +1,212 @@
+#include "Frustum.h"
+
+#include <math.h>
+#include <bit>
+#include <immintrin.h>
+
+void CullingBounds::Clear() {
+    center_x.clear();
+    center_y.clear();
+    center_z.clear();
+    extent_x.clear();
+    extent_y.clear();
+    extent_z.clear();
+    count = 0;
+}
+
+void CullingBounds::Add(glm::vec3 center, glm::vec3 extent) {
+    center_x.push_back(center.x);
+    center_y.push_back(center.y);
+    center_z.push_back(center.z);
+    extent_x.push_back(extent.x);
+    extent_y.push_back(extent.y);
+    extent_z.push_back(extent.z);
+    count++;
+}
+
+void CullingBounds::Pad() {
+    u32 padded = (count + 7) & ~7u;
+    center_x.resize(padded, 0.0f);
+    center_y.resize(padded, 0.0f);
+    center_z.resize(padded, 0.0f);
+    extent_x.resize(padded, 0.0f);
+    extent_y.resize(padded, 0.0f);
+    extent_z.resize(padded, 0.0f);
+}
+
+void CullingBounds::Resize(u32 count) {
+    this->count = count;
+    Pad();
+}
+
+void CullingBounds::Set(u32 index, const glm::mat4 &transform, glm::vec3 bounds_min, glm::vec3 bounds_max) {
+    glm::vec3 center, extent;
+    TransformAABB(transform, bounds_min, bounds_max, &center, &extent);
+
+    center_x[index] = center.x;
+    center_y[index] = center.y;
+    center_z[index] = center.z;
+    extent_x[index] = extent.x;
+    extent_y[index] = extent.y;
+    extent_z[index] = extent.z;
+}
+
+void TransformAABB(const glm::mat4 &transform, glm::vec3 bounds_min, glm::vec3 bounds_max, glm::vec3 *center, glm::vec3 *extent) {
+    glm::vec3 local_center = (bounds_min + bounds_max) * 0.5f;
+    glm::vec3 local_extent = (bounds_max - bounds_min) * 0.5f;
+
+    // Arvo: the new extent is the absolute rotation applied to the old one
+    glm::mat3 rotation = glm::mat3(transform);
+    *extent = glm::vec3(
+        fabsf(rotation[0][0]) * local_extent.x + fabsf(rotation[1][0]) * local_extent.y + fabsf(rotation[2][0]) * local_extent.z,
+        fabsf(rotation[0][1]) * local_extent.x + fabsf(rotation[1][1]) * local_extent.y + fabsf(rotation[2][1]) * local_extent.z,
+        fabsf(rotation[0][2]) * local_extent.x + fabsf(rotation[1][2]) * local_extent.y + fabsf(rotation[2][2]) * local_extent.z
+    );
+
+    *center = glm::vec3(transform * glm::vec4(local_center, 1.0f));
+}
+
+void CullingBounds::Add(const glm::mat4 &transform, glm::vec3 bounds_min, glm::vec3 bounds_max) {
+    glm::vec3 center, extent;
+    TransformAABB(transform, bounds_min, bounds_max, &center, &extent);
+
+    Add(center, extent);
+}
+
+// Gribb/Hartmann plane extraction for a [0, 1] depth range
+void Frustum::Extract(const glm::mat4 &view_projection) {
+    glm::vec4 rows[4];
+    for (u32 i = 0; i < 4; ++i) {
+        rows[i] = glm::vec4(view_projection[0][i], view_projection[1][i], view_projection[2][i], view_projection[3][i]);
+    }
+
+    planes[0] = rows[3] + rows[0];
+    planes[1] = rows[3] - rows[0];
+    planes[2] = rows[3] + rows[1];
+    planes[3] = rows[3] - rows[1];
+    planes[4] = rows[2];
+    planes[5] = rows[3] - rows[2];
+
+    for (glm::vec4 &plane : planes) {
+        plane /= glm::length(glm::vec3(plane));
+    }
+}
+
+void Frustum::Extract(const FPSCamera *camera) {
+    Extract(camera->projection * camera->view);
+}
+
+void Frustum::Extract(const FreeCamera *camera) {
+    Extract(camera->projection * camera->view);
+}
+
+bool Frustum::IntersectsSphere(glm::vec3 center, f32 radius) const {
+    for (const glm::vec4 &plane : planes) {
+        if (glm::dot(glm::vec3(plane), center) + plane.w < -radius) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+bool Frustum::IntersectsAABB(glm::vec3 center, glm::vec3 extent) const {
+    for (const glm::vec4 &plane : planes) {
+        f32 distance = glm::dot(glm::vec3(plane), center) + plane.w;
+        f32 radius = glm::dot(glm::abs(glm::vec3(plane)), extent);
+
+        if (distance < -radius) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+u32 Frustum::CullAABBs(CullingBounds *bounds, u8 *visible) const {
+    bounds->Pad();
+
+    return CullAABBs(bounds, visible, 0, (u32) bounds->center_x.size());
+}
+
+u32 Frustum::CullAABBs(const CullingBounds *bounds, u8 *visible, u32 first, u32 end) const {
+    u32 visible_count = 0;
+
+#ifdef __AVX__
+    for (u32 i = first; i < end; i += 8) {
+        __m256 cx = _mm256_loadu_ps(&bounds->center_x[i]);
+        __m256 cy = _mm256_loadu_ps(&bounds->center_y[i]);
+        __m256 cz = _mm256_loadu_ps(&bounds->center_z[i]);
+        __m256 ex = _mm256_loadu_ps(&bounds->extent_x[i]);
+        __m256 ey = _mm256_loadu_ps(&bounds->extent_y[i]);
+        __m256 ez = _mm256_loadu_ps(&bounds->extent_z[i]);
+
+        __m256 inside = _mm256_castsi256_ps(_mm256_set1_epi32(-1));
+
+        for (const glm::vec4 &plane : planes) {
+            __m256 nx = _mm256_set1_ps(plane.x);
+            __m256 ny = _mm256_set1_ps(plane.y);
+            __m256 nz = _mm256_set1_ps(plane.z);
+
+            __m256 distance = _mm256_add_ps(_mm256_mul_ps(nx, cx), _mm256_mul_ps(ny, cy));
+            distance = _mm256_add_ps(distance, _mm256_mul_ps(nz, cz));
+            distance = _mm256_add_ps(distance, _mm256_set1_ps(plane.w));
+
+            __m256 radius = _mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(fabsf(plane.x)), ex), _mm256_mul_ps(_mm256_set1_ps(fabsf(plane.y)), ey));
+            radius = _mm256_add_ps(radius, _mm256_mul_ps(_mm256_set1_ps(fabsf(plane.z)), ez));
+
+            // distance >= -radius
+            inside = _mm256_and_ps(inside, _mm256_cmp_ps(_mm256_add_ps(distance, radius), _mm256_setzero_ps(), _CMP_GE_OQ));
+        }
+
+        // Padding lanes are never visible
+        u32 mask = (u32) _mm256_movemask_ps(inside);
+        u32 valid = bounds->count > i ? bounds->count - i : 0;
+        if (valid < 8) {
+            mask &= (1u << valid) - 1;
+        }
+
+        for (u32 lane = 0; lane < 8; ++lane) {
+            visible[i + lane] = (mask >> lane) & 1;
+        }
+        visible_count += (u32) std::popcount(mask);
+    }
+#else
+    for (u32 i = first; i < end; i += 4) {
+        __m128 cx = _mm_loadu_ps(&bounds->center_x[i]);
+        __m128 cy = _mm_loadu_ps(&bounds->center_y[i]);
+        __m128 cz = _mm_loadu_ps(&bounds->center_z[i]);
+        __m128 ex = _mm_loadu_ps(&bounds->extent_x[i]);
+        __m128 ey = _mm_loadu_ps(&bounds->extent_y[i]);
+        __m128 ez = _mm_loadu_ps(&bounds->extent_z[i]);
+
+        __m128 inside = _mm_castsi128_ps(_mm_set1_epi32(-1));
+
+        for (const glm::vec4 &plane : planes) {
+            __m128 distance = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(plane.x), cx), _mm_mul_ps(_mm_set1_ps(plane.y), cy));
+            distance = _mm_add_ps(distance, _mm_mul_ps(_mm_set1_ps(plane.z), cz));
+            distance = _mm_add_ps(distance, _mm_set1_ps(plane.w));
+
+            __m128 radius = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(fabsf(plane.x)), ex), _mm_mul_ps(_mm_set1_ps(fabsf(plane.y)), ey));
+            radius = _mm_add_ps(radius, _mm_mul_ps(_mm_set1_ps(fabsf(plane.z)), ez));
+
+            // distance >= -radius
+            inside = _mm_and_ps(inside, _mm_cmpge_ps(_mm_add_ps(distance, radius), _mm_setzero_ps()));
+        }
+
+        // Padding lanes are never visible
+        u32 mask = (u32) _mm_movemask_ps(inside);
+        u32 valid = bounds->count > i ? bounds->count - i : 0;
+        if (valid < 4) {
+            mask &= (1u << valid) - 1;
+        }
+
+        for (u32 lane = 0; lane < 4; ++lane) {
+            visible[i + lane] = (mask >> lane) & 1;
+        }
+        visible_count += (u32) std::popcount(mask);
+    }
+#endif
+
+    return visible_count;
+}
@@ -0,0 +1,51 @@
+#ifndef FRUSTUM_H
+#define FRUSTUM_H
+
+#include "Common.h"
+#include "Core/Camera.h"
+
+#define GLM_FORCE_DEPTH_ZERO_TO_ONE
+#include <glm/glm.hpp>
+
+// World space box that encloses a transformed model space box
+void TransformAABB(const glm::mat4 &transform, glm::vec3 bounds_min, glm::vec3 bounds_max, glm::vec3 *center, glm::vec3 *extent);
+
+// World space axis aligned boxes stored as structure of arrays, so the frustum test can
+// load 4 (SSE) or 8 (AVX) boxes per instruction. Culling pads the arrays to a multiple
+// of 8, call Clear before adding boxes again.
+struct CullingBounds {
+    array<f32> center_x, center_y, center_z;
+    array<f32> extent_x, extent_y, extent_z;
+    u32 count = 0;
+
+    void Clear();
+    void Add(glm::vec3 center, glm::vec3 extent);
+    // Transforms a model space box, the result encloses the rotated box
+    void Add(const glm::mat4 &transform, glm::vec3 bounds_min, glm::vec3 bounds_max);
+    void Pad();
+
+    // Room for count padded boxes, filled with Set. Lets several threads write their own ranges.
+    void Resize(u32 count);
+    void Set(u32 index, const glm::mat4 &transform, glm::vec3 bounds_min, glm::vec3 bounds_max);
+};
+
+// Six world space planes (xyz normal pointing inwards, w distance) in the order
+// left, right, bottom, top, near, far. Layout matches what the culling shader expects.
+struct Frustum {
+    glm::vec4 planes[6];
+
+    void Extract(const glm::mat4 &view_projection);
+    void Extract(const FPSCamera *camera);
+    void Extract(const FreeCamera *camera);
+
+    bool IntersectsSphere(glm::vec3 center, f32 radius) const;
+    bool IntersectsAABB(glm::vec3 center, glm::vec3 extent) const;
+
+    // Writes 1 for every box that intersects the frustum and 0 for every other one,
+    // visible needs room for the padded count. Returns the number of visible boxes.
+    u32 CullAABBs(CullingBounds *bounds, u8 *visible) const;
+    // Only the boxes in [first, end), both multiples of 8. The bounds have to be padded already.
+    u32 CullAABBs(const CullingBounds *bounds, u8 *visible, u32 first, u32 end) const;
+};
+
+#endif
@@ -0,0 +1,473 @@
+#include "GPUCulling.h"
+
+#include <bit>
+#include <algorithm>
+
+bool CullBuffer::Reserve(VkDeviceSize size, VkBufferUsageFlags usage) {
+    if (size <= this->size) {
+        return false;
+    }
+
+    VkDevice device = VulkanDevice::handle;
+
+    if (buffer) {
+        // Frames in flight and the frame being recorded may still read the old buffer and its slot
+        CullBuffer old = *this;
+        VulkanDevice::graphics_timeline.Defer([old]() mutable { old.Destroy(); });
+
+        buffer = VK_NULL_HANDLE;
+        descriptor = BindlessDescriptors::INVALID_INDEX;
+    }
+
+    VkDeviceSize new_size = this->size ? this->size : 1024;
+    while (new_size < size) {
+        new_size *= 2;
+    }
+
+    VkBufferCreateInfo buffer_info = { VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO };
+    buffer_info.size = new_size;
+    buffer_info.usage = usage;
+    buffer_info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+
+    VK_CHECK(vkCreateBuffer(device, &buffer_info, 0, &buffer));
+    allocation = VulkanAllocator::AllocateBuffer(buffer, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+
+    this->size = new_size;
+
+    // The old slot is only released with the old buffer, so no frame sees the slot change
+    descriptor = BindlessDescriptors::RegisterBuffer(Info());
+
+    return true;
+}
+
+void CullBuffer::Destroy() {
+    if (buffer) {
+        vkDestroyBuffer(VulkanDevice::handle, buffer, 0);
+        VulkanAllocator::Free(&allocation);
+    }
+
+    if (descriptor != BindlessDescriptors::INVALID_INDEX) {
+        BindlessDescriptors::ReleaseBuffer(descriptor);
+    }
+
+    buffer = VK_NULL_HANDLE;
+    descriptor = BindlessDescriptors::INVALID_INDEX;
+}
+
+VkDescriptorBufferInfo CullBuffer::Info() {
+    VkDescriptorBufferInfo info;
+    info.buffer = buffer;
+    info.offset = 0;
+    info.range = VK_WHOLE_SIZE;
+
+    return info;
+}
+
+void CreateComputePipeline(ComputePipeline *pipeline, const char *path, span<const VkDescriptorType> bindings, u32 push_constant_size) {
+    Shader shader;
+    shader.Create(path);
+
+    PipelineInfo pipeline_info;
+    pipeline_info.AddShader(VK_SHADER_STAGE_COMPUTE_BIT, &shader);
+    for (VkDescriptorType type : bindings) {
+        pipeline_info.AddBinding(VK_SHADER_STAGE_COMPUTE_BIT, type);
+    }
+    pipeline_info.AddPushConstant(VK_SHADER_STAGE_COMPUTE_BIT, push_constant_size);
+
+    pipeline->Create(&pipeline_info);
+
+    shader.Destroy();
+}
+
+void CullBarrier(VkCommandBuffer cmd_buf, VkPipelineStageFlags2 src_stage, VkAccessFlags2 src_access, VkPipelineStageFlags2 dst_stage, VkAccessFlags2 dst_access) {
+    VkMemoryBarrier2 memory_barrier = { VK_STRUCTURE_TYPE_MEMORY_BARRIER_2 };
+    memory_barrier.srcStageMask = src_stage;
+    memory_barrier.srcAccessMask = src_access;
+    memory_barrier.dstStageMask = dst_stage;
+    memory_barrier.dstAccessMask = dst_access;
+
+    VkDependencyInfo dependency_info = { VK_STRUCTURE_TYPE_DEPENDENCY_INFO };
+    dependency_info.memoryBarrierCount = 1;
+    dependency_info.pMemoryBarriers = &memory_barrier;
+
+    vkCmdPipelineBarrier2(cmd_buf, &dependency_info);
+}
+
+void ImageBarrier(VkCommandBuffer cmd_buf, VkImage image, VkImageAspectFlags aspect, VkImageLayout old_layout, VkImageLayout new_layout,
+                  VkPipelineStageFlags2 src_stage, VkAccessFlags2 src_access, VkPipelineStageFlags2 dst_stage, VkAccessFlags2 dst_access,
+                  u32 first_layer, u32 layer_count) {
+    VkImageMemoryBarrier2 image_barrier = { VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER_2 };
+    image_barrier.srcStageMask = src_stage;
+    image_barrier.srcAccessMask = src_access;
+    image_barrier.dstStageMask = dst_stage;
+    image_barrier.dstAccessMask = dst_access;
+    image_barrier.oldLayout = old_layout;
+    image_barrier.newLayout = new_layout;
+    image_barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    image_barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    image_barrier.image = image;
+    image_barrier.subresourceRange.aspectMask = aspect;
+    image_barrier.subresourceRange.levelCount = VK_REMAINING_MIP_LEVELS;
+    image_barrier.subresourceRange.baseArrayLayer = first_layer;
+    image_barrier.subresourceRange.layerCount = layer_count;
+
+    VkDependencyInfo dependency_info = { VK_STRUCTURE_TYPE_DEPENDENCY_INFO };
+    dependency_info.imageMemoryBarrierCount = 1;
+    dependency_info.pImageMemoryBarriers = &image_barrier;
+
+    vkCmdPipelineBarrier2(cmd_buf, &dependency_info);
+}
+
+void HiZPyramid::Create() {
+    const VkDescriptorType bindings[] = { VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, VK_DESCRIPTOR_TYPE_STORAGE_IMAGE };
+    CreateComputePipeline(&pipeline, "Engine/Assets/Shaders/hiz.comp.spv", bindings, sizeof(HiZConstants));
+
+    // Only read with texelFetch, filtering never happens
+    VkSamplerCreateInfo sampler_info = { VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO };
+    sampler_info.magFilter = VK_FILTER_NEAREST;
+    sampler_info.minFilter = VK_FILTER_NEAREST;
+    sampler_info.mipmapMode = VK_SAMPLER_MIPMAP_MODE_NEAREST;
+    sampler_info.addressModeU = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+    sampler_info.addressModeV = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+    sampler_info.addressModeW = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+    sampler_info.maxLod = VK_LOD_CLAMP_NONE;
+
+    VK_CHECK(vkCreateSampler(VulkanDevice::handle, &sampler_info, 0, &sampler));
+}
+
+void HiZPyramid::Destroy() {
+    VkDevice device = VulkanDevice::handle;
+
+    if (level_count) {
+        for (u32 i = 0; i < level_count; ++i) {
+            vkDestroyImageView(device, level_views[i], 0);
+        }
+        image.Destroy();
+    }
+
+    vkDestroySampler(device, sampler, 0);
+    pipeline.Destroy();
+}
+
+void HiZPyramid::Resize(u32 width, u32 height) {
+    if (width == depth_width && height == depth_height) {
+        return;
+    }
+
+    VkDevice device = VulkanDevice::handle;
+
+    if (level_count) {
+        // Only happens after a swapchain resize, the last frames may still read the old pyramid
+        array<VkImageView> old_views(level_views, level_views + level_count);
+        VulkanImage old_image = image;
+
+        VulkanDevice::graphics_timeline.Defer([old_views, old_image]() mutable {
+            for (VkImageView view : old_views) {
+                vkDestroyImageView(VulkanDevice::handle, view, 0);
+            }
+            old_image.Destroy();
+        });
+    }
+
+    depth_width = width;
+    depth_height = height;
+
+    // Powers of two so every mip is exactly half of the one above, rounding never drops a texel
+    u32 level_width = std::bit_ceil((width + 1) / 2);
+    u32 level_height = std::bit_ceil((height + 1) / 2);
+
+    level_count = std::min((u32) std::bit_width(std::max(level_width, level_height)), (u32) MAX_LEVELS);
+
+    image.Create(
+        VK_FORMAT_R32_SFLOAT, level_width, level_height, level_count,
+        VK_SAMPLE_COUNT_1_BIT, VK_IMAGE_USAGE_STORAGE_BIT | VK_IMAGE_USAGE_SAMPLED_BIT
+    );
+
+    for (u32 i = 0; i < level_count; ++i) {
+        VkImageViewCreateInfo view_info = { VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO };
+        view_info.image = image.handle;
+        view_info.viewType = VK_IMAGE_VIEW_TYPE_2D;
+        view_info.format = VK_FORMAT_R32_SFLOAT;
+        view_info.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+        view_info.subresourceRange.baseMipLevel = i;
+        view_info.subresourceRange.levelCount = 1;
+        view_info.subresourceRange.layerCount = 1;
+
+        VK_CHECK(vkCreateImageView(device, &view_info, 0, &level_views[i]));
+    }
+}
+
+void HiZPyramid::Build(VkCommandBuffer cmd_buf, VulkanSwapchain *swapchain) {
+    Resize(swapchain->extent.width, swapchain->extent.height);
+
+    ImageBarrier(cmd_buf, swapchain->depth_image.handle, VK_IMAGE_ASPECT_DEPTH_BIT,
+        VK_IMAGE_LAYOUT_DEPTH_ATTACHMENT_OPTIMAL, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
+        VK_PIPELINE_STAGE_2_LATE_FRAGMENT_TESTS_BIT, VK_ACCESS_2_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT,
+        VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT, VK_ACCESS_2_SHADER_SAMPLED_READ_BIT
+    );
+
+    // Every level is rewritten, the late phase of the previous frame may still be reading it
+    ImageBarrier(cmd_buf, image.handle, VK_IMAGE_ASPECT_COLOR_BIT,
+        VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_GENERAL,
+        VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT, VK_ACCESS_2_NONE,
+        VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT, VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT
+    );
+
+    vkCmdBindPipeline(cmd_buf, VK_PIPELINE_BIND_POINT_COMPUTE, pipeline.handle);
+
+    s32 src_width = (s32) depth_width;
+    s32 src_height = (s32) depth_height;
+    s32 level_width = (s32) std::bit_ceil((depth_width + 1) / 2);
+    s32 level_height = (s32) std::bit_ceil((depth_height + 1) / 2);
+
+    for (u32 i = 0; i < level_count; ++i) {
+        HiZConstants constants;
+        constants.src_width = src_width;
+        constants.src_height = src_height;
+        constants.dst_width = std::max(level_width >> i, 1);
+        constants.dst_height = std::max(level_height >> i, 1);
+
+        VkDescriptorImageInfo src_info;
+        src_info.sampler = sampler;
+        src_info.imageView = i == 0 ? swapchain->depth_image.view : level_views[i - 1];
+        src_info.imageLayout = i == 0 ? VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL : VK_IMAGE_LAYOUT_GENERAL;
+
+        VkDescriptorImageInfo dst_info;
+        dst_info.sampler = VK_NULL_HANDLE;
+        dst_info.imageView = level_views[i];
+        dst_info.imageLayout = VK_IMAGE_LAYOUT_GENERAL;
+
+        VkWriteDescriptorSet write_descriptors[2] = {};
+        write_descriptors[0].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+        write_descriptors[0].dstBinding = 0;
+        write_descriptors[0].descriptorCount = 1;
+        write_descriptors[0].descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+        write_descriptors[0].pImageInfo = &src_info;
+        write_descriptors[1].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+        write_descriptors[1].dstBinding = 1;
+        write_descriptors[1].descriptorCount = 1;
+        write_descriptors[1].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE;
+        write_descriptors[1].pImageInfo = &dst_info;
+
+        vkCmdPushDescriptorSetFunc(cmd_buf, VK_PIPELINE_BIND_POINT_COMPUTE, pipeline.layout, 0, ARRAY_SIZE(write_descriptors), write_descriptors);
+        vkCmdPushConstants(cmd_buf, pipeline.layout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(HiZConstants), &constants);
+        vkCmdDispatch(cmd_buf, (constants.dst_width + GROUP_SIZE - 1) / GROUP_SIZE, (constants.dst_height + GROUP_SIZE - 1) / GROUP_SIZE, 1);
+
+        // The next level and the late culling phase read this one
+        CullBarrier(cmd_buf,
+            VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT, VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT,
+            VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT, VK_ACCESS_2_SHADER_SAMPLED_READ_BIT
+        );
+
+        src_width = constants.dst_width;
+        src_height = constants.dst_height;
+    }
+
+    ImageBarrier(cmd_buf, swapchain->depth_image.handle, VK_IMAGE_ASPECT_DEPTH_BIT,
+        VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL, VK_IMAGE_LAYOUT_DEPTH_ATTACHMENT_OPTIMAL,
+        VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT, VK_ACCESS_2_NONE,
+        VK_PIPELINE_STAGE_2_EARLY_FRAGMENT_TESTS_BIT | VK_PIPELINE_STAGE_2_LATE_FRAGMENT_TESTS_BIT,
+        VK_ACCESS_2_DEPTH_STENCIL_ATTACHMENT_READ_BIT | VK_ACCESS_2_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT
+    );
+}
+
+VkDescriptorImageInfo HiZPyramid::Info() {
+    VkDescriptorImageInfo info;
+    info.sampler = sampler;
+    info.imageView = image.view;
+    info.imageLayout = VK_IMAGE_LAYOUT_GENERAL;
+
+    return info;
+}
+
+void GPUCuller::Create(VulkanSwapchain *swapchain, u32 frame_count) {
+    this->swapchain = swapchain;
+    this->frame_count = frame_count;
+
+    // 0 instance matrices, 1 instance infos, 2 batches, 3 visible instances, 4 visible counts,
+    // 5 visibility history, 6 constants, 7 stats, 8 depth pyramid
+    const VkDescriptorType cull_bindings[] = {
+        VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+        VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+        VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER
+    };
+    const VkDescriptorType compact_bindings[] = {
+        VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+        VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER
+    };
+
+    CreateComputePipeline(&cull_pipeline, "Engine/Assets/Shaders/cull.comp.spv", cull_bindings, sizeof(CullPhaseConstants));
+    CreateComputePipeline(&compact_pipeline, "Engine/Assets/Shaders/compact.comp.spv", compact_bindings, sizeof(CompactConstants));
+
+    hiz.Create();
+
+    VkBufferCreateInfo buffer_info = { VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO };
+    buffer_info.size = frame_count * sizeof(OcclusionStats);
+    buffer_info.usage = VK_BUFFER_USAGE_STORAGE_BUFFER_BIT;
+    buffer_info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+
+    VK_CHECK(vkCreateBuffer(VulkanDevice::handle, &buffer_info, 0, &stats_buffer));
+    stats_allocation = VulkanAllocator::AllocateBuffer(stats_buffer, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
+
+    memset(stats_allocation.mapped, 0, buffer_info.size);
+}
+
+void GPUCuller::Destroy() {
+    visible_instances.Destroy();
+    visible_counts.Destroy();
+    draw_commands.Destroy();
+    draw_materials.Destroy();
+    draw_count.Destroy();
+    visibility_history.Destroy();
+
+    vkDestroyBuffer(VulkanDevice::handle, stats_buffer, 0);
+    VulkanAllocator::Free(&stats_allocation);
+
+    hiz.Destroy();
+
+    cull_pipeline.Destroy();
+    compact_pipeline.Destroy();
+}
+
+void GPUCuller::ReadStats(u32 frame) {
+    OcclusionStats *stats = (OcclusionStats *) stats_allocation.mapped + frame;
+
+    RenderStats::CountOcclusion(stats->early, stats->late, stats->occluded);
+
+    // Frames without culling never touch their counters
+    memset(stats, 0, sizeof(OcclusionStats));
+}
+
+void PushStorageBuffers(VkCommandBuffer cmd_buf, VkPipelineLayout layout, VkDescriptorBufferInfo *infos, u32 count, const VkWriteDescriptorSet *extra) {
+    VkWriteDescriptorSet write_descriptors[16] = {};
+
+    for (u32 i = 0; i < count; ++i) {
+        write_descriptors[i].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+        write_descriptors[i].dstBinding = i;
+        write_descriptors[i].descriptorCount = 1;
+        write_descriptors[i].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+        write_descriptors[i].pBufferInfo = &infos[i];
+    }
+
+    u32 write_count = count;
+    if (extra) {
+        write_descriptors[write_count++] = *extra;
+    }
+
+    vkCmdPushDescriptorSetFunc(cmd_buf, VK_PIPELINE_BIND_POINT_COMPUTE, layout, 0, write_count, write_descriptors);
+}
+
+void GPUCuller::Cull(VkCommandBuffer cmd_buf, CullInput *input) {
+    Prepare(cmd_buf, input);
+
+    RunPhase(cmd_buf, input, CULL_PHASE_FRUSTUM);
+}
+
+void GPUCuller::CullEarly(VkCommandBuffer cmd_buf, CullInput *input) {
+    Prepare(cmd_buf, input);
+
+    RunPhase(cmd_buf, input, CULL_PHASE_EARLY);
+}
+
+void GPUCuller::Prepare(VkCommandBuffer cmd_buf, CullInput *input) {
+    visible_instances.Reserve((VkDeviceSize) input->instance_count * sizeof(u32), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT);
+    visible_counts.Reserve((VkDeviceSize) input->batch_count * sizeof(u32), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT);
+    draw_commands.Reserve((VkDeviceSize) input->slot_count * sizeof(VkDrawIndexedIndirectCommand), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT);
+    draw_materials.Reserve((VkDeviceSize) input->slot_count * sizeof(u32), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT);
+    draw_count.Reserve((VkDeviceSize) input->chunk_count * sizeof(u32), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT);
+
+    // The previous frame may still be drawing from the outputs, its late phase wrote the history
+    CullBarrier(cmd_buf,
+        VK_PIPELINE_STAGE_2_DRAW_INDIRECT_BIT | VK_PIPELINE_STAGE_2_VERTEX_SHADER_BIT | VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT, VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT,
+        VK_PIPELINE_STAGE_2_CLEAR_BIT | VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT, VK_ACCESS_2_TRANSFER_WRITE_BIT | VK_ACCESS_2_SHADER_STORAGE_READ_BIT
+    );
+
+    // Both phases bind the pyramid, it can only be recreated before anything refers to it
+    hiz.Resize(swapchain->extent.width, swapchain->extent.height);
+
+    // A new history says nothing was visible, the late phase then draws everything that passes
+    if (visibility_history.Reserve((VkDeviceSize) input->history_count * sizeof(u32), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT)) {
+        vkCmdFillBuffer(cmd_buf, visibility_history.buffer, 0, VK_WHOLE_SIZE, 0);
+    }
+}
+
+void GPUCuller::BuildHiZ(VkCommandBuffer cmd_buf) {
+    hiz.Build(cmd_buf, swapchain);
+}
+
+void GPUCuller::CullLate(VkCommandBuffer cmd_buf, CullInput *input) {
+    // The early draws read the outputs that are about to be rewritten
+    CullBarrier(cmd_buf,
+        VK_PIPELINE_STAGE_2_DRAW_INDIRECT_BIT | VK_PIPELINE_STAGE_2_VERTEX_SHADER_BIT, VK_ACCESS_2_NONE,
+        VK_PIPELINE_STAGE_2_CLEAR_BIT | VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT, VK_ACCESS_2_NONE
+    );
+
+    RunPhase(cmd_buf, input, CULL_PHASE_LATE);
+
+    // Counters are read by ReadStats once the frame's fence is signaled
+    CullBarrier(cmd_buf,
+        VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT, VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT,
+        VK_PIPELINE_STAGE_2_HOST_BIT, VK_ACCESS_2_HOST_READ_BIT
+    );
+}
+
+void GPUCuller::RunPhase(VkCommandBuffer cmd_buf, CullInput *input, CullPhase phase) {
+    vkCmdFillBuffer(cmd_buf, visible_counts.buffer, 0, (VkDeviceSize) input->batch_count * sizeof(u32), 0);
+
+    CullBarrier(cmd_buf,
+        VK_PIPELINE_STAGE_2_CLEAR_BIT, VK_ACCESS_2_TRANSFER_WRITE_BIT,
+        VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT, VK_ACCESS_2_SHADER_STORAGE_READ_BIT | VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT
+    );
+
+    CullPhaseConstants cull_constants;
+    cull_constants.phase = phase;
+
+    VkDescriptorBufferInfo cull_buffers[8] = {
+        input->instances, input->instance_infos, input->batches, visible_instances.Info(), visible_counts.Info(),
+        visibility_history.Info(), input->constants, { stats_buffer, 0, VK_WHOLE_SIZE }
+    };
+
+    VkDescriptorImageInfo hiz_info = hiz.Info();
+
+    VkWriteDescriptorSet hiz_write = { VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET };
+    hiz_write.dstBinding = ARRAY_SIZE(cull_buffers);
+    hiz_write.descriptorCount = 1;
+    hiz_write.descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+    hiz_write.pImageInfo = &hiz_info;
+
+    vkCmdBindPipeline(cmd_buf, VK_PIPELINE_BIND_POINT_COMPUTE, cull_pipeline.handle);
+    PushStorageBuffers(cmd_buf, cull_pipeline.layout, cull_buffers, ARRAY_SIZE(cull_buffers), &hiz_write);
+    vkCmdPushConstants(cmd_buf, cull_pipeline.layout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(CullPhaseConstants), &cull_constants);
+    vkCmdDispatch(cmd_buf, (input->instance_count + CULL_GROUP_SIZE - 1) / CULL_GROUP_SIZE, 1, 1);
+
+    CullBarrier(cmd_buf,
+        VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT, VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT,
+        VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT, VK_ACCESS_2_SHADER_STORAGE_READ_BIT
+    );
+
+    CompactConstants compact_constants;
+    compact_constants.slot_count = input->slot_count;
+    compact_constants.chunk_size = input->chunk_size;
+
+    VkDescriptorBufferInfo compact_buffers[5] = { visible_counts.Info(), input->slots, draw_commands.Info(), draw_materials.Info(), draw_count.Info() };
+
+    vkCmdBindPipeline(cmd_buf, VK_PIPELINE_BIND_POINT_COMPUTE, compact_pipeline.handle);
+    PushStorageBuffers(cmd_buf, compact_pipeline.layout, compact_buffers, ARRAY_SIZE(compact_buffers));
+    vkCmdPushConstants(cmd_buf, compact_pipeline.layout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(CompactConstants), &compact_constants);
+    vkCmdDispatch(cmd_buf, input->chunk_count, 1, 1);
+
+    CullBarrier(cmd_buf,
+        VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT, VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT,
+        VK_PIPELINE_STAGE_2_DRAW_INDIRECT_BIT | VK_PIPELINE_STAGE_2_VERTEX_SHADER_BIT, VK_ACCESS_2_INDIRECT_COMMAND_READ_BIT | VK_ACCESS_2_SHADER_STORAGE_READ_BIT
+    );
+}
+
+void GPUCuller::Draw(VkCommandBuffer cmd_buf, CullInput *input, u32 chunk) {
+    u32 first_slot = chunk * input->chunk_size;
+    u32 slot_count = std::min(input->chunk_size, input->slot_count - first_slot);
+
+    VkDeviceSize command_offset = (VkDeviceSize) first_slot * sizeof(VkDrawIndexedIndirectCommand);
+    VkDeviceSize count_offset = (VkDeviceSize) chunk * sizeof(u32);
+
+    vkCmdDrawIndexedIndirectCount(cmd_buf, draw_commands.buffer, command_offset, draw_count.buffer, count_offset, slot_count, sizeof(VkDrawIndexedIndirectCommand));
+}
@@ -0,0 +1,218 @@
+#ifndef GPU_CULLING_H
+#define GPU_CULLING_H
+
+#include "Common.h"
+#include "Vulkan/VulkanRenderer.h"
+#include "Graphics/Frustum.h"
+
+// Structs below mirror the std430 layouts in cull.comp, compact.comp and hiz.comp
+
+// All instances of one model
+struct CullBatch {
+    // Model space, xyz center, w radius
+    glm::vec4 bounding_sphere;
+    // Model space box, w unused
+    glm::vec4 bounds_min;
+    glm::vec4 bounds_max;
+    u32 first_instance;
+    u32 instance_count;
+    u32 _padding[2];
+};
+
+struct CullInstance {
+    u32 batch;
+    // Entry in the visibility history, the position of the instance among all instances
+    // submitted this frame, so it stays the same as long as the game submits in the same order
+    u32 history;
+};
+
+// One mesh of one batch, becomes a VkDrawIndexedIndirectCommand if any instance of the batch is visible
+struct DrawSlot {
+    u32 index_count;
+    u32 first_index;
+    s32 vertex_offset;
+    u32 material_index;
+    u32 batch;
+    u32 first_instance;
+    u32 _padding[2];
+};
+
+// Too large for push constants, lives in the frame allocator
+struct CullConstants {
+    glm::vec4 frustum_planes[6];
+    glm::mat4 view_projection;
+    u32 instance_count;
+    u32 frame;
+    u32 depth_width;
+    u32 depth_height;
+};
+
+enum CullPhase {
+    // Instances that were visible last frame, they are drawn first and become the occluders
+    CULL_PHASE_EARLY,
+    // Everything, tested against the depth pyramid of the early draws
+    CULL_PHASE_LATE,
+    // Frustum only, a single pass without occlusion culling
+    CULL_PHASE_FRUSTUM
+};
+
+struct CullPhaseConstants {
+    u32 phase;
+};
+
+struct CompactConstants {
+    u32 slot_count;
+    u32 chunk_size;
+};
+
+struct HiZConstants {
+    s32 src_width;
+    s32 src_height;
+    s32 dst_width;
+    s32 dst_height;
+};
+
+// Written by cull.comp, one per frame in flight
+struct OcclusionStats {
+    u32 early;
+    u32 late;
+    u32 occluded;
+    u32 _padding;
+};
+
+// Everything the culling passes read, written to the frame allocator by the SceneRenderer
+struct CullInput {
+    VkDescriptorBufferInfo constants;
+    VkDescriptorBufferInfo instances;
+    VkDescriptorBufferInfo instance_infos;
+    VkDescriptorBufferInfo batches;
+    VkDescriptorBufferInfo slots;
+    u32 instance_count;
+    u32 batch_count;
+    u32 slot_count;
+    // Instances submitted before CPU culling, the size of the visibility history
+    u32 history_count;
+    // The slots are split into chunks of chunk_size, each gets its own indirect draw so
+    // they can be recorded on different threads
+    u32 chunk_count;
+    u32 chunk_size;
+};
+
+// Device local buffer the culling shaders write, grows on demand
+struct CullBuffer {
+    VkBuffer buffer = VK_NULL_HANDLE;
+    VulkanAllocation allocation;
+    VkDeviceSize size = 0;
+    // Slot in BindlessDescriptors, may change when the buffer grows
+    u32 descriptor = BindlessDescriptors::INVALID_INDEX;
+
+    // Returns true if a new buffer was created, its contents are undefined
+    bool Reserve(VkDeviceSize size, VkBufferUsageFlags usage);
+    void Destroy();
+
+    VkDescriptorBufferInfo Info();
+};
+
+// Helpers shared by the compute passes. Compute pipelines use push descriptors, binding i
+// is bindings[i] and the push constants are visible to the compute stage only.
+void CreateComputePipeline(ComputePipeline *pipeline, const char *path, span<const VkDescriptorType> bindings, u32 push_constant_size);
+void CullBarrier(VkCommandBuffer cmd_buf, VkPipelineStageFlags2 src_stage, VkAccessFlags2 src_access, VkPipelineStageFlags2 dst_stage, VkAccessFlags2 dst_access);
+// All mip levels, layer_count layers from first_layer
+void ImageBarrier(VkCommandBuffer cmd_buf, VkImage image, VkImageAspectFlags aspect, VkImageLayout old_layout, VkImageLayout new_layout,
+                  VkPipelineStageFlags2 src_stage, VkAccessFlags2 src_access, VkPipelineStageFlags2 dst_stage, VkAccessFlags2 dst_access,
+                  u32 first_layer=0, u32 layer_count=VK_REMAINING_ARRAY_LAYERS);
+// Storage buffers to bindings 0 to count - 1, extra is pushed after them for bindings that are not storage buffers
+void PushStorageBuffers(VkCommandBuffer cmd_buf, VkPipelineLayout layout, VkDescriptorBufferInfo *infos, u32 count, const VkWriteDescriptorSet *extra=0);
+
+// Max depth mip chain of the depth attachment. Level 0 is half the resolution of the
+// depth rounded up to a power of two, every texel holds the farthest depth of the 2x2
+// texels below it. Texels past the edge repeat the last row and column.
+struct HiZPyramid {
+    static const u32 MAX_LEVELS = 16;
+    static const u32 GROUP_SIZE = 8;
+
+    VulkanImage image = {};
+    VkImageView level_views[MAX_LEVELS] = {};
+    VkSampler sampler = VK_NULL_HANDLE;
+    ComputePipeline pipeline;
+
+    u32 depth_width = 0;
+    u32 depth_height = 0;
+    u32 level_count = 0;
+
+    void Create();
+    void Destroy();
+
+    // Recreates the pyramid if the depth attachment changed size, must not be called
+    // while a command buffer that is being recorded refers to the old one
+    void Resize(u32 width, u32 height);
+
+    // Reads swapchain->depth_image, which has to be the size of the last Resize. Has to be
+    // called outside of dynamic rendering, the depth is back in DEPTH_ATTACHMENT_OPTIMAL afterwards.
+    void Build(VkCommandBuffer cmd_buf, VulkanSwapchain *swapchain);
+
+    VkDescriptorImageInfo Info();
+};
+
+// GPU driven draw submission. Per frame the CPU only writes the instance matrices and one
+// record per model and per mesh, the GPU does the rest:
+//
+//   cull.comp     one thread per instance, tests its bounds against the frustum and the
+//                 depth pyramid and appends visible instances to the range of their batch
+//   compact.comp  one workgroup per chunk of draw slots, walks them in order and writes an
+//                 indirect command for every slot with visible instances, plus the chunk's count
+//   hiz.comp      one dispatch per pyramid level
+//
+// Occlusion culling runs in two phases. The early phase draws what was visible last frame,
+// the pyramid is built from that depth, and the late phase tests every instance against it:
+// newly visible instances are drawn on top and the visibility history is updated for the
+// next frame. Each phase is one vkCmdDrawIndexedIndirectCount per chunk, the compaction keeps
+// the slot order within a chunk and the chunks are drawn in order, so the front to back
+// order of the render queue survives.
+struct GPUCuller {
+    static const u32 CULL_GROUP_SIZE = 64;
+
+    ComputePipeline cull_pipeline;
+    ComputePipeline compact_pipeline;
+    HiZPyramid hiz;
+
+    // Indices into the instance matrices, in batch ranges, read with gl_InstanceIndex
+    CullBuffer visible_instances;
+    CullBuffer visible_counts;
+    CullBuffer draw_commands;
+    // Material of every written command, read with gl_DrawID and the chunk's first slot
+    CullBuffer draw_materials;
+    // One count per chunk
+    CullBuffer draw_count;
+    // One u32 per instance, non zero if it passed the late phase of the last frame
+    CullBuffer visibility_history;
+
+    // Host visible, one OcclusionStats per frame in flight
+    VkBuffer stats_buffer = VK_NULL_HANDLE;
+    VulkanAllocation stats_allocation;
+    u32 frame_count = 0;
+
+    VulkanSwapchain *swapchain = 0;
+
+    void Create(VulkanSwapchain *swapchain, u32 frame_count);
+    void Destroy();
+
+    // Hands the statistics of the last use of this frame to RenderStats, the frame's
+    // fence has to be signaled
+    void ReadStats(u32 frame);
+
+    // All of these have to be called outside of dynamic rendering. Either Cull alone, or
+    // CullEarly, BuildHiZ and CullLate with a draw after each of the culling passes.
+    void Cull(VkCommandBuffer cmd_buf, CullInput *input);
+    void CullEarly(VkCommandBuffer cmd_buf, CullInput *input);
+    void BuildHiZ(VkCommandBuffer cmd_buf);
+    void CullLate(VkCommandBuffer cmd_buf, CullInput *input);
+
+    // Commands of one chunk, can be recorded into a secondary on any thread
+    void Draw(VkCommandBuffer cmd_buf, CullInput *input, u32 chunk);
+
+    void Prepare(VkCommandBuffer cmd_buf, CullInput *input);
+    void RunPhase(VkCommandBuffer cmd_buf, CullInput *input, CullPhase phase);
+};
+
+#endif
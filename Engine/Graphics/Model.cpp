@@ -1,28 +1,94 @@
 #include "Model.h"
 
+#include <float.h>
+#include <algorithm>
+
 #include "assimp/Importer.hpp"
 #include "assimp/scene.h"
 #include "assimp/postprocess.h"
 
 #include "Common.h"
 
+static u32 next_model_id = 0;
+
 Model::Model() {
+    id = next_model_id++;
 }
 
 Model::~Model() {
 	for (Mesh *mesh : meshes) {
-        mesh->vertices_buffer->Destroy();
-		mesh->index_buffer->Destroy();
-		delete mesh->vertices_buffer;
-		delete mesh->index_buffer;
+        GeometryArena::Free(&mesh->geometry);
         delete mesh;
 	}
 
-	materials_buffer->Destroy();
-	delete materials_buffer;
+	if (material_range) {
+		MaterialTable::Free(material_range);
+	}
+}
+
+StorageBuffer MaterialTable::buffer;
+TLSFAllocator MaterialTable::tlsf;
+u32 MaterialTable::descriptor = BindlessDescriptors::INVALID_INDEX;
+
+void MaterialTable::Create() {
+    buffer.Create(CAPACITY * sizeof(Material), BUFFER_STATIC);
+    tlsf.Create(CAPACITY);
+
+    descriptor = BindlessDescriptors::RegisterBuffer({ buffer.buffer, 0, VK_WHOLE_SIZE });
+}
+
+void MaterialTable::Destroy() {
+    BindlessDescriptors::ReleaseBuffer(descriptor);
+
+    tlsf.Destroy();
+    buffer.Destroy();
+}
+
+TLSFBlock *MaterialTable::Allocate(Material *materials, u32 count) {
+    TLSFBlock *range = tlsf.Allocate(count, 1);
+    if (!range) {
+        LogFatal("Material table is full (%d materials)", CAPACITY);
+    }
+
+    VkDeviceSize offset = range->offset * sizeof(Material);
+    VkDeviceSize size = count * sizeof(Material);
+
+    if (buffer.mapped) {
+        memcpy((u8 *) buffer.mapped + offset, materials, size);
+    } else {
+        VulkanUploader::UploadBuffer(buffer.buffer, offset, materials, size);
+    }
+
+    return range;
+}
+
+void MaterialTable::Free(TLSFBlock *range) {
+    tlsf.Free(range);
 }
 
-Model *ModelImporter::Load(const char *path, VkCommandPool command_pool) {
+struct OccluderTriangle {
+    f32 area;
+    glm::vec3 vertices[3];
+};
+
+// Keeps the largest triangles, they hide the most per rasterized triangle
+static void BuildOccluderMesh(OccluderMesh *occluder_mesh, array<OccluderTriangle> *triangles) {
+    u64 count = std::min((u64) triangles->size(), (u64) OccluderMesh::MAX_TRIANGLES);
+
+    std::partial_sort(triangles->begin(), triangles->begin() + count, triangles->end(), [](const OccluderTriangle &a, const OccluderTriangle &b) {
+        return a.area > b.area;
+    });
+
+    occluder_mesh->vertices.resize(count * 3);
+    for (u64 i = 0; i < count; ++i) {
+        OccluderTriangle *triangle = &(*triangles)[i];
+        occluder_mesh->vertices[i * 3 + 0] = triangle->vertices[0];
+        occluder_mesh->vertices[i * 3 + 1] = triangle->vertices[1];
+        occluder_mesh->vertices[i * 3 + 2] = triangle->vertices[2];
+    }
+}
+
+Model *ModelImporter::Load(const char *path, MaterialShading shading) {
     Assimp::Importer importer;
 
 	const u32 import_flags =
@@ -51,6 +117,7 @@ Model *ModelImporter::Load(const char *path, VkCommandPool command_pool) {
             aiMaterial *aiMat = scene->mMaterials[i];
             
             Material *mat = &materials[i];
+            mat->shading = shading;
 
             aiColor3D ambient, diffuse, specular;
             if (aiMat->Get(AI_MATKEY_COLOR_AMBIENT, ambient) == AI_SUCCESS) {
@@ -64,12 +131,18 @@ Model *ModelImporter::Load(const char *path, VkCommandPool command_pool) {
             }
         }
 
-		model->materials_buffer = new StorageBuffer();
-		model->materials_buffer->Create(materials, scene->mNumMaterials * sizeof(Material));
+		model->material_range = MaterialTable::Allocate(materials, scene->mNumMaterials);
 
 		delete[] materials;
     }
 
+    u32 first_material = model->material_range ? (u32) model->material_range->offset : 0;
+
+    glm::vec3 bounds_min = glm::vec3(FLT_MAX);
+    glm::vec3 bounds_max = glm::vec3(-FLT_MAX);
+
+    array<OccluderTriangle> occluder_triangles;
+
     model->meshes.resize(scene->mNumMeshes);
 	for (int i = 0; i < scene->mNumMeshes; ++i) {
 		aiMesh *ai_mesh = scene->mMeshes[i];
@@ -80,6 +153,9 @@ Model *ModelImporter::Load(const char *path, VkCommandPool command_pool) {
 		u32 num_indices = ai_mesh->mNumFaces * 3;
 		u32 *indices = new u32[num_indices];
 
+		glm::vec3 mesh_min = glm::vec3(FLT_MAX);
+		glm::vec3 mesh_max = glm::vec3(-FLT_MAX);
+
 		aiVector3D zero_vector(0.0f);
 		for (u32 i = 0; i < ai_mesh->mNumVertices; ++i) {
 			aiVector3D pos = ai_mesh->mVertices[i];
@@ -88,6 +164,9 @@ Model *ModelImporter::Load(const char *path, VkCommandPool command_pool) {
 
             Vertex *vertex = &vertices[i];
             vertex->position = glm::vec<3, f32>(pos.x, pos.y, pos.z);
+
+            mesh_min = glm::min(mesh_min, vertex->position);
+            mesh_max = glm::max(mesh_max, vertex->position);
             vertex->normal = glm::vec<4, u8>(
                 normal.x * 127.0f + 127.0f,
                 normal.y * 127.0f + 127.0f,
@@ -102,23 +181,49 @@ Model *ModelImporter::Load(const char *path, VkCommandPool command_pool) {
 			indices[i * 3 + 0] = face.mIndices[0];
 			indices[i * 3 + 1] = face.mIndices[1];
 			indices[i * 3 + 2] = face.mIndices[2];
+
+            OccluderTriangle triangle;
+            triangle.vertices[0] = vertices[indices[i * 3 + 0]].position;
+            triangle.vertices[1] = vertices[indices[i * 3 + 1]].position;
+            triangle.vertices[2] = vertices[indices[i * 3 + 2]].position;
+            triangle.area = glm::length(glm::cross(triangle.vertices[1] - triangle.vertices[0], triangle.vertices[2] - triangle.vertices[0]));
+            occluder_triangles.push_back(triangle);
+		}
+
+		if (!vertices_count) {
+			mesh_min = mesh_max = glm::vec3(0.0f);
 		}
 
-        StorageBuffer *storage_buffer = new StorageBuffer();
-        storage_buffer->Create((void *) &vertices[0], ai_mesh->mNumVertices * sizeof(Vertex));
+		bounds_min = glm::min(bounds_min, mesh_min);
+		bounds_max = glm::max(bounds_max, mesh_max);
 
-        IndexBuffer *index_buffer = new IndexBuffer();
-        index_buffer->Create((u32 *) &indices[0], num_indices, command_pool);
-		
 		Mesh *mesh = new Mesh;
-		mesh->material_index	= ai_mesh->mMaterialIndex;
-		mesh->vertices_buffer   = storage_buffer;
-		mesh->index_buffer		= index_buffer;
+		mesh->material_index	= first_material + ai_mesh->mMaterialIndex;
+		mesh->bounds_min		= mesh_min;
+		mesh->bounds_max		= mesh_max;
+		mesh->bounding_sphere	= glm::vec4((mesh_min + mesh_max) * 0.5f, glm::length(mesh_max - mesh_min) * 0.5f);
 		model->meshes[i]		= mesh;
 
+        GeometryArena::Allocate(&mesh->geometry, vertices, vertices_count, indices, num_indices);
+
 		delete[] vertices;
 		delete[] indices;
 	}
 
+    if (bounds_min.x > bounds_max.x) {
+        bounds_min = bounds_max = glm::vec3(0.0f);
+    }
+
+    // The sphere around the box is not the tightest one but it is cheap and conservative
+    model->bounds_min = bounds_min;
+    model->bounds_max = bounds_max;
+    model->bounding_sphere = glm::vec4((bounds_min + bounds_max) * 0.5f, glm::length(bounds_max - bounds_min) * 0.5f);
+
+    BuildOccluderMesh(&model->occluder_mesh, &occluder_triangles);
+
+    // One submission for all meshes and nothing waits on it. The model is skipped by the
+    // renderer until the upload has been handed to the graphics queue.
+    model->upload_ticket = VulkanUploader::Flush();
+
     return model;
 }
\ No newline at end of file
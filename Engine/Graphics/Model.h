@@ -18,13 +18,8 @@ struct PointLight {
     glm::vec4 ambient;
     glm::vec4 diffuse;
     glm::vec3 pos;
-    f32 _padding;
-};
-
-struct PointLights {
-    u32 count;
-    glm::vec3 _padding;
-    PointLight lights[10];
+    // The light fades out towards it and does not reach further
+    f32 radius;
 };
 
 struct Transformation {
@@ -33,36 +28,86 @@ struct Transformation {
     glm::mat4 model;
 };
 
+// Where a material is lit, has to match simple.vert and simple.frag
+enum MaterialShading : u32 {
+    SHADING_PER_PIXEL,
+    // Gouraud shading, cheaper and good enough for low poly assets. Only the shadow is
+    // still sampled per fragment.
+    SHADING_PER_VERTEX
+};
+
 struct Material {
     glm::vec4 ambient;
     glm::vec4 diffuse;
     glm::vec4 specular;
     f32 shininess;
-    glm::vec3 _padding;
+    MaterialShading shading = SHADING_PER_PIXEL;
+    glm::vec2 _padding;
 };
 
+// Vertices and indices live in GeometryArena, a mesh only knows where
 struct Mesh {
-    StorageBuffer *vertices_buffer = 0;
-    IndexBuffer *index_buffer = 0;
+    GeometryAllocation geometry;
     u32 material_index = 0;
+    // Model space
+    glm::vec3 bounds_min;
+    glm::vec3 bounds_max;
+    glm::vec4 bounding_sphere;
 };
 
-struct MeshData {
-    glm::mat4 model_matrix;
-    u32 material_index;
+// Materials of all models in one storage buffer, so a single indirect draw can
+// reach any of them. Mesh::material_index indexes this table directly.
+struct MaterialTable {
+    static const u32 CAPACITY = 16 * 1024;
+
+    static StorageBuffer buffer;
+    static TLSFAllocator tlsf;
+    // Slot in BindlessDescriptors
+    static u32 descriptor;
+
+    static void Create();
+    static void Destroy();
+
+    static TLSFBlock *Allocate(Material *materials, u32 count);
+    static void Free(TLSFBlock *range);
+};
+
+// CPU copy of the largest triangles of a model, rasterized by the software occlusion
+// culling. A subset of the real surface, so it can never hide more than the model does.
+struct OccluderMesh {
+    static const u32 MAX_TRIANGLES = 256;
+
+    // Model space, three per triangle
+    array<glm::vec3> vertices;
 };
 
 struct Model {
-    StorageBuffer *materials_buffer = 0;
+    // Unique per model, part of the render queue sort key
+    u32 id;
+    TLSFBlock *material_range = 0;
+    // Bounds of all meshes in model space
+    glm::vec3 bounds_min;
+    glm::vec3 bounds_max;
+    // xyz center, w radius
+    glm::vec4 bounding_sphere;
 	array<Mesh *> meshes;
+    // Rasterized into the OcclusionBuffer before other instances are tested, set for large
+    // closed models such as walls
+    bool occluder = false;
+    OccluderMesh occluder_mesh;
+    // Set for models that move, their shadows are drawn every frame instead of being cached
+    bool dynamic = false;
     glm::mat4 transformation;
+    // Mesh data may still be streaming in, see VulkanUploader::IsReady
+    u64 upload_ticket = 0;
 
 	Model();
 	~Model();
 };
 
 struct ModelImporter {
-    static Model *Load(const char *path, VkCommandPool command_pool);
+    // Every material of the model is lit with the given shading
+    static Model *Load(const char *path, MaterialShading shading=SHADING_PER_PIXEL);
 };
 
 #endif
\ No newline at end of file
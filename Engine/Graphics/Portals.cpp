@@ -0,0 +1,188 @@
+#include "Portals.h"
+
+#include <float.h>
+#include <algorithm>
+
+// Corners closer than this to the camera plane are not projected
+static const f32 MIN_W = 1e-4f;
+
+u32 CellGraph::AddCell(glm::vec3 bounds_min, glm::vec3 bounds_max) {
+    Cell cell;
+    cell.bounds_min = bounds_min;
+    cell.bounds_max = bounds_max;
+
+    cells.push_back(cell);
+
+    return (u32) cells.size() - 1;
+}
+
+u32 CellGraph::AddPortal(u32 cell_a, u32 cell_b, const glm::vec3 corners[4]) {
+    u32 index = (u32) portals.size();
+
+    Portal portal;
+    memcpy(portal.corners, corners, sizeof(portal.corners));
+    portal.cells[0] = cell_a;
+    portal.cells[1] = cell_b;
+
+    portals.push_back(portal);
+
+    cells[cell_a].portals.push_back(index);
+    cells[cell_b].portals.push_back(index);
+
+    return index;
+}
+
+u32 CellGraph::AddPortal(u32 cell_a, u32 cell_b, const glm::mat4 &transform, glm::vec3 bounds_min, glm::vec3 bounds_max) {
+    glm::vec3 center = (bounds_min + bounds_max) * 0.5f;
+    glm::vec3 extent = (bounds_max - bounds_min) * 0.5f;
+
+    u32 thin = 0;
+    if (extent.y < extent[thin]) thin = 1;
+    if (extent.z < extent[thin]) thin = 2;
+
+    u32 u = (thin + 1) % 3;
+    u32 v = (thin + 2) % 3;
+
+    glm::vec3 corners[4];
+    for (u32 i = 0; i < 4; ++i) {
+        glm::vec3 corner = center;
+        corner[u] += (i == 1 || i == 2) ? extent[u] : -extent[u];
+        corner[v] += (i >= 2) ? extent[v] : -extent[v];
+
+        corners[i] = glm::vec3(transform * glm::vec4(corner, 1.0f));
+    }
+
+    return AddPortal(cell_a, cell_b, corners);
+}
+
+void CellGraph::SetPortalOpen(u32 portal, bool open) {
+    portals[portal].open = open;
+}
+
+s32 CellGraph::FindCell(glm::vec3 position) const {
+    for (u32 i = 0; i < cells.size(); ++i) {
+        const Cell *cell = &cells[i];
+        if (glm::all(glm::greaterThanEqual(position, cell->bounds_min)) && glm::all(glm::lessThanEqual(position, cell->bounds_max))) {
+            return (s32) i;
+        }
+    }
+
+    return -1;
+}
+
+// Frustum of the part of the screen inside rect. The rectangle is mapped to the full
+// [-1, 1] range in clip space, so the plane extraction gives the narrowed side planes.
+static void ExtractRectFrustum(Frustum *frustum, const glm::mat4 &view_projection, glm::vec4 rect) {
+    f32 scale_x = 2.0f / (rect.z - rect.x);
+    f32 scale_y = 2.0f / (rect.w - rect.y);
+
+    glm::mat4 remap = glm::mat4(1.0f);
+    remap[0][0] = scale_x;
+    remap[1][1] = scale_y;
+    remap[3][0] = -(rect.z + rect.x) / (rect.z - rect.x);
+    remap[3][1] = -(rect.w + rect.y) / (rect.w - rect.y);
+
+    frustum->Extract(remap * view_projection);
+}
+
+void CellGraph::Update(const glm::mat4 &view_projection, glm::vec3 camera_position) {
+    this->view_projection = view_projection;
+
+    visible_cells.assign(cells.size(), 0);
+    cell_rects.assign(cells.size(), glm::vec4(FLT_MAX, FLT_MAX, -FLT_MAX, -FLT_MAX));
+    cell_frustums.resize(cells.size());
+
+    camera_cell = FindCell(camera_position);
+    if (camera_cell < 0) {
+        return;
+    }
+
+    Visit((u32) camera_cell, glm::vec4(-1.0f, -1.0f, 1.0f, 1.0f), -1, 0);
+
+    for (u32 i = 0; i < cells.size(); ++i) {
+        if (visible_cells[i]) {
+            ExtractRectFrustum(&cell_frustums[i], view_projection, cell_rects[i]);
+        }
+    }
+}
+
+void CellGraph::Visit(u32 cell, glm::vec4 rect, s32 from_portal, u32 depth) {
+    visible_cells[cell] = 1;
+
+    glm::vec4 *cell_rect = &cell_rects[cell];
+    cell_rect->x = std::min(cell_rect->x, rect.x);
+    cell_rect->y = std::min(cell_rect->y, rect.y);
+    cell_rect->z = std::max(cell_rect->z, rect.z);
+    cell_rect->w = std::max(cell_rect->w, rect.w);
+
+    if (depth == MAX_DEPTH) {
+        return;
+    }
+
+    for (u32 portal_index : cells[cell].portals) {
+        const Portal *portal = &portals[portal_index];
+        if (!portal->open || (s32) portal_index == from_portal) {
+            continue;
+        }
+
+        glm::vec4 portal_rect = glm::vec4(FLT_MAX, FLT_MAX, -FLT_MAX, -FLT_MAX);
+        u32 behind = 0;
+
+        for (u32 i = 0; i < 4; ++i) {
+            glm::vec4 clip = view_projection * glm::vec4(portal->corners[i], 1.0f);
+            if (clip.w < MIN_W) {
+                behind++;
+                continue;
+            }
+
+            glm::vec2 ndc = glm::vec2(clip) / clip.w;
+            portal_rect.x = std::min(portal_rect.x, ndc.x);
+            portal_rect.y = std::min(portal_rect.y, ndc.y);
+            portal_rect.z = std::max(portal_rect.z, ndc.x);
+            portal_rect.w = std::max(portal_rect.w, ndc.y);
+        }
+
+        if (behind == 4) {
+            continue;
+        }
+
+        // The camera is standing in the opening, it does not narrow anything
+        glm::vec4 next_rect = rect;
+        if (!behind) {
+            next_rect.x = std::max(rect.x, portal_rect.x);
+            next_rect.y = std::max(rect.y, portal_rect.y);
+            next_rect.z = std::min(rect.z, portal_rect.z);
+            next_rect.w = std::min(rect.w, portal_rect.w);
+        }
+
+        if (next_rect.x >= next_rect.z || next_rect.y >= next_rect.w) {
+            continue;
+        }
+
+        u32 next_cell = portal->cells[0] == cell ? portal->cells[1] : portal->cells[0];
+        Visit(next_cell, next_rect, (s32) portal_index, depth + 1);
+    }
+}
+
+bool CellGraph::IsCellVisible(s32 cell) const {
+    if (camera_cell < 0 || cell < 0) {
+        return true;
+    }
+
+    return visible_cells[cell] != 0;
+}
+
+bool CellGraph::IsVisible(s32 cell, const glm::mat4 &transform, glm::vec3 bounds_min, glm::vec3 bounds_max) const {
+    if (camera_cell < 0 || cell < 0) {
+        return true;
+    }
+
+    if (!visible_cells[cell]) {
+        return false;
+    }
+
+    glm::vec3 center, extent;
+    TransformAABB(transform, bounds_min, bounds_max, &center, &extent);
+
+    return cell_frustums[cell].IntersectsAABB(center, extent);
+}
@@ -0,0 +1,67 @@
+#ifndef PORTALS_H
+#define PORTALS_H
+
+#include "Common.h"
+#include "Graphics/Frustum.h"
+
+#define GLM_FORCE_DEPTH_ZERO_TO_ONE
+#include <glm/glm.hpp>
+
+// Opening between two cells, e.g. a doorway or a window
+struct Portal {
+    // World space convex quad
+    glm::vec3 corners[4];
+    u32 cells[2];
+    // Closed portals (shut doors) are never looked through
+    bool open = true;
+};
+
+struct Cell {
+    // World space, only used to find the cell the camera is in
+    glm::vec3 bounds_min;
+    glm::vec3 bounds_max;
+    array<u32> portals;
+};
+
+// Cell and portal visibility for interiors. Update starts in the cell of the camera and walks
+// through open portals, every portal narrows the screen rectangle the next cell is seen
+// through. Cells that are reached are visible, objects in them are tested against the frustum
+// of their rectangle, so a room behind a doorway only shows what is visible through the door.
+//
+// Cells are given by the caller (-1 for objects outside of all cells). If the camera is
+// outside of all cells, nothing is culled.
+struct CellGraph {
+    static const u32 MAX_DEPTH = 16;
+
+    array<Cell> cells;
+    array<Portal> portals;
+
+    // Valid after Update, indexed by cell
+    array<u8> visible_cells;
+    // NDC rectangle, xy min and zw max, the union of all paths that reached the cell
+    array<glm::vec4> cell_rects;
+    array<Frustum> cell_frustums;
+
+    glm::mat4 view_projection = glm::mat4(1.0f);
+    s32 camera_cell = -1;
+
+    u32 AddCell(glm::vec3 bounds_min, glm::vec3 bounds_max);
+    u32 AddPortal(u32 cell_a, u32 cell_b, const glm::vec3 corners[4]);
+    // Quad through the middle of a model space box, across its thinnest axis. Fits door
+    // and window models, which are thin in the direction you walk or look through them.
+    u32 AddPortal(u32 cell_a, u32 cell_b, const glm::mat4 &transform, glm::vec3 bounds_min, glm::vec3 bounds_max);
+
+    void SetPortalOpen(u32 portal, bool open);
+
+    // -1 if the position is in none of the cells, the first match otherwise
+    s32 FindCell(glm::vec3 position) const;
+
+    void Update(const glm::mat4 &view_projection, glm::vec3 camera_position);
+
+    bool IsCellVisible(s32 cell) const;
+    bool IsVisible(s32 cell, const glm::mat4 &transform, glm::vec3 bounds_min, glm::vec3 bounds_max) const;
+
+    void Visit(u32 cell, glm::vec4 rect, s32 from_portal, u32 depth);
+};
+
+#endif
@@ -0,0 +1,84 @@
+#include "RenderQueue.h"
+
+u64 RenderQueue::MakeKey(RenderLayer layer, u32 pipeline, f32 depth, u32 material, u32 mesh) {
+    // Positive floats compare like their bit patterns, anything behind the camera goes first
+    u32 depth_bits = 0;
+    if (depth > 0.0f) {
+        memcpy(&depth_bits, &depth, sizeof(depth_bits));
+    }
+
+    u64 key = 0;
+    key |= (u64) (layer & 0xf) << 60;
+    key |= (u64) (pipeline & 0xff) << 52;
+    key |= (u64) (depth_bits >> 16) << 36;
+    key |= (u64) (material & 0xfffff) << 16;
+    key |= (u64) (mesh & 0xffff);
+
+    return key;
+}
+
+void RenderQueue::Push(u64 key, Model *model, Mesh *mesh, u32 batch, u32 first_instance, u32 instance_count) {
+    DrawPacket packet;
+    packet.key = key;
+    packet.model = model;
+    packet.mesh = mesh;
+    packet.batch = batch;
+    packet.first_instance = first_instance;
+    packet.instance_count = instance_count;
+
+    packets.push_back(packet);
+}
+
+// LSD radix sort, one pass per key byte. Passes where every key has the same byte are skipped,
+// which is the common case for the layer and pipeline bytes.
+void RenderQueue::Sort() {
+    u32 count = (u32) packets.size();
+    if (count < 2) {
+        return;
+    }
+
+    scratch.resize(count);
+
+    DrawPacket *src = packets.data();
+    DrawPacket *dst = scratch.data();
+
+    u32 histograms[8][256] = {};
+    for (u32 i = 0; i < count; ++i) {
+        u64 key = src[i].key;
+        for (u32 pass = 0; pass < 8; ++pass) {
+            histograms[pass][(key >> (pass * 8)) & 0xff]++;
+        }
+    }
+
+    for (u32 pass = 0; pass < 8; ++pass) {
+        u32 *histogram = histograms[pass];
+        u32 shift = pass * 8;
+
+        if (histogram[(src[0].key >> shift) & 0xff] == count) {
+            continue;
+        }
+
+        u32 offset = 0;
+        for (u32 i = 0; i < 256; ++i) {
+            u32 bucket_count = histogram[i];
+            histogram[i] = offset;
+            offset += bucket_count;
+        }
+
+        for (u32 i = 0; i < count; ++i) {
+            dst[histogram[(src[i].key >> shift) & 0xff]++] = src[i];
+        }
+
+        DrawPacket *temp = src;
+        src = dst;
+        dst = temp;
+    }
+
+    if (src != packets.data()) {
+        packets.swap(scratch);
+    }
+}
+
+void RenderQueue::Clear() {
+    packets.clear();
+}
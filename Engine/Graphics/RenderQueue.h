@@ -0,0 +1,43 @@
+#ifndef RENDER_QUEUE_H
+#define RENDER_QUEUE_H
+
+#include "Common.h"
+#include "Graphics/Model.h"
+
+// Draw packets are ordered by a 64 bit key, most significant field first:
+//
+//   63..60  layer     opaque geometry before anything that needs blending
+//   59..52  pipeline
+//   51..36  depth     upper 16 bits of the view space distance, front to back
+//   35..16  material  model id and material index, keeps draws of one material together
+//   15..0   mesh      index of the mesh inside its model
+//
+// The depth field is coarse on purpose, the float bits are roughly logarithmic, so draws at a
+// similar distance fall into the same bucket and are still grouped by material inside it.
+enum RenderLayer {
+    RENDER_LAYER_OPAQUE = 0,
+    RENDER_LAYER_TRANSPARENT = 1
+};
+
+struct DrawPacket {
+    u64 key;
+    Model *model;
+    Mesh *mesh;
+    // Index of the instance batch the packet draws
+    u32 batch;
+    u32 first_instance;
+    u32 instance_count;
+};
+
+struct RenderQueue {
+    array<DrawPacket> packets;
+    array<DrawPacket> scratch;
+
+    static u64 MakeKey(RenderLayer layer, u32 pipeline, f32 depth, u32 material, u32 mesh);
+
+    void Push(u64 key, Model *model, Mesh *mesh, u32 batch, u32 first_instance, u32 instance_count);
+    void Sort();
+    void Clear();
+};
+
+#endif
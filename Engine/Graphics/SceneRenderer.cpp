@@ -1,48 +1,172 @@
 #include "SceneRenderer.h"
 
+#include "Core/JobSystem.h"
+
+#include <glm/gtc/matrix_inverse.hpp>
+
+#include <float.h>
+#include <atomic>
+#include <algorithm>
+
+// Permutation of a scene pipeline, the variant for the same values is shared
+static PipelineInfo SpecializeScene(const PipelineInfo *info, u32 max_lights, SceneDebugView debug_view, bool vertex_shading) {
+    PipelineInfo specialized = *info;
+    specialized.Specialize(SCENE_SPECIALIZATION_MAX_LIGHTS, max_lights);
+    specialized.Specialize(SCENE_SPECIALIZATION_DEBUG_VIEW, debug_view);
+    specialized.Specialize(SCENE_SPECIALIZATION_VERTEX_SHADING, vertex_shading);
+    return specialized;
+}
+
 SceneRenderer::SceneRenderer(VulkanSwapchain *swapchain, RenderPass *render_pass) : render_pass(render_pass) {
-    Shader vertex_shader, fragment_shader;
-    vertex_shader.Create("Engine/Assets/Shaders/simple.vert.spv");
-    fragment_shader.Create("Engine/Assets/Shaders/simple.frag.spv");
+    // Every buffer is read through the bindless set, see DrawConstants
+    pipeline_info.AddShader(VK_SHADER_STAGE_VERTEX_BIT, PipelineVariants::LoadShader("Engine/Assets/Shaders/simple.vert.spv"));
+    pipeline_info.AddShader(VK_SHADER_STAGE_FRAGMENT_BIT, PipelineVariants::LoadShader("Engine/Assets/Shaders/simple.frag.spv"));
+    pipeline_info.AddPushConstant(VK_SHADER_STAGE_VERTEX_BIT | VK_SHADER_STAGE_FRAGMENT_BIT, sizeof(DrawConstants));
+    pipeline_info.set_layout = BindlessDescriptors::set_layout;
+    pipeline_info = SpecializeScene(&pipeline_info, LightClusters::MAX_LIGHTS_PER_CLUSTER, SCENE_DEBUG_VIEW_NONE, true);
+
+    // Depth pre-pass variants, the layout is the same so DrawScene treats them alike
+    equal_pipeline_info = pipeline_info;
+    equal_pipeline_info.depth_compare_op = VK_COMPARE_OP_EQUAL;
+    equal_pipeline_info.depth_write = false;
+
+    depth_pipeline_info.AddShader(VK_SHADER_STAGE_VERTEX_BIT, PipelineVariants::LoadShader("Engine/Assets/Shaders/depth.vert.spv"));
+    depth_pipeline_info.AddPushConstant(VK_SHADER_STAGE_VERTEX_BIT | VK_SHADER_STAGE_FRAGMENT_BIT, sizeof(DrawConstants));
+    depth_pipeline_info.set_layout = BindlessDescriptors::set_layout;
+    depth_pipeline_info.color_write = false;
+
+    wireframe_pipeline_info = pipeline_info;
+    wireframe_pipeline_info.polygon_mode = VK_POLYGON_MODE_LINE;
+    wireframe_pipeline_info.cull_mode = VK_CULL_MODE_NONE;
+
+    // Compile in parallel while the rest loads
+    PipelineVariants::Prewarm(&pipeline_info);
+    PipelineVariants::Prewarm(&equal_pipeline_info);
+    PipelineVariants::Prewarm(&depth_pipeline_info);
+    if (VulkanPhysicalDevice::fill_mode_non_solid) {
+        PipelineVariants::Prewarm(&wireframe_pipeline_info);
+    }
 
-    PipelineInfo pipeline_info;
-    pipeline_info.AddShader(VK_SHADER_STAGE_VERTEX_BIT, &vertex_shader);
-    pipeline_info.AddShader(VK_SHADER_STAGE_FRAGMENT_BIT, &fragment_shader);
-	pipeline_info.AddBinding(VK_SHADER_STAGE_VERTEX_BIT, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER);
-	pipeline_info.AddBinding(VK_SHADER_STAGE_VERTEX_BIT, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER);
-	pipeline_info.AddBinding(VK_SHADER_STAGE_VERTEX_BIT, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER);
-    pipeline_info.AddPushConstant(VK_SHADER_STAGE_VERTEX_BIT, sizeof(MeshData));
+    culler.Create(swapchain, render_pass->frames_in_flight);
+    light_clusters.Create();
+    shadow_maps.Create(render_pass);
 
-    pipeline.Create(swapchain, &pipeline_info);
+    // Point at the frame allocator until the first frame writes the real ranges
+    VkDescriptorBufferInfo frame_allocator_info = { render_pass->frame_allocator.buffer, 0, VK_WHOLE_SIZE };
+    for (u32 i = 0; i < render_pass->frames_in_flight; ++i) {
+        scene_descriptors.push_back(BindlessDescriptors::RegisterBuffer(frame_allocator_info));
+        instance_descriptors.push_back(BindlessDescriptors::RegisterBuffer(frame_allocator_info));
+        normal_descriptors.push_back(BindlessDescriptors::RegisterBuffer(frame_allocator_info));
+        light_descriptors.push_back(BindlessDescriptors::RegisterBuffer(frame_allocator_info));
+    }
 
-    scene_data_buffer.Create(sizeof(SceneData));
+    bool discrete = VulkanPhysicalDevice::properties.deviceType == VK_PHYSICAL_DEVICE_TYPE_DISCRETE_GPU;
+    occlusion_culling = discrete ? OCCLUSION_CULLING_GPU : OCCLUSION_CULLING_CPU;
+    // Has to exist before the first model is loaded
+    MaterialTable::Create();
 
-    // TODO: check if ok
-    vertex_shader.Destroy();
-    fragment_shader.Destroy();
+    RenderStats::Create(render_pass->frames_in_flight);
 
-    RenderStats::Create();
+    pipeline = PipelineVariants::Wait(&pipeline_info);
 }
 
 SceneRenderer::~SceneRenderer() {
     RenderStats::Destroy();
 
-    scene_data_buffer.Destroy();
-    pipeline.Destroy();
+    MaterialTable::Destroy();
+    culler.Destroy();
+    light_clusters.Destroy();
+    shadow_maps.Destroy();
+
+    for (u32 i = 0; i < scene_descriptors.size(); ++i) {
+        BindlessDescriptors::ReleaseBuffer(scene_descriptors[i]);
+        BindlessDescriptors::ReleaseBuffer(instance_descriptors[i]);
+        BindlessDescriptors::ReleaseBuffer(normal_descriptors[i]);
+        BindlessDescriptors::ReleaseBuffer(light_descriptors[i]);
+    }
 }
 
 void SceneRenderer::Begin() {
     cmd_buf = render_pass->BeginFrame();
 
-    RenderStats::Begin(cmd_buf);
-
-    render_pass->Begin();
-    vkCmdBindPipeline(cmd_buf, VK_PIPELINE_BIND_POINT_GRAPHICS, pipeline.handle);
+    RenderStats::Begin(cmd_buf, render_pass->current_frame);
+    // The timeline value of this frame was waited for, so its counters are final
+    culler.ReadStats(render_pass->current_frame);
 }
 
 void SceneRenderer::End() {
+    // The batches are reset by BuildDrawSlots, their transforms stay until the next frame
+    for (u32 i = 0; i < instance_batch_count; ++i) {
+        shadow_maps.AddCasters(instance_batches[i].model, instance_batches[i].transforms);
+    }
+
+    BuildDrawSlots();
+
+    u32 slot_count = cull_input.slot_count;
+
+    bool gpu_occlusion = occlusion_culling == OCCLUSION_CULLING_GPU;
+
+    // Culling runs in compute, so it is recorded outside of rendering
+    if (slot_count) {
+        {
+            GPU_SCOPE(cmd_buf, "Culling");
+
+            if (gpu_occlusion) {
+                culler.CullEarly(cmd_buf, &cull_input);
+            } else {
+                culler.Cull(cmd_buf, &cull_input);
+            }
+        }
+
+        // After the culling, it may recreate the buffers the draws read
+        RecordScene(gpu_occlusion ? 2 : 1);
+
+        GPU_SCOPE(cmd_buf, "Light clusters");
+        BuildLightClusters();
+    }
+
+    point_lights.clear();
+
+    // Also without draws, the shadow layers have to be sampleable
+    {
+        GPU_SCOPE(cmd_buf, "Shadows");
+        shadow_maps.Render(cmd_buf, &render_pass->frame_allocator, render_pass->current_frame, &instance_bounds);
+    }
+
+    // The secondaries are executed inside the rendering, so the scope goes around it
+    RenderStats::BeginScope(cmd_buf, "Scene");
+
+    // Fragments of every rendering, the depth pass has no fragment shader
+    RenderStats::BeginStatistics(cmd_buf);
+
+    render_pass->Begin(true, slot_count != 0);
+
+    if (slot_count) {
+        ExecuteScene(0);
+    }
+
+    if (slot_count && gpu_occlusion) {
+        // The early draws are the occluders, instances that became visible are drawn on top
+        render_pass->End(false);
+
+        {
+            GPU_SCOPE(cmd_buf, "Hi-Z and late culling");
+            culler.BuildHiZ(cmd_buf);
+            culler.CullLate(cmd_buf, &cull_input);
+        }
+
+        render_pass->Begin(false, true);
+
+        ExecuteScene(1);
+    }
+
     render_pass->End();
 
+    VkExtent2D extent = render_pass->swapchain->extent;
+    RenderStats::EndStatistics(cmd_buf, (u64) extent.width * extent.height * VulkanPhysicalDevice::msaa_samples);
+
+    RenderStats::EndScope(cmd_buf);
+
     RenderStats::EndGPU(cmd_buf);
 
     render_pass->EndFrame();
@@ -51,72 +175,447 @@ void SceneRenderer::End() {
 }
 
 void SceneRenderer::SetSceneData(SceneData *scene_data) {
-    u32 size = 3 * sizeof(glm::mat4) + 16 + scene_data->num_point_lights * sizeof(PointLight);
-    
-    scene_data_buffer.SetData(scene_data, size);
+    view_matrix = scene_data->view;
+    view_projection = scene_data->projection * scene_data->view;
+    frustum.Extract(view_projection);
 
-    VkDescriptorBufferInfo scene_data_buffer_info;
-    scene_data_buffer_info.buffer = scene_data_buffer.buffer;
-    scene_data_buffer_info.offset = 0;
-    scene_data_buffer_info.range = size;
+    VkExtent2D extent = render_pass->swapchain->extent;
+    scene_data->screen_size = glm::vec2((f32) extent.width, (f32) extent.height);
+    ProjectionDepthRange(scene_data->projection, &scene_data->z_near, &scene_data->z_far);
 
-    VkWriteDescriptorSet scene_write_descriptors[1] = {};
-    scene_write_descriptors[0].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
-    scene_write_descriptors[0].dstBinding = 0;
-    scene_write_descriptors[0].descriptorCount = 1;
-    scene_write_descriptors[0].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
-    scene_write_descriptors[0].pBufferInfo = &scene_data_buffer_info;
+    shadow_maps.Update(scene_data->projection, scene_data->view, scene_data->dir_light.dir);
+    for (u32 i = 0; i < CascadedShadowMaps::CASCADE_COUNT; ++i) {
+        scene_data->cascade_view_projections[i] = shadow_maps.cascades[i].view_projection;
+        scene_data->cascade_splits[i] = shadow_maps.cascades[i].split;
+    }
+    scene_data->shadow_map = shadow_maps.texture;
 
-    vkCmdPushDescriptorSetFunc(cmd_buf, VK_PIPELINE_BIND_POINT_GRAPHICS, pipeline.layout, 0, ARRAY_SIZE(scene_write_descriptors), scene_write_descriptors);
+    // Every frame in flight gets its own copy, the previous frames may still be reading theirs
+    scene_buffer_info = render_pass->frame_allocator.Push(scene_data, sizeof(SceneData));
+    BindlessDescriptors::UpdateBuffer(scene_descriptors[render_pass->current_frame], scene_buffer_info);
 }
 
 void SceneRenderer::RenderModel(Model *model) {
-    VkDescriptorBufferInfo material_buffer_info;
-    material_buffer_info.buffer = model->materials_buffer->buffer;
-    material_buffer_info.offset = 0;
-    material_buffer_info.range = model->materials_buffer->size;
+    RenderModelInstanced(model, span<const glm::mat4>(&model->transformation, 1));
+}
+
+void SceneRenderer::RenderModelInstanced(Model *model, span<const glm::mat4> transforms) {
+    if (!VulkanUploader::IsReady(model->upload_ticket)) {
+        return;
+    }
+
+    InstanceBatch *batch;
+
+    auto it = instance_batch_lookup.find(model);
+    if (it != instance_batch_lookup.end()) {
+        batch = &instance_batches[it->second];
+    } else {
+        // Batches are reused across frames so their transform arrays keep their capacity
+        if (instance_batch_count == instance_batches.size()) {
+            instance_batches.emplace_back();
+        }
 
-    VkWriteDescriptorSet material_write_descriptors[1] = {};
-    material_write_descriptors[0].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
-    material_write_descriptors[0].dstBinding = 2;
-    material_write_descriptors[0].descriptorCount = 1;
-    material_write_descriptors[0].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
-    material_write_descriptors[0].pBufferInfo = &material_buffer_info;
+        instance_batch_lookup[model] = instance_batch_count;
 
-    vkCmdPushDescriptorSetFunc(cmd_buf, VK_PIPELINE_BIND_POINT_GRAPHICS, pipeline.layout, 0, ARRAY_SIZE(material_write_descriptors), material_write_descriptors);
+        batch = &instance_batches[instance_batch_count++];
+        batch->model = model;
+        batch->transforms.clear();
+    }
 
-    for (Mesh *mesh : model->meshes) {
-        VkWriteDescriptorSet mesh_write_descriptors[1] = {};
+    batch->transforms.insert(batch->transforms.end(), transforms.begin(), transforms.end());
+}
 
-        VkDescriptorBufferInfo vertex_buffer_info = {};
-        VkDeviceSize vertex_buffer_size = mesh->vertices_buffer->size;
-        vertex_buffer_info.buffer = mesh->vertices_buffer->buffer;
-        vertex_buffer_info.offset = 0;
-        vertex_buffer_info.range = vertex_buffer_size;
+void SceneRenderer::RenderPointLight(const PointLight &light) {
+    point_lights.push_back(light);
+}
 
-        RenderStats::CountTriangles(vertex_buffer_size / sizeof(Vertex) / 3);
+void SceneRenderer::RenderPointLights(span<const PointLight> lights) {
+    point_lights.insert(point_lights.end(), lights.begin(), lights.end());
+}
 
-        mesh_write_descriptors[0].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
-        mesh_write_descriptors[0].dstBinding = 1;
-        mesh_write_descriptors[0].descriptorCount = 1;
-        mesh_write_descriptors[0].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
-        mesh_write_descriptors[0].pBufferInfo = &vertex_buffer_info;
+// Distance along the view direction, larger is further away
+static f32 ViewDepth(const glm::mat4 &view, const glm::mat4 &transform) {
+    glm::vec3 position = glm::vec3(transform[3]);
+    return -(view[0][2] * position.x + view[1][2] * position.y + view[2][2] * position.z + view[3][2]);
+}
 
-        vkCmdPushDescriptorSetFunc(cmd_buf, VK_PIPELINE_BIND_POINT_GRAPHICS, pipeline.layout, 0, ARRAY_SIZE(mesh_write_descriptors), mesh_write_descriptors);
+void SceneRenderer::BuildDrawSlots() {
+    FrameAllocator *frame_allocator = &render_pass->frame_allocator;
+    CullInput *input = &cull_input;
+
+    input->instance_count = 0;
+    input->batch_count = instance_batch_count;
+    input->slot_count = 0;
+    input->chunk_count = 0;
+    input->chunk_size = 0;
+
+    batch_submitted_offsets.resize(instance_batch_count + 1);
+    batch_visible_offsets.resize(instance_batch_count + 1);
+    batch_depths.resize(instance_batch_count);
+
+    u32 submitted_count = 0;
+    for (u32 i = 0; i < instance_batch_count; ++i) {
+        batch_submitted_offsets[i] = submitted_count;
+        submitted_count += (u32) instance_batches[i].transforms.size();
+    }
+    batch_submitted_offsets[instance_batch_count] = submitted_count;
 
-        MeshData mesh_data;
-        mesh_data.material_index = mesh->material_index;
-        // TODO: Change
-        mesh_data.model_matrix = model->transformation;
+    // Frustum culling on the CPU first, instances outside the view are never uploaded
+    instance_bounds.Resize(submitted_count);
+    JobSystem::ParallelFor(instance_batch_count, 1, [&](u32 begin, u32 end, u32 thread) {
+        for (u32 i = begin; i < end; ++i) {
+            InstanceBatch *batch = &instance_batches[i];
+            u32 index = batch_submitted_offsets[i];
 
-        // TODO: change sometime in future to not use push constants?
-        // The issue is that we would need some dynamic uniforms to update uniform buffers
-        // We can't use dynamic buffers though because of we use push decriptors
-        vkCmdPushConstants(cmd_buf, pipeline.layout, VK_SHADER_STAGE_VERTEX_BIT, 0, sizeof(MeshData), &mesh_data);
+            for (const glm::mat4 &transform : batch->transforms) {
+                instance_bounds.Set(index++, transform, batch->model->bounds_min, batch->model->bounds_max);
+            }
+        }
+    });
 
-        vkCmdBindIndexBuffer(cmd_buf, mesh->index_buffer->buffer, 0, VK_INDEX_TYPE_UINT32);
+    u32 padded_count = (u32) instance_bounds.center_x.size();
+    instance_visibility.resize(padded_count);
+
+    std::atomic<u32> visible_count = 0;
+    JobSystem::ParallelFor(padded_count / 8, CULL_JOB_SIZE / 8, [&](u32 begin, u32 end, u32 thread) {
+        visible_count += frustum.CullAABBs(&instance_bounds, instance_visibility.data(), begin * 8, end * 8);
+    });
+
+    u32 instance_count = visible_count;
+
+    if (instance_count && occlusion_culling == OCCLUSION_CULLING_CPU) {
+        instance_count -= CullOccludedInstances();
+    }
+
+    RenderStats::CountCulling(instance_count, submitted_count - instance_count);
+
+    input->instance_count = instance_count;
+    input->history_count = submitted_count;
+
+    if (!instance_count) {
+        instance_batch_count = 0;
+        instance_batch_lookup.clear();
+        return;
+    }
+
+    // Inputs of the culling passes, all of them only live for this frame
+    CullConstants constants;
+    memcpy(constants.frustum_planes, frustum.planes, sizeof(frustum.planes));
+    constants.view_projection = view_projection;
+    constants.instance_count = instance_count;
+    constants.frame = render_pass->current_frame;
+    constants.depth_width = render_pass->swapchain->extent.width;
+    constants.depth_height = render_pass->swapchain->extent.height;
+
+    input->constants = frame_allocator->Push(&constants, sizeof(constants));
+
+    input->instances.buffer = frame_allocator->buffer;
+    input->instances.range = (VkDeviceSize) instance_count * sizeof(glm::mat4);
+    glm::mat4 *instance_data = (glm::mat4 *) frame_allocator->Allocate(input->instances.range, &input->instances.offset);
+    BindlessDescriptors::UpdateBuffer(instance_descriptors[render_pass->current_frame], input->instances);
+
+    // Inverse transpose of every instance, once here instead of in every vertex. A std430
+    // mat3 pads its columns to vec4, like mat3x4.
+    VkDescriptorBufferInfo normals = { frame_allocator->buffer, 0, (VkDeviceSize) instance_count * sizeof(glm::mat3x4) };
+    glm::mat3x4 *normal_data = (glm::mat3x4 *) frame_allocator->Allocate(normals.range, &normals.offset);
+    BindlessDescriptors::UpdateBuffer(normal_descriptors[render_pass->current_frame], normals);
+
+    input->instance_infos.buffer = frame_allocator->buffer;
+    input->instance_infos.range = (VkDeviceSize) instance_count * sizeof(CullInstance);
+    CullInstance *instance_info_data = (CullInstance *) frame_allocator->Allocate(input->instance_infos.range, &input->instance_infos.offset);
+
+    input->batches.buffer = frame_allocator->buffer;
+    input->batches.range = (VkDeviceSize) input->batch_count * sizeof(CullBatch);
+    CullBatch *batch_data = (CullBatch *) frame_allocator->Allocate(input->batches.range, &input->batches.offset);
+
+    // Every batch needs to know where its visible instances start before they can be written in parallel
+    JobSystem::ParallelFor(instance_batch_count, 1, [&](u32 begin, u32 end, u32 thread) {
+        for (u32 i = begin; i < end; ++i) {
+            u32 batch_visible = 0;
+            for (u32 j = batch_submitted_offsets[i]; j < batch_submitted_offsets[i + 1]; ++j) {
+                batch_visible += instance_visibility[j];
+            }
+            batch_visible_offsets[i] = batch_visible;
+        }
+    });
+
+    u32 first_instance = 0;
+    for (u32 i = 0; i < instance_batch_count; ++i) {
+        u32 batch_visible = batch_visible_offsets[i];
+        batch_visible_offsets[i] = first_instance;
+        first_instance += batch_visible;
+    }
+    batch_visible_offsets[instance_batch_count] = first_instance;
 
+    JobSystem::ParallelFor(instance_batch_count, 1, [&](u32 begin, u32 end, u32 thread) {
+        for (u32 i = begin; i < end; ++i) {
+            InstanceBatch *batch = &instance_batches[i];
+            Model *model = batch->model;
+
+            u32 history = batch_submitted_offsets[i];
+            u32 instance = batch_visible_offsets[i];
+
+            f32 depth = FLT_MAX;
+            for (const glm::mat4 &transform : batch->transforms) {
+                if (instance_visibility[history]) {
+                    instance_data[instance] = transform;
+                    normal_data[instance] = glm::mat3x4(glm::inverseTranspose(glm::mat3(transform)));
+                    instance_info_data[instance].batch = i;
+                    instance_info_data[instance].history = history;
+                    instance++;
+
+                    depth = std::min(depth, ViewDepth(view_matrix, transform));
+                }
+                history++;
+            }
+
+            batch_depths[i] = depth;
+
+            CullBatch *cull_batch = &batch_data[i];
+            cull_batch->bounding_sphere = model->bounding_sphere;
+            cull_batch->bounds_min = glm::vec4(model->bounds_min, 0.0f);
+            cull_batch->bounds_max = glm::vec4(model->bounds_max, 0.0f);
+            cull_batch->first_instance = batch_visible_offsets[i];
+            cull_batch->instance_count = batch_visible_offsets[i + 1] - batch_visible_offsets[i];
+        }
+    });
+
+    for (u32 i = 0; i < instance_batch_count; ++i) {
+        Model *model = instance_batches[i].model;
+        u32 batch_first_instance = batch_visible_offsets[i];
+        u32 batch_instances = batch_visible_offsets[i + 1] - batch_first_instance;
+        f32 depth = batch_depths[i];
+
+        if (!batch_instances) {
+            continue;
+        }
+
+        // All instances of a batch share the mesh draws, so meshes can only be culled
+        // one by one if there is a single visible instance
+        u8 *mesh_visible = 0;
+        if (batch_instances == 1 && model->meshes.size() > 1) {
+            const glm::mat4 &transform = instance_data[batch_first_instance];
+
+            mesh_bounds.Clear();
+            for (Mesh *mesh : model->meshes) {
+                mesh_bounds.Add(transform, mesh->bounds_min, mesh->bounds_max);
+            }
+
+            mesh_visibility.resize((mesh_bounds.count + 7) & ~7u);
+            u32 visible_meshes = frustum.CullAABBs(&mesh_bounds, mesh_visibility.data());
+            mesh_visible = mesh_visibility.data();
+
+            RenderStats::CountCulling(0, mesh_bounds.count - visible_meshes);
+        }
+
+        // The queue decides the order of the draw slots, compaction on the GPU keeps it
+        for (u32 mesh_index = 0; mesh_index < model->meshes.size(); ++mesh_index) {
+            if (mesh_visible && !mesh_visible[mesh_index]) {
+                continue;
+            }
+
+            Mesh *mesh = model->meshes[mesh_index];
+            u32 material = (model->id << 8) | (mesh->material_index & 0xff);
+
+            u64 key = RenderQueue::MakeKey(RENDER_LAYER_OPAQUE, 0, depth, material, mesh_index);
+            render_queue.Push(key, model, mesh, i, batch_first_instance, batch_instances);
+        }
+    }
+
+    render_queue.Sort();
+
+    u32 slot_count = (u32) render_queue.packets.size();
+    input->slot_count = slot_count;
+
+    // One chunk per job thread, unless they would get too small
+    u32 chunk_count = std::min(render_pass->thread_count, (slot_count + MIN_CHUNK_SLOTS - 1) / MIN_CHUNK_SLOTS);
+    input->chunk_count = chunk_count;
+    input->chunk_size = chunk_count ? (slot_count + chunk_count - 1) / chunk_count : 0;
+
+    input->slots.buffer = frame_allocator->buffer;
+    input->slots.range = (VkDeviceSize) slot_count * sizeof(DrawSlot);
+    DrawSlot *slot_data = (DrawSlot *) frame_allocator->Allocate(input->slots.range, &input->slots.offset);
+
+    for (u32 i = 0; i < slot_count; ++i) {
+        DrawPacket *packet = &render_queue.packets[i];
+        GeometryAllocation *geometry = &packet->mesh->geometry;
+
+        DrawSlot *slot = &slot_data[i];
+        slot->index_count = geometry->index_count;
+        slot->first_index = geometry->first_index;
+        slot->vertex_offset = (s32) geometry->vertex_offset;
+        slot->material_index = packet->mesh->material_index;
+        slot->batch = packet->batch;
+        slot->first_instance = packet->first_instance;
+
+        // Submitted before culling, the GPU may draw less
+        RenderStats::CountTriangles((u64) geometry->index_count / 3 * packet->instance_count);
+    }
+
+    render_queue.Clear();
+
+    instance_batch_count = 0;
+    instance_batch_lookup.clear();
+}
+
+// Rasterizes the visible occluders and hides the instances behind them, returns how many
+// were hidden. Occluders are not tested, a flat one can be hidden by its own depth.
+u32 SceneRenderer::CullOccludedInstances() {
+    occlusion_buffer.Clear(view_projection);
+
+    u32 tested_instance = 0;
+    for (u32 i = 0; i < instance_batch_count; ++i) {
+        InstanceBatch *batch = &instance_batches[i];
+        Model *model = batch->model;
+
+        for (const glm::mat4 &transform : batch->transforms) {
+            if (model->occluder && instance_visibility[tested_instance]) {
+                occlusion_buffer.RasterizeTriangles(transform, model->occluder_mesh.vertices);
+            }
+            tested_instance++;
+        }
+    }
+
+    // The buffer is only read from here on, batches are tested in parallel
+    std::atomic<u32> occluded = 0;
+
+    JobSystem::ParallelFor(instance_batch_count, 1, [&](u32 begin, u32 end, u32 thread) {
+        u32 batch_occluded = 0;
+
+        for (u32 i = begin; i < end; ++i) {
+            InstanceBatch *batch = &instance_batches[i];
+            Model *model = batch->model;
+
+            u8 *visible = &instance_visibility[batch_submitted_offsets[i]];
+            if (model->occluder) {
+                continue;
+            }
+
+            for (const glm::mat4 &transform : batch->transforms) {
+                if (*visible && !occlusion_buffer.IsVisible(transform, model->bounds_min, model->bounds_max)) {
+                    *visible = 0;
+                    batch_occluded++;
+                }
+                visible++;
+            }
+        }
+
+        occluded += batch_occluded;
+    });
+
+    RenderStats::CountOcclusion(0, 0, occluded);
+
+    return occluded;
+}
+
+// Uploads the lights of this frame and bins them, recorded outside of rendering
+void SceneRenderer::BuildLightClusters() {
+    u32 light_count = (u32) point_lights.size();
+
+    // The lights binding can not be empty
+    PointLight no_light = {};
+    VkDescriptorBufferInfo lights_info = light_count
+        ? render_pass->frame_allocator.Push(point_lights.data(), light_count * sizeof(PointLight))
+        : render_pass->frame_allocator.Push(&no_light, sizeof(PointLight));
+
+    BindlessDescriptors::UpdateBuffer(light_descriptors[render_pass->current_frame], lights_info);
+
+    light_clusters.Build(cmd_buf, scene_buffer_info, lights_info, light_count);
+}
+
+// Records the draws of every phase, one secondary per phase, pass and chunk. Only reads
+// state that is final by now, so the job threads can record while nothing else happens.
+void SceneRenderer::RecordScene(u32 phase_count) {
+    u32 chunk_count = cull_input.chunk_count;
+
+    u32 light_count = (u32) point_lights.size();
+    u32 max_lights = LightClusters::MAX_LIGHTS_PER_CLUSTER;
+    for (u32 limit : LIGHT_LIMITS) {
+        if (limit >= light_count) {
+            max_lights = limit;
+            break;
+        }
+    }
+
+    // A permutation that still compiles falls back to the general one, which shades the same
+    bool wireframe_pass = wireframe && VulkanPhysicalDevice::fill_mode_non_solid;
+    PipelineInfo color_info = SpecializeScene(wireframe_pass ? &wireframe_pipeline_info : &pipeline_info, max_lights, debug_view, vertex_shading);
+    Pipeline *color_pipeline = PipelineVariants::Get(&color_info, pipeline);
+
+    PipelineInfo equal_info = SpecializeScene(&equal_pipeline_info, max_lights, debug_view, vertex_shading);
+    Pipeline *depth_pipeline = PipelineVariants::Get(&depth_pipeline_info, 0);
+    Pipeline *equal_pipeline = PipelineVariants::Get(&equal_info, PipelineVariants::Get(&equal_pipeline_info, 0));
+    bool prepass = depth_prepass && !wireframe_pass && depth_pipeline && equal_pipeline;
+
+    // Read by ExecuteScene, depth_prepass may be toggled before then
+    pass_count = prepass ? 2 : 1;
+
+    secondary_buffers.resize(phase_count * pass_count * chunk_count);
+
+    JobSystem::ParallelFor(phase_count * pass_count * chunk_count, 1, [&](u32 begin, u32 end, u32 thread) {
+        for (u32 i = begin; i < end; ++i) {
+            u32 chunk = i % chunk_count;
+            u32 pass = (i / chunk_count) % pass_count;
+            u32 phase = i / (chunk_count * pass_count);
+
+            bool depth_pass = pass_count == 2 && pass == 0;
+            RenderStatsPass stats_pass = depth_pass ? RENDER_STATS_DEPTH_PASS : RENDER_STATS_COLOR_PASS;
+            Pipeline *pass_pipeline = depth_pass ? depth_pipeline : pass_count == 2 ? equal_pipeline : color_pipeline;
+
+            VkCommandBuffer secondary = render_pass->BeginSecondary(thread);
+
+            // Chunks execute in order, so the first and last one bound the pass
+            if (chunk == 0) {
+                RenderStats::BeginPass(secondary, stats_pass, phase);
+            }
+
+            DrawScene(secondary, pass_pipeline, chunk);
+
+            if (chunk == chunk_count - 1) {
+                RenderStats::EndPass(secondary, stats_pass, phase);
+            }
+
+            render_pass->EndSecondary(secondary);
+
+            secondary_buffers[i] = secondary;
+        }
+    });
+}
+
+void SceneRenderer::DrawScene(VkCommandBuffer cmd_buf, Pipeline *pipeline, u32 chunk) {
+    vkCmdBindPipeline(cmd_buf, VK_PIPELINE_BIND_POINT_GRAPHICS, pipeline->handle);
+    BindlessDescriptors::Bind(cmd_buf, VK_PIPELINE_BIND_POINT_GRAPHICS, pipeline->layout);
+
+    u32 frame = render_pass->current_frame;
+
+    DrawConstants constants;
+    constants.draw_offset = chunk * cull_input.chunk_size;
+    constants.scene_buffer = scene_descriptors[frame];
+    constants.vertex_buffer = GeometryArena::vertex_descriptor;
+    constants.material_buffer = MaterialTable::descriptor;
+    constants.instance_buffer = instance_descriptors[frame];
+    constants.visible_instance_buffer = culler.visible_instances.descriptor;
+    constants.draw_material_buffer = culler.draw_materials.descriptor;
+    constants.light_buffer = light_descriptors[frame];
+    constants.cluster_count_buffer = light_clusters.cluster_counts.descriptor;
+    constants.cluster_light_buffer = light_clusters.cluster_lights.descriptor;
+    constants.normal_buffer = normal_descriptors[frame];
+    vkCmdPushConstants(cmd_buf, pipeline->layout, VK_SHADER_STAGE_VERTEX_BIT | VK_SHADER_STAGE_FRAGMENT_BIT, 0, sizeof(DrawConstants), &constants);
+
+    vkCmdBindIndexBuffer(cmd_buf, GeometryArena::index_buffer, 0, VK_INDEX_TYPE_UINT32);
+
+    // One draw for the whole chunk, the count comes from compact.comp
+    culler.Draw(cmd_buf, &cull_input, chunk);
+}
+
+// Has to be inside rendering that was begun for secondaries, chunks run in slot order and
+// the depth pass of a phase runs before its color pass
+void SceneRenderer::ExecuteScene(u32 phase) {
+    u32 count = pass_count * cull_input.chunk_count;
+
+    vkCmdExecuteCommands(cmd_buf, count, &secondary_buffers[phase * count]);
+
+    for (u32 i = 0; i < count; ++i) {
         RenderStats::DrawCall();
-        vkCmdDrawIndexed(cmd_buf, mesh->index_buffer->count, 1, 0, 0, 0);
     }
-}
\ No newline at end of file
+}
@@ -2,22 +2,166 @@
 #define SCENE_RENDERER_H
 
 #include "Vulkan/VulkanRenderer.h"
+#include "Vulkan/VulkanPipelineVariants.h"
 #include "Graphics/Model.h"
+#include "Graphics/RenderQueue.h"
+#include "Graphics/Frustum.h"
+#include "Graphics/GPUCulling.h"
+#include "Graphics/SoftwareOcclusion.h"
+#include "Graphics/ClusteredLighting.h"
+#include "Graphics/ShadowMaps.h"
 
 struct SceneData {
     alignas(16) glm::mat4 projection;
     alignas(16) glm::mat4 view;
     alignas(16) DirectionalLight dir_light;
-    alignas(16) u8 num_point_lights;
-    alignas(16) PointLight point_lights[10];
+    // Filled in by SetSceneData, the fragment shader finds its light cluster with them
+    alignas(16) glm::vec2 screen_size;
+    f32 z_near;
+    f32 z_far;
+    // Filled in by SetSceneData from the shadow cascades of dir_light
+    alignas(16) glm::mat4 cascade_view_projections[CascadedShadowMaps::CASCADE_COUNT];
+    glm::vec4 cascade_splits;
+    u32 shadow_map;
+};
+
+// Push constants of the scene pipeline, the buffers are slots in BindlessDescriptors
+struct DrawConstants {
+    u32 draw_offset;
+    u32 scene_buffer;
+    u32 vertex_buffer;
+    u32 material_buffer;
+    u32 instance_buffer;
+    u32 visible_instance_buffer;
+    u32 draw_material_buffer;
+    u32 light_buffer;
+    u32 cluster_count_buffer;
+    u32 cluster_light_buffer;
+    u32 normal_buffer;
+};
+
+// constant_id of the specialization constants of simple.frag
+enum SceneSpecialization {
+    SCENE_SPECIALIZATION_MAX_LIGHTS,
+    SCENE_SPECIALIZATION_DEBUG_VIEW,
+    // Off compiles out the SHADING_PER_VERTEX path, every material is lit per pixel then
+    SCENE_SPECIALIZATION_VERTEX_SHADING
+};
+
+// Has to match DEBUG_VIEW in simple.frag
+enum SceneDebugView {
+    SCENE_DEBUG_VIEW_NONE,
+    SCENE_DEBUG_VIEW_NORMALS,
+    // Point lights per fragment, blue to red
+    SCENE_DEBUG_VIEW_LIGHT_COUNT,
+    // Tints the shadow cascades
+    SCENE_DEBUG_VIEW_CASCADES,
+    SCENE_DEBUG_VIEW_COUNT
+};
+
+enum OcclusionCulling {
+    OCCLUSION_CULLING_NONE,
+    // Occluder models are rasterized into an OcclusionBuffer before the instances are uploaded
+    OCCLUSION_CULLING_CPU,
+    // Two phase culling against a depth pyramid, see GPUCuller
+    OCCLUSION_CULLING_GPU
+};
+
+// All instances of one model that were submitted this frame
+struct InstanceBatch {
+    Model *model;
+    array<glm::mat4> transforms;
 };
 
 struct SceneRenderer {
+    // Fewer slots are not worth a secondary command buffer of their own
+    static const u32 MIN_CHUNK_SLOTS = 64;
+    // Boxes per frustum culling job, a multiple of 8
+    static const u32 CULL_JOB_SIZE = 1024;
+    // Bounds of the point light loop the scene pipelines are specialized for, the frame
+    // picks the smallest one that holds all of its lights
+    static constexpr u32 LIGHT_LIMITS[] = { 0, 8, 32, LightClusters::MAX_LIGHTS_PER_CLUSTER };
+
     RenderPass *render_pass;
-    Pipeline pipeline;
+    // The pipelines are PipelineVariants, only this one is compiled before the first frame,
+    // the others are prewarmed and used once they are ready. The infos are specialized for
+    // the most lights and no debug view, every frame specializes copies of them.
+    PipelineInfo pipeline_info;
+    Pipeline *pipeline;
+    SceneDebugView debug_view = SCENE_DEBUG_VIEW_NONE;
+    // Off lights SHADING_PER_VERTEX materials per pixel as well
+    bool vertex_shading = true;
     VkCommandBuffer cmd_buf;
 
-    StorageBuffer scene_data_buffer;
+    // With depth_prepass every phase first draws its chunks with the depth pipeline, position
+    // only and without a fragment shader, then shades them again with the equal pipeline, which
+    // tests for equal depth and writes none, so every sample is shaded once. Both passes
+    // draw the same sorted and culled chunks. Pays off once fragments are expensive and
+    // overdraw is high, RenderStats reports both to decide per scene.
+    bool depth_prepass = false;
+    PipelineInfo depth_pipeline_info;
+    PipelineInfo equal_pipeline_info;
+
+    // Draws the triangle edges only, without the depth pre-pass. Ignored when the GPU has no
+    // VulkanPhysicalDevice::fill_mode_non_solid.
+    bool wireframe = false;
+    PipelineInfo wireframe_pipeline_info;
+
+    // Draws are collected during the frame and submitted in End, repeated RenderModel
+    // calls for the same model end up in one batch. The meshes of all batches are sorted
+    // by RenderQueue, culled on the GPU and drawn with one indirect draw per occlusion phase
+    // and chunk. The chunks are recorded into secondary command buffers on the job threads.
+    array<InstanceBatch> instance_batches;
+    u32 instance_batch_count = 0;
+    map<Model *, u32> instance_batch_lookup;
+
+    // Per batch, so the job threads can work on batches independently. Submitted and
+    // visible instances before every batch, plus the total at the end.
+    array<u32> batch_submitted_offsets;
+    array<u32> batch_visible_offsets;
+    array<f32> batch_depths;
+
+    // Phase major, then pass, chunk_count per pass
+    array<VkCommandBuffer> secondary_buffers;
+    u32 pass_count = 1;
+
+    // Submitted during the frame, binned into light_clusters in End
+    array<PointLight> point_lights;
+    LightClusters light_clusters;
+
+    // Every submitted instance casts, camera culling does not apply to shadows
+    CascadedShadowMaps shadow_maps;
+
+    RenderQueue render_queue;
+    GPUCuller culler;
+
+    // CPU frustum culling, instances use the model bounds and the meshes of single
+    // instances are tested on their own
+    CullingBounds instance_bounds;
+    array<u8> instance_visibility;
+    CullingBounds mesh_bounds;
+    array<u8> mesh_visibility;
+
+    // GPU on discrete cards, where the compute passes are cheap, CPU everywhere else
+    OcclusionCulling occlusion_culling;
+    OcclusionBuffer occlusion_buffer;
+
+    // From the last SetSceneData, used for the depth part of the sort keys and for culling
+    glm::mat4 view_matrix = glm::mat4(1.0f);
+    glm::mat4 view_projection = glm::mat4(1.0f);
+    Frustum frustum;
+
+    VkDescriptorBufferInfo scene_buffer_info = {};
+
+    // Frame allocator ranges change every frame, each frame in flight has its own slots
+    // that are pointed at them, so nothing pending reads a slot while it is rewritten
+    array<u32> scene_descriptors;
+    array<u32> instance_descriptors;
+    array<u32> normal_descriptors;
+    array<u32> light_descriptors;
+
+    // Frame allocator ranges written by BuildDrawSlots
+    CullInput cull_input = {};
 
     SceneRenderer(VulkanSwapchain *swapchain, RenderPass *render_pass);
     ~SceneRenderer();
@@ -27,6 +171,16 @@ struct SceneRenderer {
 
     void SetSceneData(SceneData *scene_data);
     void RenderModel(Model *model);
+    void RenderModelInstanced(Model *model, span<const glm::mat4> transforms);
+    void RenderPointLight(const PointLight &light);
+    void RenderPointLights(span<const PointLight> lights);
+
+    void BuildDrawSlots();
+    u32 CullOccludedInstances();
+    void BuildLightClusters();
+    void RecordScene(u32 phase_count);
+    void DrawScene(VkCommandBuffer cmd_buf, Pipeline *pipeline, u32 chunk);
+    void ExecuteScene(u32 phase);
 };
 
 #endif
\ No newline at end of file
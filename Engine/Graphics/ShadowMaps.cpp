@@ -0,0 +1,395 @@
+#include "ShadowMaps.h"
+
+#include "Core/JobSystem.h"
+#include "Graphics/GPUCulling.h"
+#include "Graphics/ClusteredLighting.h"
+
+#include <glm/gtc/matrix_transform.hpp>
+#include <math.h>
+#include <algorithm>
+
+static const u64 HASH_BASIS = 14695981039346656037ull;
+
+// FNV-1a
+static u64 HashBytes(u64 hash, const void *data, u64 size) {
+    const u8 *bytes = (const u8 *) data;
+    for (u64 i = 0; i < size; ++i) {
+        hash = (hash ^ bytes[i]) * 1099511628211ull;
+    }
+    return hash;
+}
+
+void CascadedShadowMaps::Create(RenderPass *render_pass) {
+    VkDevice device = VulkanDevice::handle;
+
+    // No fragment shader, both sides cast so thin geometry like the floor does too
+    PipelineInfo pipeline_info;
+    pipeline_info.AddShader(VK_SHADER_STAGE_VERTEX_BIT, PipelineVariants::LoadShader("Engine/Assets/Shaders/shadow.vert.spv"));
+    pipeline_info.AddPushConstant(VK_SHADER_STAGE_VERTEX_BIT, sizeof(ShadowConstants));
+    pipeline_info.set_layout = BindlessDescriptors::set_layout;
+    pipeline_info.depth_target_only = true;
+    pipeline_info.color_write = false;
+    pipeline_info.cull_mode = VK_CULL_MODE_NONE;
+    pipeline_info.depth_bias_constant = 1.25f;
+    pipeline_info.depth_bias_slope = 1.75f;
+
+    // Compiles while the images are created
+    PipelineVariants::Prewarm(&pipeline_info);
+
+    shadow_image.Create(
+        VK_FORMAT_D32_SFLOAT, MAP_SIZE, MAP_SIZE, 1, VK_SAMPLE_COUNT_1_BIT,
+        VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT | VK_IMAGE_USAGE_SAMPLED_BIT | VK_IMAGE_USAGE_TRANSFER_DST_BIT,
+        VULKAN_ALLOCATION_GENERAL, CASCADE_COUNT
+    );
+    static_image.Create(
+        VK_FORMAT_D32_SFLOAT, MAP_SIZE, MAP_SIZE, 1, VK_SAMPLE_COUNT_1_BIT,
+        VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT | VK_IMAGE_USAGE_TRANSFER_SRC_BIT,
+        VULKAN_ALLOCATION_GENERAL, CASCADE_COUNT
+    );
+
+    for (u32 i = 0; i < CASCADE_COUNT; ++i) {
+        VkImageViewCreateInfo view_info = { VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO };
+        view_info.viewType = VK_IMAGE_VIEW_TYPE_2D;
+        view_info.format = VK_FORMAT_D32_SFLOAT;
+        view_info.subresourceRange.aspectMask = VK_IMAGE_ASPECT_DEPTH_BIT;
+        view_info.subresourceRange.levelCount = 1;
+        view_info.subresourceRange.baseArrayLayer = i;
+        view_info.subresourceRange.layerCount = 1;
+
+        view_info.image = shadow_image.handle;
+        VK_CHECK(vkCreateImageView(device, &view_info, 0, &shadow_views[i]));
+
+        view_info.image = static_image.handle;
+        VK_CHECK(vkCreateImageView(device, &view_info, 0, &static_views[i]));
+    }
+
+    // Outside of the maps everything is lit
+    VkSamplerCreateInfo sampler_info = { VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO };
+    sampler_info.magFilter = VK_FILTER_LINEAR;
+    sampler_info.minFilter = VK_FILTER_LINEAR;
+    sampler_info.mipmapMode = VK_SAMPLER_MIPMAP_MODE_NEAREST;
+    sampler_info.addressModeU = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_BORDER;
+    sampler_info.addressModeV = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_BORDER;
+    sampler_info.addressModeW = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_BORDER;
+    sampler_info.borderColor = VK_BORDER_COLOR_FLOAT_OPAQUE_WHITE;
+    sampler_info.compareEnable = VK_TRUE;
+    sampler_info.compareOp = VK_COMPARE_OP_LESS_OR_EQUAL;
+
+    VK_CHECK(vkCreateSampler(device, &sampler_info, 0, &sampler));
+
+    // Sampled in SHADER_READ_ONLY_OPTIMAL, Render leaves every layer in it
+    texture = BindlessDescriptors::RegisterTexture(shadow_image.view, sampler);
+
+    // Point at the frame allocator until the first frame writes the real ranges
+    VkDescriptorBufferInfo frame_allocator_info = { render_pass->frame_allocator.buffer, 0, VK_WHOLE_SIZE };
+    for (u32 i = 0; i < render_pass->frames_in_flight; ++i) {
+        instance_descriptors.push_back(BindlessDescriptors::RegisterBuffer(frame_allocator_info));
+    }
+
+    static_hash = HASH_BASIS;
+
+    pipeline = PipelineVariants::Wait(&pipeline_info);
+}
+
+void CascadedShadowMaps::Destroy() {
+    VkDevice device = VulkanDevice::handle;
+
+    BindlessDescriptors::ReleaseTexture(texture);
+    for (u32 descriptor : instance_descriptors) {
+        BindlessDescriptors::ReleaseBuffer(descriptor);
+    }
+    instance_descriptors.clear();
+
+    for (u32 i = 0; i < CASCADE_COUNT; ++i) {
+        vkDestroyImageView(device, shadow_views[i], 0);
+        vkDestroyImageView(device, static_views[i], 0);
+    }
+
+    shadow_image.Destroy();
+    static_image.Destroy();
+
+    vkDestroySampler(device, sampler, 0);
+}
+
+void CascadedShadowMaps::Update(const glm::mat4 &projection, const glm::mat4 &view, glm::vec3 light_dir) {
+    light_dir = glm::normalize(light_dir);
+
+    bool light_moved = light_dir != this->light_dir;
+    this->light_dir = light_dir;
+
+    f32 z_near, z_far;
+    ProjectionDepthRange(projection, &z_near, &z_far);
+
+    f32 distance = std::min(shadow_distance, z_far);
+
+    // The corners of a slice at view depth d are d * (+-1 / p00, +-1 / p11), this is the
+    // squared length of that offset per unit of depth
+    f32 corner_slope = 1.0f / (projection[0][0] * projection[0][0]) + 1.0f / (projection[1][1] * projection[1][1]);
+
+    // A rotation only, so the snapping grid stays fixed in the world
+    glm::vec3 up = std::abs(light_dir.y) > 0.99f ? glm::vec3(0.0f, 0.0f, 1.0f) : glm::vec3(0.0f, 1.0f, 0.0f);
+    glm::mat4 light_view = glm::lookAt(glm::vec3(0.0f), -light_dir, up);
+    glm::mat4 inverse_view = glm::inverse(view);
+
+    f32 slice_near = z_near;
+    for (u32 i = 0; i < CASCADE_COUNT; ++i) {
+        ShadowCascade *cascade = &cascades[i];
+
+        // Blend of the logarithmic and the even split
+        f32 t = f32(i + 1) / CASCADE_COUNT;
+        f32 log_split = z_near * std::pow(distance / z_near, t);
+        f32 linear_split = z_near + (distance - z_near) * t;
+        f32 slice_far = linear_split + (log_split - linear_split) * split_lambda;
+
+        // Smallest sphere around the slice, its center is on the view axis where the near
+        // and far corners are equally far away
+        f32 center_depth = std::min((slice_near + slice_far) * (1.0f + corner_slope) * 0.5f, slice_far);
+        f32 far_offset = slice_far - center_depth;
+        f32 radius = std::sqrt(far_offset * far_offset + slice_far * slice_far * corner_slope);
+        // Float noise must not resize the box
+        radius = std::ceil(radius * 16.0f) / 16.0f;
+
+        // The snapped center is at most half a step off per axis, the box still encloses the sphere
+        f32 half_size = radius * SNAP_DIVISIONS / (SNAP_DIVISIONS - 1);
+        f32 step = 2.0f * half_size / SNAP_DIVISIONS;
+
+        glm::vec4 world_center = inverse_view * glm::vec4(0.0f, 0.0f, -center_depth, 1.0f);
+        glm::vec3 light_center = glm::vec3(light_view * world_center);
+        glm::vec3 center = glm::floor(light_center / step + 0.5f) * step;
+
+        if (light_moved || center != cascade->center || half_size != cascade->half_size) {
+            cascade->cache_valid = false;
+        }
+
+        cascade->center = center;
+        cascade->half_size = half_size;
+        cascade->split = slice_far;
+
+        // The light looks down -z, the box reaches caster_distance further towards the light
+        f32 depth = -center.z;
+        glm::mat4 light_projection = glm::ortho(
+            center.x - half_size, center.x + half_size,
+            center.y - half_size, center.y + half_size,
+            depth - half_size - caster_distance, depth + half_size
+        );
+
+        cascade->view_projection = light_projection * light_view;
+        cascade->frustum.Extract(cascade->view_projection);
+
+        slice_near = slice_far;
+    }
+}
+
+void CascadedShadowMaps::AddCasters(Model *model, span<const glm::mat4> transforms) {
+    ShadowCaster caster;
+    caster.model = model;
+    caster.transforms = transforms.data();
+    caster.count = (u32) transforms.size();
+
+    casters.push_back(caster);
+
+    if (!model->dynamic) {
+        static_hash = HashBytes(static_hash, &model->id, sizeof(model->id));
+        static_hash = HashBytes(static_hash, transforms.data(), transforms.size_bytes());
+    }
+}
+
+void CascadedShadowMaps::Render(VkCommandBuffer cmd_buf, FrameAllocator *frame_allocator, u32 frame, const CullingBounds *caster_bounds) {
+    // Static casters were added, removed or moved, every cache is stale
+    if (static_hash != cached_static_hash) {
+        for (ShadowCascade &cascade : cascades) {
+            cascade.cache_valid = false;
+        }
+        cached_static_hash = static_hash;
+    }
+    static_hash = HASH_BASIS;
+
+    u32 padded_count = (u32) caster_bounds->center_x.size();
+    caster_visibility.resize(CASCADE_COUNT * padded_count);
+
+    JobSystem::ParallelFor(CASCADE_COUNT, 1, [&](u32 begin, u32 end, u32 thread) {
+        for (u32 i = begin; i < end; ++i) {
+            cascades[i].frustum.CullAABBs(caster_bounds, &caster_visibility[i * padded_count], 0, padded_count);
+        }
+    });
+
+    instances.clear();
+    for (u32 i = 0; i < CASCADE_COUNT; ++i) {
+        CollectDraws(&cascades[i], &caster_visibility[i * padded_count]);
+    }
+
+    if (!instances.empty()) {
+        VkDescriptorBufferInfo instance_info = frame_allocator->Push(instances.data(), instances.size() * sizeof(glm::mat4));
+        BindlessDescriptors::UpdateBuffer(instance_descriptors[frame], instance_info);
+    }
+
+    VkImageCopy layer_copy = {};
+    layer_copy.srcSubresource.aspectMask = VK_IMAGE_ASPECT_DEPTH_BIT;
+    layer_copy.srcSubresource.layerCount = 1;
+    layer_copy.dstSubresource.aspectMask = VK_IMAGE_ASPECT_DEPTH_BIT;
+    layer_copy.dstSubresource.layerCount = 1;
+    layer_copy.extent = { MAP_SIZE, MAP_SIZE, 1 };
+
+    for (u32 i = 0; i < CASCADE_COUNT; ++i) {
+        ShadowCascade *cascade = &cascades[i];
+
+        RenderStats::BeginCascade(cmd_buf, i);
+
+        bool render_static = !cascade->cache_valid;
+        bool has_dynamic = !cascade->dynamic_draws.empty();
+
+        if (render_static) {
+            // Cleared anyway, the previous frame may still be copying from it
+            ImageBarrier(cmd_buf, static_image.handle, VK_IMAGE_ASPECT_DEPTH_BIT,
+                VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_DEPTH_ATTACHMENT_OPTIMAL,
+                VK_PIPELINE_STAGE_2_COPY_BIT, VK_ACCESS_2_NONE,
+                VK_PIPELINE_STAGE_2_EARLY_FRAGMENT_TESTS_BIT | VK_PIPELINE_STAGE_2_LATE_FRAGMENT_TESTS_BIT,
+                VK_ACCESS_2_DEPTH_STENCIL_ATTACHMENT_READ_BIT | VK_ACCESS_2_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT,
+                i, 1
+            );
+
+            DrawCasters(cmd_buf, cascade, cascade->static_draws, static_views[i], true, frame);
+
+            ImageBarrier(cmd_buf, static_image.handle, VK_IMAGE_ASPECT_DEPTH_BIT,
+                VK_IMAGE_LAYOUT_DEPTH_ATTACHMENT_OPTIMAL, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+                VK_PIPELINE_STAGE_2_LATE_FRAGMENT_TESTS_BIT, VK_ACCESS_2_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT,
+                VK_PIPELINE_STAGE_2_COPY_BIT, VK_ACCESS_2_TRANSFER_READ_BIT,
+                i, 1
+            );
+
+            cascade->cache_valid = true;
+        }
+
+        // Without dynamic casters, now and last frame, the shadow layer is still a copy of
+        // the unchanged static layer
+        if (render_static || has_dynamic || cascade->has_dynamic) {
+            // Overwritten by the copy, the previous frame may still be sampling it
+            ImageBarrier(cmd_buf, shadow_image.handle, VK_IMAGE_ASPECT_DEPTH_BIT,
+                VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+                VK_PIPELINE_STAGE_2_FRAGMENT_SHADER_BIT, VK_ACCESS_2_NONE,
+                VK_PIPELINE_STAGE_2_COPY_BIT, VK_ACCESS_2_TRANSFER_WRITE_BIT,
+                i, 1
+            );
+
+            layer_copy.srcSubresource.baseArrayLayer = i;
+            layer_copy.dstSubresource.baseArrayLayer = i;
+            vkCmdCopyImage(
+                cmd_buf,
+                static_image.handle, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+                shadow_image.handle, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+                1, &layer_copy
+            );
+
+            if (has_dynamic) {
+                ImageBarrier(cmd_buf, shadow_image.handle, VK_IMAGE_ASPECT_DEPTH_BIT,
+                    VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, VK_IMAGE_LAYOUT_DEPTH_ATTACHMENT_OPTIMAL,
+                    VK_PIPELINE_STAGE_2_COPY_BIT, VK_ACCESS_2_TRANSFER_WRITE_BIT,
+                    VK_PIPELINE_STAGE_2_EARLY_FRAGMENT_TESTS_BIT | VK_PIPELINE_STAGE_2_LATE_FRAGMENT_TESTS_BIT,
+                    VK_ACCESS_2_DEPTH_STENCIL_ATTACHMENT_READ_BIT | VK_ACCESS_2_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT,
+                    i, 1
+                );
+
+                DrawCasters(cmd_buf, cascade, cascade->dynamic_draws, shadow_views[i], false, frame);
+
+                ImageBarrier(cmd_buf, shadow_image.handle, VK_IMAGE_ASPECT_DEPTH_BIT,
+                    VK_IMAGE_LAYOUT_DEPTH_ATTACHMENT_OPTIMAL, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
+                    VK_PIPELINE_STAGE_2_LATE_FRAGMENT_TESTS_BIT, VK_ACCESS_2_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT,
+                    VK_PIPELINE_STAGE_2_FRAGMENT_SHADER_BIT, VK_ACCESS_2_SHADER_SAMPLED_READ_BIT,
+                    i, 1
+                );
+            } else {
+                ImageBarrier(cmd_buf, shadow_image.handle, VK_IMAGE_ASPECT_DEPTH_BIT,
+                    VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
+                    VK_PIPELINE_STAGE_2_COPY_BIT, VK_ACCESS_2_TRANSFER_WRITE_BIT,
+                    VK_PIPELINE_STAGE_2_FRAGMENT_SHADER_BIT, VK_ACCESS_2_SHADER_SAMPLED_READ_BIT,
+                    i, 1
+                );
+            }
+
+            cascade->has_dynamic = has_dynamic;
+        }
+
+        RenderStats::EndCascade(cmd_buf, i);
+    }
+
+    casters.clear();
+}
+
+// Static casters are only collected when the cache has to be rendered again
+void CascadedShadowMaps::CollectDraws(ShadowCascade *cascade, const u8 *visible) {
+    cascade->static_draws.clear();
+    cascade->dynamic_draws.clear();
+
+    u32 box = 0;
+    for (const ShadowCaster &caster : casters) {
+        bool dynamic = caster.model->dynamic;
+
+        if (!dynamic && cascade->cache_valid) {
+            box += caster.count;
+            continue;
+        }
+
+        ShadowDraw draw;
+        draw.model = caster.model;
+        draw.first_instance = (u32) instances.size();
+        draw.instance_count = 0;
+
+        for (u32 i = 0; i < caster.count; ++i) {
+            if (visible[box++]) {
+                instances.push_back(caster.transforms[i]);
+                draw.instance_count++;
+            }
+        }
+
+        if (draw.instance_count) {
+            (dynamic ? cascade->dynamic_draws : cascade->static_draws).push_back(draw);
+        }
+    }
+}
+
+void CascadedShadowMaps::DrawCasters(VkCommandBuffer cmd_buf, ShadowCascade *cascade, span<const ShadowDraw> draws, VkImageView view, bool clear, u32 frame) {
+    VkRenderingAttachmentInfo depth_attachment = { VK_STRUCTURE_TYPE_RENDERING_ATTACHMENT_INFO };
+    depth_attachment.imageView = view;
+    depth_attachment.imageLayout = VK_IMAGE_LAYOUT_DEPTH_ATTACHMENT_OPTIMAL;
+    depth_attachment.loadOp = clear ? VK_ATTACHMENT_LOAD_OP_CLEAR : VK_ATTACHMENT_LOAD_OP_LOAD;
+    depth_attachment.storeOp = VK_ATTACHMENT_STORE_OP_STORE;
+    depth_attachment.clearValue.depthStencil = { 1.0f, 0 };
+
+    VkRenderingInfo rendering_info = { VK_STRUCTURE_TYPE_RENDERING_INFO };
+    rendering_info.renderArea.extent = { MAP_SIZE, MAP_SIZE };
+    rendering_info.layerCount = 1;
+    rendering_info.pDepthAttachment = &depth_attachment;
+
+    vkCmdBeginRendering(cmd_buf, &rendering_info);
+
+    if (!draws.empty()) {
+        VkViewport viewport = { 0.0f, 0.0f, (f32) MAP_SIZE, (f32) MAP_SIZE, 0.0f, 1.0f };
+        VkRect2D scissor = { { 0, 0 }, { MAP_SIZE, MAP_SIZE } };
+
+        vkCmdSetViewport(cmd_buf, 0, 1, &viewport);
+        vkCmdSetScissor(cmd_buf, 0, 1, &scissor);
+
+        vkCmdBindPipeline(cmd_buf, VK_PIPELINE_BIND_POINT_GRAPHICS, pipeline->handle);
+        BindlessDescriptors::Bind(cmd_buf, VK_PIPELINE_BIND_POINT_GRAPHICS, pipeline->layout);
+        vkCmdBindIndexBuffer(cmd_buf, GeometryArena::index_buffer, 0, VK_INDEX_TYPE_UINT32);
+
+        ShadowConstants constants;
+        constants.view_projection = cascade->view_projection;
+        constants.vertex_buffer = GeometryArena::vertex_descriptor;
+        constants.instance_buffer = instance_descriptors[frame];
+        vkCmdPushConstants(cmd_buf, pipeline->layout, VK_SHADER_STAGE_VERTEX_BIT, 0, sizeof(ShadowConstants), &constants);
+
+        // Few casters per cascade, gl_InstanceIndex starts at first_instance
+        for (const ShadowDraw &draw : draws) {
+            for (Mesh *mesh : draw.model->meshes) {
+                GeometryAllocation *geometry = &mesh->geometry;
+                vkCmdDrawIndexed(cmd_buf, geometry->index_count, draw.instance_count, geometry->first_index, (s32) geometry->vertex_offset, draw.first_instance);
+
+                RenderStats::DrawCall();
+                RenderStats::CountTriangles((u64) geometry->index_count / 3 * draw.instance_count);
+            }
+        }
+    }
+
+    vkCmdEndRendering(cmd_buf);
+}
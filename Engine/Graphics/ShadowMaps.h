@@ -0,0 +1,118 @@
+#ifndef SHADOW_MAPS_H
+#define SHADOW_MAPS_H
+
+#include "Common.h"
+#include "Vulkan/VulkanRenderer.h"
+#include "Vulkan/VulkanPipelineVariants.h"
+#include "Graphics/Model.h"
+#include "Graphics/Frustum.h"
+
+// Push constants of shadow.vert
+struct ShadowConstants {
+    glm::mat4 view_projection;
+    u32 vertex_buffer;
+    u32 instance_buffer;
+};
+
+// Instances submitted this frame that throw shadows, the transforms live in the
+// InstanceBatch of the SceneRenderer until the end of the frame
+struct ShadowCaster {
+    Model *model;
+    const glm::mat4 *transforms;
+    u32 count;
+};
+
+// Instances of one model that reach one cascade, a range of the frame's shadow instances
+struct ShadowDraw {
+    Model *model;
+    u32 first_instance;
+    u32 instance_count;
+};
+
+struct ShadowCascade {
+    glm::mat4 view_projection;
+    Frustum frustum;
+    // View depth where the cascade ends
+    f32 split;
+
+    // Light space center and half size of the box, both only change in whole snapping steps
+    glm::vec3 center;
+    f32 half_size;
+
+    // The static layer holds the static casters of the box it was rendered with
+    bool cache_valid = false;
+    // The shadow layer holds more than a copy of the static layer
+    bool has_dynamic = false;
+
+    array<ShadowDraw> static_draws;
+    array<ShadowDraw> dynamic_draws;
+};
+
+// Cascaded shadow maps for the directional light. The view up to shadow_distance is split
+// into CASCADE_COUNT slices, each one covered by an orthographic box of the light. The box
+// encloses the bounding sphere of its slice, so its size does not change when the camera
+// turns, and its center moves in steps of a 1/SNAP_DIVISIONS of the box, a whole number of
+// texels, so the texels of static shadows stay where they are while the camera moves.
+//
+// Every cascade has two layers. The static layer caches the casters of models that are not
+// Model::dynamic, it is only rendered again when the box moves a step, the light turns or
+// the static casters change. Every frame the static layer is copied into the shadow layer
+// and the dynamic casters are drawn on top, simple.frag samples the shadow layers.
+struct CascadedShadowMaps {
+    static const u32 CASCADE_COUNT = 4;
+    static const u32 MAP_SIZE = 2048;
+    static const u32 SNAP_DIVISIONS = 16;
+
+    // Shadows end there, or at the far plane if it is closer
+    f32 shadow_distance = 60.0f;
+    // 0 splits the distance evenly, 1 logarithmically
+    f32 split_lambda = 0.75f;
+    // How far towards the light casters outside a box still throw shadows into it
+    f32 caster_distance = 50.0f;
+
+    // CASCADE_COUNT layers each, D32
+    VulkanImage shadow_image;
+    VulkanImage static_image;
+    VkImageView shadow_views[CASCADE_COUNT] = {};
+    VkImageView static_views[CASCADE_COUNT] = {};
+    // Compares with the depth of the fragment, linear filtering gives 2x2 PCF
+    VkSampler sampler = VK_NULL_HANDLE;
+    // Slot of the shadow layers in BindlessDescriptors
+    u32 texture = BindlessDescriptors::INVALID_INDEX;
+    // Owned by PipelineVariants
+    Pipeline *pipeline = 0;
+
+    ShadowCascade cascades[CASCADE_COUNT];
+    glm::vec3 light_dir = glm::vec3(0.0f);
+
+    // Casters of this frame, hashed to notice changes of the static ones
+    array<ShadowCaster> casters;
+    u64 static_hash = 0;
+    u64 cached_static_hash = 0;
+
+    // Padded caster count per cascade
+    array<u8> caster_visibility;
+    array<glm::mat4> instances;
+    // Per frame in flight, point at the frame's instance matrices
+    array<u32> instance_descriptors;
+
+    void Create(RenderPass *render_pass);
+    void Destroy();
+
+    // Places the cascades for the camera, light_dir points towards the light. Once per frame,
+    // before Render.
+    void Update(const glm::mat4 &projection, const glm::mat4 &view, glm::vec3 light_dir);
+
+    // The transforms have to stay untouched until Render
+    void AddCasters(Model *model, span<const glm::mat4> transforms);
+
+    // Renders what changed and leaves the shadow layers in SHADER_READ_ONLY_OPTIMAL. Has to
+    // be called outside of dynamic rendering, before the draws that sample the shadows.
+    // caster_bounds holds the padded world space boxes of all casters in the order they were added.
+    void Render(VkCommandBuffer cmd_buf, FrameAllocator *frame_allocator, u32 frame, const CullingBounds *caster_bounds);
+
+    void CollectDraws(ShadowCascade *cascade, const u8 *visible);
+    void DrawCasters(VkCommandBuffer cmd_buf, ShadowCascade *cascade, span<const ShadowDraw> draws, VkImageView view, bool clear, u32 frame);
+};
+
+#endif
@@ -0,0 +1,201 @@
+#include "SoftwareOcclusion.h"
+
+#include <math.h>
+#include <float.h>
+#include <algorithm>
+#include <immintrin.h>
+
+// Vertices closer than this to the camera plane are not projected
+static const f32 MIN_W = 1e-4f;
+
+void OcclusionBuffer::Clear(const glm::mat4 &view_projection) {
+    this->view_projection = view_projection;
+
+    depth.assign(WIDTH * HEIGHT, 1.0f);
+    occluder_triangles = 0;
+}
+
+static glm::vec3 ToScreen(glm::vec4 clip) {
+    f32 inv_w = 1.0f / clip.w;
+    return glm::vec3(
+        (clip.x * inv_w * 0.5f + 0.5f) * OcclusionBuffer::WIDTH,
+        (clip.y * inv_w * 0.5f + 0.5f) * OcclusionBuffer::HEIGHT,
+        clip.z * inv_w
+    );
+}
+
+// Clamped before the conversion, projected points close to the camera can be far outside
+static f32 ClampPixel(f32 coordinate, u32 size) {
+    return std::clamp(floorf(coordinate), 0.0f, (f32) (size - 1));
+}
+
+void OcclusionBuffer::RasterizeTriangles(const glm::mat4 &transform, span<const glm::vec3> vertices) {
+    glm::mat4 mvp = view_projection * transform;
+
+    for (u64 i = 0; i + 2 < vertices.size(); i += 3) {
+        glm::vec4 clip0 = mvp * glm::vec4(vertices[i + 0], 1.0f);
+        glm::vec4 clip1 = mvp * glm::vec4(vertices[i + 1], 1.0f);
+        glm::vec4 clip2 = mvp * glm::vec4(vertices[i + 2], 1.0f);
+
+        // Vulkan clips at z = 0, the near plane. Clipping would add vertices,
+        // dropping an occluder triangle that crosses it is always safe.
+        if (clip0.z < 0.0f || clip1.z < 0.0f || clip2.z < 0.0f) {
+            continue;
+        }
+        if (clip0.w < MIN_W || clip1.w < MIN_W || clip2.w < MIN_W) {
+            continue;
+        }
+
+        RasterizeTriangle(ToScreen(clip0), ToScreen(clip1), ToScreen(clip2));
+    }
+}
+
+void OcclusionBuffer::RasterizeTriangle(glm::vec3 v0, glm::vec3 v1, glm::vec3 v2) {
+    f32 area = (v1.x - v0.x) * (v2.y - v0.y) - (v1.y - v0.y) * (v2.x - v0.x);
+    if (fabsf(area) < 1e-6f) {
+        return;
+    }
+
+    // Both windings are rasterized, the inside test wants a positive area
+    if (area < 0.0f) {
+        std::swap(v1, v2);
+        area = -area;
+    }
+
+    f32 left = std::min({ v0.x, v1.x, v2.x });
+    f32 right = std::max({ v0.x, v1.x, v2.x });
+    f32 top = std::min({ v0.y, v1.y, v2.y });
+    f32 bottom = std::max({ v0.y, v1.y, v2.y });
+
+    if (right < 0.0f || left >= (f32) WIDTH || bottom < 0.0f || top >= (f32) HEIGHT) {
+        return;
+    }
+
+    s32 min_x = (s32) ClampPixel(left, WIDTH);
+    s32 max_x = (s32) ClampPixel(right, WIDTH);
+    s32 min_y = (s32) ClampPixel(top, HEIGHT);
+    s32 max_y = (s32) ClampPixel(bottom, HEIGHT);
+
+    // Rows start on a multiple of 4 so every load stays inside the row
+    min_x &= ~3;
+
+    occluder_triangles++;
+
+    // Edge function of a -> b is a*x + b*y + c, positive on the inner side.
+    // The edge opposite of a vertex gives its barycentric weight.
+    glm::vec3 edges[3];
+    glm::vec3 points[3] = { v0, v1, v2 };
+    for (u32 i = 0; i < 3; ++i) {
+        glm::vec3 a = points[(i + 1) % 3];
+        glm::vec3 b = points[(i + 2) % 3];
+
+        f32 edge_a = -(b.y - a.y);
+        f32 edge_b = b.x - a.x;
+        edges[i] = glm::vec3(edge_a, edge_b, -(edge_a * a.x + edge_b * a.y));
+    }
+
+    // Depth is affine in screen space
+    f32 inv_area = 1.0f / area;
+    glm::vec3 depth_plane = (edges[0] * v0.z + edges[1] * v1.z + edges[2] * v2.z) * inv_area;
+
+    __m128 lane_offsets = _mm_setr_ps(0.5f, 1.5f, 2.5f, 3.5f);
+    __m128 zero = _mm_setzero_ps();
+
+    __m128 edge_a[3], edge_b[3], edge_c[3];
+    for (u32 i = 0; i < 3; ++i) {
+        edge_a[i] = _mm_set1_ps(edges[i].x);
+        edge_b[i] = _mm_set1_ps(edges[i].y);
+        edge_c[i] = _mm_set1_ps(edges[i].z);
+    }
+
+    __m128 depth_a = _mm_set1_ps(depth_plane.x);
+    __m128 depth_b = _mm_set1_ps(depth_plane.y);
+    __m128 depth_c = _mm_set1_ps(depth_plane.z);
+
+    for (s32 y = min_y; y <= max_y; ++y) {
+        __m128 py = _mm_set1_ps((f32) y + 0.5f);
+        f32 *row = &depth[(u64) y * WIDTH];
+
+        __m128 row_edges[3];
+        for (u32 i = 0; i < 3; ++i) {
+            row_edges[i] = _mm_add_ps(_mm_mul_ps(edge_b[i], py), edge_c[i]);
+        }
+        __m128 row_depth = _mm_add_ps(_mm_mul_ps(depth_b, py), depth_c);
+
+        for (s32 x = min_x; x <= max_x; x += 4) {
+            __m128 px = _mm_add_ps(_mm_set1_ps((f32) x), lane_offsets);
+
+            __m128 e0 = _mm_add_ps(_mm_mul_ps(edge_a[0], px), row_edges[0]);
+            __m128 e1 = _mm_add_ps(_mm_mul_ps(edge_a[1], px), row_edges[1]);
+            __m128 e2 = _mm_add_ps(_mm_mul_ps(edge_a[2], px), row_edges[2]);
+
+            __m128 inside = _mm_and_ps(_mm_and_ps(_mm_cmpge_ps(e0, zero), _mm_cmpge_ps(e1, zero)), _mm_cmpge_ps(e2, zero));
+            if (!_mm_movemask_ps(inside)) {
+                continue;
+            }
+
+            __m128 z = _mm_add_ps(_mm_mul_ps(depth_a, px), row_depth);
+            __m128 old_depth = _mm_loadu_ps(row + x);
+            __m128 new_depth = _mm_min_ps(old_depth, z);
+
+            _mm_storeu_ps(row + x, _mm_or_ps(_mm_and_ps(inside, new_depth), _mm_andnot_ps(inside, old_depth)));
+        }
+    }
+}
+
+bool OcclusionBuffer::IsVisible(const glm::mat4 &transform, glm::vec3 bounds_min, glm::vec3 bounds_max) const {
+    glm::mat4 mvp = view_projection * transform;
+
+    glm::vec2 screen_min = glm::vec2(FLT_MAX);
+    glm::vec2 screen_max = glm::vec2(-FLT_MAX);
+    f32 nearest = FLT_MAX;
+
+    for (u32 i = 0; i < 8; ++i) {
+        glm::vec3 corner = glm::vec3(
+            (i & 1) ? bounds_max.x : bounds_min.x,
+            (i & 2) ? bounds_max.y : bounds_min.y,
+            (i & 4) ? bounds_max.z : bounds_min.z
+        );
+
+        glm::vec4 clip = mvp * glm::vec4(corner, 1.0f);
+
+        // Reaches behind the camera, there is no usable rectangle
+        if (clip.w < MIN_W) {
+            return true;
+        }
+
+        glm::vec3 screen = ToScreen(clip);
+        screen_min = glm::min(screen_min, glm::vec2(screen));
+        screen_max = glm::max(screen_max, glm::vec2(screen));
+        nearest = std::min(nearest, screen.z);
+    }
+
+    s32 min_x = (s32) ClampPixel(screen_min.x, WIDTH);
+    s32 max_x = (s32) ClampPixel(screen_max.x, WIDTH);
+    s32 min_y = (s32) ClampPixel(screen_min.y, HEIGHT);
+    s32 max_y = (s32) ClampPixel(screen_max.y, HEIGHT);
+
+    s32 first_x = min_x & ~3;
+
+    __m128 lane_x = _mm_setr_ps(0.0f, 1.0f, 2.0f, 3.0f);
+    __m128 lowest_x = _mm_set1_ps((f32) min_x - 0.5f);
+    __m128 highest_x = _mm_set1_ps((f32) max_x + 0.5f);
+    __m128 nearest_depth = _mm_set1_ps(nearest);
+
+    // Visible as soon as one covered pixel is not in front of the box
+    for (s32 y = min_y; y <= max_y; ++y) {
+        const f32 *row = &depth[(u64) y * WIDTH];
+
+        for (s32 x = first_x; x <= max_x; x += 4) {
+            __m128 px = _mm_add_ps(_mm_set1_ps((f32) x), lane_x);
+            __m128 in_rect = _mm_and_ps(_mm_cmpgt_ps(px, lowest_x), _mm_cmplt_ps(px, highest_x));
+            __m128 not_hidden = _mm_cmple_ps(nearest_depth, _mm_loadu_ps(row + x));
+
+            if (_mm_movemask_ps(_mm_and_ps(in_rect, not_hidden))) {
+                return true;
+            }
+        }
+    }
+
+    return false;
+}
@@ -0,0 +1,38 @@
+#ifndef SOFTWARE_OCCLUSION_H
+#define SOFTWARE_OCCLUSION_H
+
+#include "Common.h"
+
+#define GLM_FORCE_DEPTH_ZERO_TO_ONE
+#include <glm/glm.hpp>
+
+// Low resolution depth buffer the CPU rasterizes occluders into, so hidden instances can be
+// dropped before anything is recorded. Needs no GPU at all. Depth is 0 at the near plane and
+// 1 at the far plane like the depth attachment, the buffer keeps the nearest depth per pixel.
+//
+// Rows are processed 4 pixels at a time with SSE. Pixels are only covered if their center is
+// inside a triangle, and triangles that cross the near plane are skipped, so the occluders
+// never hide more than they would on the GPU at this resolution.
+struct OcclusionBuffer {
+    // WIDTH has to be a multiple of 4
+    static const u32 WIDTH = 256;
+    static const u32 HEIGHT = 128;
+
+    array<f32> depth;
+    glm::mat4 view_projection;
+
+    u32 occluder_triangles = 0;
+
+    void Clear(const glm::mat4 &view_projection);
+
+    // Three model space vertices per triangle
+    void RasterizeTriangles(const glm::mat4 &transform, span<const glm::vec3> vertices);
+
+    // False if the model space box is behind the rasterized occluders everywhere it covers
+    bool IsVisible(const glm::mat4 &transform, glm::vec3 bounds_min, glm::vec3 bounds_max) const;
+
+    // x and y in pixels, z is depth
+    void RasterizeTriangle(glm::vec3 v0, glm::vec3 v1, glm::vec3 v2);
+};
+
+#endif
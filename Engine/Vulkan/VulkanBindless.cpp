@@ -0,0 +1,147 @@
+#include "VulkanBindless.h"
+
+#include "VulkanRenderer.h"
+
+VkDescriptorSetLayout BindlessDescriptors::set_layout = VK_NULL_HANDLE;
+VkDescriptorPool BindlessDescriptors::pool = VK_NULL_HANDLE;
+VkDescriptorSet BindlessDescriptors::set = VK_NULL_HANDLE;
+array<u32> BindlessDescriptors::free_buffers;
+array<u32> BindlessDescriptors::free_textures;
+
+void BindlessDescriptors::Create() {
+    VkDevice device = VulkanDevice::handle;
+
+    VkDescriptorSetLayoutBinding bindings[2] = {};
+    bindings[0].binding = 0;
+    bindings[0].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+    bindings[0].descriptorCount = MAX_BUFFERS;
+    bindings[0].stageFlags = VK_SHADER_STAGE_ALL;
+    bindings[1].binding = 1;
+    bindings[1].descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+    bindings[1].descriptorCount = MAX_TEXTURES;
+    bindings[1].stageFlags = VK_SHADER_STAGE_ALL;
+
+    // Unused slots stay unwritten, slots of finished frames are rewritten while the set is bound
+    VkDescriptorBindingFlags binding_flags[2] = {
+        VK_DESCRIPTOR_BINDING_PARTIALLY_BOUND_BIT | VK_DESCRIPTOR_BINDING_UPDATE_AFTER_BIND_BIT | VK_DESCRIPTOR_BINDING_UPDATE_UNUSED_WHILE_PENDING_BIT,
+        VK_DESCRIPTOR_BINDING_PARTIALLY_BOUND_BIT | VK_DESCRIPTOR_BINDING_UPDATE_AFTER_BIND_BIT | VK_DESCRIPTOR_BINDING_UPDATE_UNUSED_WHILE_PENDING_BIT
+    };
+
+    VkDescriptorSetLayoutBindingFlagsCreateInfo binding_flags_info = { VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_BINDING_FLAGS_CREATE_INFO };
+    binding_flags_info.bindingCount = ARRAY_SIZE(binding_flags);
+    binding_flags_info.pBindingFlags = binding_flags;
+
+    VkDescriptorSetLayoutCreateInfo set_layout_info = { VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO };
+    set_layout_info.pNext = &binding_flags_info;
+    set_layout_info.flags = VK_DESCRIPTOR_SET_LAYOUT_CREATE_UPDATE_AFTER_BIND_POOL_BIT;
+    set_layout_info.bindingCount = ARRAY_SIZE(bindings);
+    set_layout_info.pBindings = bindings;
+
+    VK_CHECK(vkCreateDescriptorSetLayout(device, &set_layout_info, 0, &set_layout));
+
+    VkDescriptorPoolSize pool_sizes[2] = {
+        { VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, MAX_BUFFERS },
+        { VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, MAX_TEXTURES }
+    };
+
+    VkDescriptorPoolCreateInfo pool_info = { VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO };
+    pool_info.flags = VK_DESCRIPTOR_POOL_CREATE_UPDATE_AFTER_BIND_BIT;
+    pool_info.maxSets = 1;
+    pool_info.poolSizeCount = ARRAY_SIZE(pool_sizes);
+    pool_info.pPoolSizes = pool_sizes;
+
+    VK_CHECK(vkCreateDescriptorPool(device, &pool_info, 0, &pool));
+
+    VkDescriptorSetAllocateInfo allocate_info = { VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO };
+    allocate_info.descriptorPool = pool;
+    allocate_info.descriptorSetCount = 1;
+    allocate_info.pSetLayouts = &set_layout;
+
+    VK_CHECK(vkAllocateDescriptorSets(device, &allocate_info, &set));
+
+    // Low indices are handed out first
+    free_buffers.resize(MAX_BUFFERS);
+    for (u32 i = 0; i < MAX_BUFFERS; ++i) {
+        free_buffers[i] = MAX_BUFFERS - 1 - i;
+    }
+
+    free_textures.resize(MAX_TEXTURES);
+    for (u32 i = 0; i < MAX_TEXTURES; ++i) {
+        free_textures[i] = MAX_TEXTURES - 1 - i;
+    }
+}
+
+void BindlessDescriptors::Destroy() {
+    VkDevice device = VulkanDevice::handle;
+
+    // Frees the set as well
+    vkDestroyDescriptorPool(device, pool, 0);
+    vkDestroyDescriptorSetLayout(device, set_layout, 0);
+
+    free_buffers.clear();
+    free_textures.clear();
+}
+
+u32 BindlessDescriptors::RegisterBuffer(VkDescriptorBufferInfo info) {
+    if (free_buffers.empty()) {
+        LogFatal("Bindless buffer table is full (%d buffers)", MAX_BUFFERS);
+    }
+
+    u32 index = free_buffers.back();
+    free_buffers.pop_back();
+
+    UpdateBuffer(index, info);
+
+    return index;
+}
+
+void BindlessDescriptors::UpdateBuffer(u32 index, VkDescriptorBufferInfo info) {
+    VkWriteDescriptorSet write_descriptor = { VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET };
+    write_descriptor.dstSet = set;
+    write_descriptor.dstBinding = 0;
+    write_descriptor.dstArrayElement = index;
+    write_descriptor.descriptorCount = 1;
+    write_descriptor.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+    write_descriptor.pBufferInfo = &info;
+
+    vkUpdateDescriptorSets(VulkanDevice::handle, 1, &write_descriptor, 0, 0);
+}
+
+void BindlessDescriptors::ReleaseBuffer(u32 index) {
+    // The slot keeps its stale descriptor, partially bound allows that as long as nobody reads it
+    free_buffers.push_back(index);
+}
+
+u32 BindlessDescriptors::RegisterTexture(VkImageView view, VkSampler sampler) {
+    if (free_textures.empty()) {
+        LogFatal("Bindless texture table is full (%d textures)", MAX_TEXTURES);
+    }
+
+    u32 index = free_textures.back();
+    free_textures.pop_back();
+
+    VkDescriptorImageInfo image_info;
+    image_info.sampler = sampler;
+    image_info.imageView = view;
+    image_info.imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+
+    VkWriteDescriptorSet write_descriptor = { VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET };
+    write_descriptor.dstSet = set;
+    write_descriptor.dstBinding = 1;
+    write_descriptor.dstArrayElement = index;
+    write_descriptor.descriptorCount = 1;
+    write_descriptor.descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+    write_descriptor.pImageInfo = &image_info;
+
+    vkUpdateDescriptorSets(VulkanDevice::handle, 1, &write_descriptor, 0, 0);
+
+    return index;
+}
+
+void BindlessDescriptors::ReleaseTexture(u32 index) {
+    free_textures.push_back(index);
+}
+
+void BindlessDescriptors::Bind(VkCommandBuffer cmd_buf, VkPipelineBindPoint bind_point, VkPipelineLayout layout) {
+    vkCmdBindDescriptorSets(cmd_buf, bind_point, layout, 0, 1, &set, 0, 0);
+}
@@ -0,0 +1,41 @@
+#ifndef VULKAN_BINDLESS_H
+#define VULKAN_BINDLESS_H
+
+#include <Vulkan/vulkan.h>
+
+#include "Common.h"
+
+// Singleton with one global descriptor set that holds every storage buffer and texture the
+// draws read. Resources are registered once and keep their index, shaders get the indices
+// through push constants, so a draw binds the set and never writes a descriptor.
+//
+// Binding 0 is an array of storage buffers, binding 1 an array of combined image samplers.
+// Slots are written with update after bind: a slot may be rewritten while the set is bound,
+// as long as no pending command buffer reads that slot.
+struct BindlessDescriptors {
+    static const u32 MAX_BUFFERS = 1024;
+    static const u32 MAX_TEXTURES = 4096;
+    static const u32 INVALID_INDEX = ~0u;
+
+    static VkDescriptorSetLayout set_layout;
+    static VkDescriptorPool pool;
+    static VkDescriptorSet set;
+
+    static array<u32> free_buffers;
+    static array<u32> free_textures;
+
+    static void Create();
+    static void Destroy();
+
+    static u32 RegisterBuffer(VkDescriptorBufferInfo info);
+    static void UpdateBuffer(u32 index, VkDescriptorBufferInfo info);
+    static void ReleaseBuffer(u32 index);
+
+    static u32 RegisterTexture(VkImageView view, VkSampler sampler);
+    static void ReleaseTexture(u32 index);
+
+    // Set 0 of the layout has to be set_layout
+    static void Bind(VkCommandBuffer cmd_buf, VkPipelineBindPoint bind_point, VkPipelineLayout layout);
+};
+
+#endif
@@ -0,0 +1,257 @@
+#include "VulkanGeometry.h"
+
+#include "VulkanRenderer.h"
+
+VkBuffer GeometryArena::vertex_buffer = VK_NULL_HANDLE;
+VulkanAllocation GeometryArena::vertex_allocation = {};
+TLSFAllocator GeometryArena::vertex_tlsf;
+VkBuffer GeometryArena::index_buffer = VK_NULL_HANDLE;
+VulkanAllocation GeometryArena::index_allocation = {};
+TLSFAllocator GeometryArena::index_tlsf;
+array<GeometryAllocation *> GeometryArena::allocations;
+u32 GeometryArena::vertex_descriptor = BindlessDescriptors::INVALID_INDEX;
+
+static void CreateArenaBuffer(VkDeviceSize size, VkBufferUsageFlags usage, VkBuffer *buffer, VulkanAllocation *allocation) {
+    VkDevice device = VulkanDevice::handle;
+
+    VkBufferCreateInfo buffer_info = { VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO };
+    buffer_info.size = size;
+    // Compaction copies from the old buffers to the new ones
+    buffer_info.usage = usage | VK_BUFFER_USAGE_TRANSFER_SRC_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT;
+    buffer_info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+
+    VK_CHECK(vkCreateBuffer(device, &buffer_info, 0, buffer));
+    *allocation = VulkanAllocator::AllocateBuffer(*buffer, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+}
+
+static void DestroyArenaBuffer(VkBuffer buffer, VulkanAllocation *allocation) {
+    vkDestroyBuffer(VulkanDevice::handle, buffer, 0);
+    VulkanAllocator::Free(allocation);
+}
+
+void GeometryArena::Create() {
+    CreateArenaBuffer((VkDeviceSize) INITIAL_VERTEX_CAPACITY * sizeof(Vertex), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, &vertex_buffer, &vertex_allocation);
+    CreateArenaBuffer((VkDeviceSize) INITIAL_INDEX_CAPACITY * sizeof(u32), VK_BUFFER_USAGE_INDEX_BUFFER_BIT, &index_buffer, &index_allocation);
+
+    vertex_tlsf.Create(INITIAL_VERTEX_CAPACITY);
+    index_tlsf.Create(INITIAL_INDEX_CAPACITY);
+
+    vertex_descriptor = BindlessDescriptors::RegisterBuffer(VertexBufferInfo());
+}
+
+void GeometryArena::Destroy() {
+    if (allocations.size()) {
+        LogError("GeometryArena: %d allocations were not freed", (u32) allocations.size());
+    }
+
+    vertex_tlsf.Destroy();
+    index_tlsf.Destroy();
+
+    BindlessDescriptors::ReleaseBuffer(vertex_descriptor);
+
+    DestroyArenaBuffer(vertex_buffer, &vertex_allocation);
+    DestroyArenaBuffer(index_buffer, &index_allocation);
+
+    allocations.clear();
+}
+
+static bool AllocateRanges(GeometryAllocation *allocation, u32 vertex_count, u32 index_count) {
+    TLSFBlock *vertex_range = GeometryArena::vertex_tlsf.Allocate(vertex_count, 1);
+    if (!vertex_range) {
+        return false;
+    }
+
+    TLSFBlock *index_range = GeometryArena::index_tlsf.Allocate(index_count, 1);
+    if (!index_range) {
+        GeometryArena::vertex_tlsf.Free(vertex_range);
+        return false;
+    }
+
+    allocation->vertex_range = vertex_range;
+    allocation->vertex_offset = (u32) vertex_range->offset;
+    allocation->vertex_count = vertex_count;
+    allocation->index_range = index_range;
+    allocation->first_index = (u32) index_range->offset;
+    allocation->index_count = index_count;
+
+    return true;
+}
+
+void GeometryArena::Allocate(GeometryAllocation *allocation, const Vertex *vertices, u32 vertex_count, const u32 *indices, u32 index_count) {
+    if (!AllocateRanges(allocation, vertex_count, index_count)) {
+        u64 vertex_capacity = vertex_tlsf.capacity;
+        u64 index_capacity = index_tlsf.capacity;
+
+        // Fragmented but large enough: compacting is enough. Otherwise double until it fits.
+        // The TLSF rounds sizes up to MIN_SPLIT and a request up to the next size class, which
+        // is at most count >> SL_LOG2 more, so the free space needs that much slack.
+        u64 vertex_needed = vertex_tlsf.used + vertex_count + (vertex_count >> TLSFAllocator::SL_LOG2) + TLSFAllocator::MIN_SPLIT;
+        u64 index_needed = index_tlsf.used + index_count + (index_count >> TLSFAllocator::SL_LOG2) + TLSFAllocator::MIN_SPLIT;
+
+        while (vertex_capacity < vertex_needed) {
+            vertex_capacity *= 2;
+        }
+        while (index_capacity < index_needed) {
+            index_capacity *= 2;
+        }
+
+        while (true) {
+            if (vertex_capacity > UINT32_MAX || index_capacity > UINT32_MAX) {
+                LogFatal("GeometryArena: out of space for %d vertices and %d indices", vertex_count, index_count);
+            }
+
+            Rebuild((u32) vertex_capacity, (u32) index_capacity);
+
+            if (AllocateRanges(allocation, vertex_count, index_count)) {
+                break;
+            }
+
+            // Never rebuild at a capacity that already failed
+            vertex_capacity *= 2;
+            index_capacity *= 2;
+        }
+    }
+
+    allocation->slot = (u32) allocations.size();
+    allocations.push_back(allocation);
+
+    VulkanUploader::UploadBuffer(vertex_buffer, (VkDeviceSize) allocation->vertex_offset * sizeof(Vertex), vertices, (VkDeviceSize) vertex_count * sizeof(Vertex));
+    VulkanUploader::UploadBuffer(index_buffer, (VkDeviceSize) allocation->first_index * sizeof(u32), indices, (VkDeviceSize) index_count * sizeof(u32));
+}
+
+void GeometryArena::Free(GeometryAllocation *allocation) {
+    if (!allocation->vertex_range) {
+        return;
+    }
+
+    vertex_tlsf.Free(allocation->vertex_range);
+    index_tlsf.Free(allocation->index_range);
+
+    GeometryAllocation *last = allocations.back();
+    allocations[allocation->slot] = last;
+    last->slot = allocation->slot;
+    allocations.pop_back();
+
+    *allocation = {};
+}
+
+void GeometryArena::Compact() {
+    Rebuild((u32) vertex_tlsf.capacity, (u32) index_tlsf.capacity);
+}
+
+void GeometryArena::Rebuild(u32 vertex_capacity, u32 index_capacity) {
+    VulkanTimeline *timeline = &VulkanDevice::graphics_timeline;
+
+    // Pending uploads have to land in the old buffers first and no frame may read them anymore
+    VulkanUploader::Wait(VulkanUploader::Flush());
+    timeline->Wait(timeline->submitted);
+
+    VkBuffer new_vertex_buffer, new_index_buffer;
+    VulkanAllocation new_vertex_allocation, new_index_allocation;
+    CreateArenaBuffer((VkDeviceSize) vertex_capacity * sizeof(Vertex), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, &new_vertex_buffer, &new_vertex_allocation);
+    CreateArenaBuffer((VkDeviceSize) index_capacity * sizeof(u32), VK_BUFFER_USAGE_INDEX_BUFFER_BIT, &new_index_buffer, &new_index_allocation);
+
+    vertex_tlsf.Destroy();
+    index_tlsf.Destroy();
+    vertex_tlsf = {};
+    index_tlsf = {};
+    vertex_tlsf.Create(vertex_capacity);
+    index_tlsf.Create(index_capacity);
+
+    array<VkBufferCopy> vertex_copies;
+    array<VkBufferCopy> index_copies;
+
+    // A fresh TLSF hands out the ranges back to back
+    for (GeometryAllocation *allocation : allocations) {
+        VkBufferCopy vertex_copy;
+        vertex_copy.srcOffset = (VkDeviceSize) allocation->vertex_offset * sizeof(Vertex);
+        vertex_copy.size = (VkDeviceSize) allocation->vertex_count * sizeof(Vertex);
+
+        VkBufferCopy index_copy;
+        index_copy.srcOffset = (VkDeviceSize) allocation->first_index * sizeof(u32);
+        index_copy.size = (VkDeviceSize) allocation->index_count * sizeof(u32);
+
+        if (!AllocateRanges(allocation, allocation->vertex_count, allocation->index_count)) {
+            LogFatal("GeometryArena: rebuild capacity too small");
+        }
+
+        vertex_copy.dstOffset = (VkDeviceSize) allocation->vertex_offset * sizeof(Vertex);
+        index_copy.dstOffset = (VkDeviceSize) allocation->first_index * sizeof(u32);
+
+        if (vertex_copy.size) {
+            vertex_copies.push_back(vertex_copy);
+        }
+        if (index_copy.size) {
+            index_copies.push_back(index_copy);
+        }
+    }
+
+    // The copies read the old buffers, they go once the copies are done
+    u64 copy_value = timeline->submitted;
+
+    if (vertex_copies.size() || index_copies.size()) {
+        // Both buffers are owned by the graphics family, so the copy runs there as well
+        VulkanCommandPool command_pool;
+        command_pool.Create(VulkanDevice::graphics_index);
+
+        VulkanCommandBuffers command_buffers;
+        command_buffers.Create(&command_pool, 1);
+        command_buffers.Begin(0, VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT);
+
+        VkCommandBuffer command_buffer = command_buffers.buffers[0];
+        if (vertex_copies.size()) {
+            vkCmdCopyBuffer(command_buffer, vertex_buffer, new_vertex_buffer, (u32) vertex_copies.size(), vertex_copies.data());
+        }
+        if (index_copies.size()) {
+            vkCmdCopyBuffer(command_buffer, index_buffer, new_index_buffer, (u32) index_copies.size(), index_copies.data());
+        }
+
+        // Frames submitted after the copies read the new buffers
+        VkMemoryBarrier2 memory_barrier = { VK_STRUCTURE_TYPE_MEMORY_BARRIER_2 };
+        memory_barrier.srcStageMask = VK_PIPELINE_STAGE_2_COPY_BIT;
+        memory_barrier.srcAccessMask = VK_ACCESS_2_TRANSFER_WRITE_BIT;
+        memory_barrier.dstStageMask = VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT;
+        memory_barrier.dstAccessMask = VK_ACCESS_2_MEMORY_READ_BIT;
+
+        VkDependencyInfo dependency_info = { VK_STRUCTURE_TYPE_DEPENDENCY_INFO };
+        dependency_info.memoryBarrierCount = 1;
+        dependency_info.pMemoryBarriers = &memory_barrier;
+
+        vkCmdPipelineBarrier2(command_buffer, &dependency_info);
+
+        command_buffers.End(0);
+
+        // Queue order keeps the frames behind the copies, the CPU does not have to wait for them
+        copy_value = timeline->Submit(command_buffer);
+
+        // Destroying the pool frees the command buffer
+        timeline->Defer([command_pool]() mutable { command_pool.Destroy(); }, copy_value);
+    }
+
+    VkBuffer old_vertex_buffer = vertex_buffer;
+    VkBuffer old_index_buffer = index_buffer;
+    VulkanAllocation old_vertex_allocation = vertex_allocation;
+    VulkanAllocation old_index_allocation = index_allocation;
+
+    timeline->Defer([=]() mutable {
+        DestroyArenaBuffer(old_vertex_buffer, &old_vertex_allocation);
+        DestroyArenaBuffer(old_index_buffer, &old_index_allocation);
+    }, copy_value);
+
+    vertex_buffer = new_vertex_buffer;
+    vertex_allocation = new_vertex_allocation;
+    index_buffer = new_index_buffer;
+    index_allocation = new_index_allocation;
+
+    // Nothing is pending after the wait above, the slot can be pointed at the new buffer
+    BindlessDescriptors::UpdateBuffer(vertex_descriptor, VertexBufferInfo());
+}
+
+VkDescriptorBufferInfo GeometryArena::VertexBufferInfo() {
+    VkDescriptorBufferInfo info;
+    info.buffer = vertex_buffer;
+    info.offset = 0;
+    info.range = VK_WHOLE_SIZE;
+
+    return info;
+}
@@ -0,0 +1,64 @@
+#ifndef VULKAN_GEOMETRY_H
+#define VULKAN_GEOMETRY_H
+
+#include <Vulkan/vulkan.h>
+
+#include "Common.h"
+#include "VulkanMemory.h"
+
+struct Vertex;
+
+// Location of one mesh inside the arena. vertex_offset and first_index are in elements and
+// go straight into vkCmdDrawIndexed, the indices themselves stay relative to the mesh.
+struct GeometryAllocation {
+    u32 vertex_offset = 0;
+    u32 vertex_count = 0;
+    u32 first_index = 0;
+    u32 index_count = 0;
+
+    TLSFBlock *vertex_range = 0;
+    TLSFBlock *index_range = 0;
+    // Position in GeometryArena::allocations
+    u32 slot = 0;
+};
+
+// Singleton that keeps the vertices of every mesh in one storage buffer and the indices in
+// one index buffer, so draws only differ in their offsets and never rebind geometry.
+// Ranges are handed out with TLSF. The arena remembers where every GeometryAllocation lives,
+// Compact() moves the data together and patches the offsets in place, so an allocation
+// must not be moved in memory while it is alive.
+struct GeometryArena {
+    static const u32 INITIAL_VERTEX_CAPACITY = 1024 * 1024;
+    static const u32 INITIAL_INDEX_CAPACITY = 4 * 1024 * 1024;
+
+    static VkBuffer vertex_buffer;
+    static VulkanAllocation vertex_allocation;
+    static TLSFAllocator vertex_tlsf;
+
+    static VkBuffer index_buffer;
+    static VulkanAllocation index_allocation;
+    static TLSFAllocator index_tlsf;
+
+    static array<GeometryAllocation *> allocations;
+
+    // Slot of the vertex buffer in BindlessDescriptors, stays the same when the arena grows
+    static u32 vertex_descriptor;
+
+    static void Create();
+    static void Destroy();
+
+    // Reserves space and queues the upload through VulkanUploader, the data can be freed right away.
+    // Compacts or grows the arena if the ranges do not fit.
+    static void Allocate(GeometryAllocation *allocation, const Vertex *vertices, u32 vertex_count, const u32 *indices, u32 index_count);
+    static void Free(GeometryAllocation *allocation);
+
+    // Packs all allocations to the start of the buffers. Waits for the GPU, only call this
+    // outside of a frame (e.g. after a level was unloaded).
+    static void Compact();
+    // Moves everything into new buffers of the given capacity, this is also how the arena grows
+    static void Rebuild(u32 vertex_capacity, u32 index_capacity);
+
+    static VkDescriptorBufferInfo VertexBufferInfo();
+};
+
+#endif
@@ -0,0 +1,560 @@
+#include "VulkanMemory.h"
+
+#include <bit>
+
+#include "VulkanRenderer.h"
+
+static VkDeviceSize AlignUp(VkDeviceSize value, VkDeviceSize alignment) {
+    return (value + alignment - 1) & ~(alignment - 1);
+}
+
+static void TLSFMapping(VkDeviceSize size, u32 *fl, u32 *sl) {
+    if (size < TLSFAllocator::SMALL_SIZE) {
+        *fl = 0;
+        *sl = (u32) (size / (TLSFAllocator::SMALL_SIZE / TLSFAllocator::SL_COUNT));
+    } else {
+        u32 log2 = (u32) std::bit_width(size) - 1;
+        *sl = (u32) (size >> (log2 - TLSFAllocator::SL_LOG2)) ^ TLSFAllocator::SL_COUNT;
+        *fl = log2 - TLSFAllocator::FL_SHIFT + 1;
+    }
+}
+
+void TLSFAllocator::Create(VkDeviceSize capacity) {
+    this->capacity = capacity;
+
+    first = new TLSFBlock();
+    first->offset = 0;
+    first->size = capacity;
+    InsertFree(first);
+}
+
+void TLSFAllocator::Destroy() {
+    TLSFBlock *block = first;
+    while (block) {
+        TLSFBlock *next = block->next_phys;
+        delete block;
+        block = next;
+    }
+
+    first = 0;
+    fl_bitmap = 0;
+    memset(sl_bitmap, 0, sizeof(sl_bitmap));
+    memset(free_lists, 0, sizeof(free_lists));
+}
+
+void TLSFAllocator::InsertFree(TLSFBlock *block) {
+    u32 fl, sl;
+    TLSFMapping(block->size, &fl, &sl);
+
+    TLSFBlock *head = free_lists[fl][sl];
+    block->free = true;
+    block->prev_free = 0;
+    block->next_free = head;
+    if (head) {
+        head->prev_free = block;
+    }
+
+    free_lists[fl][sl] = block;
+    fl_bitmap |= 1ull << fl;
+    sl_bitmap[fl] |= 1u << sl;
+}
+
+void TLSFAllocator::RemoveFree(TLSFBlock *block) {
+    u32 fl, sl;
+    TLSFMapping(block->size, &fl, &sl);
+
+    if (block->prev_free) {
+        block->prev_free->next_free = block->next_free;
+    } else {
+        free_lists[fl][sl] = block->next_free;
+    }
+
+    if (block->next_free) {
+        block->next_free->prev_free = block->prev_free;
+    }
+
+    if (!free_lists[fl][sl]) {
+        sl_bitmap[fl] &= ~(1u << sl);
+        if (!sl_bitmap[fl]) {
+            fl_bitmap &= ~(1ull << fl);
+        }
+    }
+
+    block->free = false;
+    block->prev_free = 0;
+    block->next_free = 0;
+}
+
+TLSFBlock *TLSFAllocator::FindFree(VkDeviceSize size) {
+    // Round up to the next list so that every block in the found list is large enough
+    if (size >= SMALL_SIZE) {
+        u32 log2 = (u32) std::bit_width(size) - 1;
+        size += (1ull << (log2 - SL_LOG2)) - 1;
+    }
+
+    u32 fl, sl;
+    TLSFMapping(size, &fl, &sl);
+    if (fl >= FL_COUNT) {
+        return 0;
+    }
+
+    u32 sl_map = sl_bitmap[fl] & (~0u << sl);
+    if (!sl_map) {
+        if (fl + 1 >= FL_COUNT) {
+            return 0;
+        }
+
+        u64 fl_map = fl_bitmap & (~0ull << (fl + 1));
+        if (!fl_map) {
+            return 0;
+        }
+
+        fl = (u32) std::countr_zero(fl_map);
+        sl_map = sl_bitmap[fl];
+    }
+
+    sl = (u32) std::countr_zero(sl_map);
+    return free_lists[fl][sl];
+}
+
+TLSFBlock *TLSFAllocator::Split(TLSFBlock *block, VkDeviceSize size) {
+    TLSFBlock *rest = new TLSFBlock();
+    rest->offset = block->offset + size;
+    rest->size = block->size - size;
+    rest->prev_phys = block;
+    rest->next_phys = block->next_phys;
+
+    if (block->next_phys) {
+        block->next_phys->prev_phys = rest;
+    }
+
+    block->next_phys = rest;
+    block->size = size;
+
+    return rest;
+}
+
+void TLSFAllocator::Merge(TLSFBlock *block, TLSFBlock *next) {
+    block->size += next->size;
+    block->next_phys = next->next_phys;
+
+    if (next->next_phys) {
+        next->next_phys->prev_phys = block;
+    }
+
+    delete next;
+}
+
+TLSFBlock *TLSFAllocator::Allocate(VkDeviceSize size, VkDeviceSize alignment) {
+    if (alignment < MIN_SPLIT) {
+        alignment = MIN_SPLIT;
+    }
+    size = AlignUp(size ? size : 1, MIN_SPLIT);
+
+    // Block offsets are always multiples of MIN_SPLIT, larger alignments may need padding in front
+    VkDeviceSize search_size = size + (alignment > MIN_SPLIT ? alignment - MIN_SPLIT : 0);
+
+    TLSFBlock *block = FindFree(search_size);
+    if (!block) {
+        return 0;
+    }
+
+    RemoveFree(block);
+
+    VkDeviceSize padding = AlignUp(block->offset, alignment) - block->offset;
+    if (padding) {
+        // Neighbours of a free block are never free, so the padding can't be merged away
+        TLSFBlock *aligned = Split(block, padding);
+        InsertFree(block);
+        block = aligned;
+    }
+
+    if (block->size - size >= MIN_SPLIT) {
+        TLSFBlock *tail = Split(block, size);
+        InsertFree(tail);
+    }
+
+    block->free = false;
+    used += block->size;
+    allocation_count++;
+
+    return block;
+}
+
+void TLSFAllocator::Free(TLSFBlock *block) {
+    used -= block->size;
+    allocation_count--;
+
+    TLSFBlock *next = block->next_phys;
+    if (next && next->free) {
+        RemoveFree(next);
+        Merge(block, next);
+    }
+
+    TLSFBlock *prev = block->prev_phys;
+    if (prev && prev->free) {
+        RemoveFree(prev);
+        Merge(prev, block);
+        block = prev;
+    }
+
+    InsertFree(block);
+}
+
+VkDeviceSize TLSFAllocator::LargestFreeBlock() {
+    VkDeviceSize largest = 0;
+    for (TLSFBlock *block = first; block; block = block->next_phys) {
+        if (block->free && block->size > largest) {
+            largest = block->size;
+        }
+    }
+
+    return largest;
+}
+
+array<VulkanMemoryBlock *> VulkanAllocator::pools[VK_MAX_MEMORY_TYPES * VulkanAllocator::POOLS_PER_TYPE];
+array<VulkanMemoryBlock *> VulkanAllocator::dedicated_blocks;
+VkDeviceSize VulkanAllocator::block_sizes[VK_MAX_MEMORY_TYPES] = {};
+u32 VulkanAllocator::device_allocation_count = 0;
+
+static VulkanMemoryBlock *CreateBlock(u32 memory_type, u32 pool, VkDeviceSize size, bool dedicated, bool linear) {
+    VkDevice device = VulkanDevice::handle;
+
+    if (VulkanAllocator::device_allocation_count >= VulkanPhysicalDevice::properties.limits.maxMemoryAllocationCount) {
+        return 0;
+    }
+
+    VkMemoryAllocateInfo allocate_info = { VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO };
+    allocate_info.allocationSize = size;
+    allocate_info.memoryTypeIndex = memory_type;
+
+    VkDeviceMemory memory;
+    if (vkAllocateMemory(device, &allocate_info, 0, &memory) != VK_SUCCESS) {
+        return 0;
+    }
+
+    VulkanAllocator::device_allocation_count++;
+
+    VulkanMemoryBlock *block = new VulkanMemoryBlock();
+    block->memory = memory;
+    block->size = size;
+    block->memory_type = memory_type;
+    block->pool = pool;
+    block->dedicated = dedicated;
+    block->linear = linear;
+    block->mapped = 0;
+    block->linear_head = 0;
+    block->linear_count = 0;
+
+    // Host visible blocks stay mapped for their whole lifetime, a VkDeviceMemory can only be mapped once
+    VkMemoryPropertyFlags properties = VulkanPhysicalDevice::memory_properties.memoryTypes[memory_type].propertyFlags;
+    if (properties & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT) {
+        VK_CHECK(vkMapMemory(device, memory, 0, VK_WHOLE_SIZE, 0, &block->mapped));
+    }
+
+    if (!dedicated && !linear) {
+        block->tlsf.Create(size);
+    }
+
+    return block;
+}
+
+static void DestroyBlock(VulkanMemoryBlock *block) {
+    VkDevice device = VulkanDevice::handle;
+
+    if (block->mapped) {
+        vkUnmapMemory(device, block->memory);
+    }
+
+    if (!block->dedicated && !block->linear) {
+        block->tlsf.Destroy();
+    }
+
+    vkFreeMemory(device, block->memory, 0);
+    VulkanAllocator::device_allocation_count--;
+
+    delete block;
+}
+
+static bool BlockEmpty(VulkanMemoryBlock *block) {
+    return block->tlsf.allocation_count == 0 && block->linear_count == 0;
+}
+
+static bool SubAllocate(VulkanMemoryBlock *block, VkMemoryRequirements requirements, VulkanAllocationStrategy strategy, VulkanAllocation *allocation) {
+    if (strategy == VULKAN_ALLOCATION_LINEAR) {
+        VkDeviceSize offset = AlignUp(block->linear_head, requirements.alignment);
+        if (offset + requirements.size > block->size) {
+            return false;
+        }
+
+        block->linear_head = offset + requirements.size;
+        block->linear_count++;
+
+        allocation->offset = offset;
+        allocation->range = 0;
+    } else {
+        TLSFBlock *range = block->tlsf.Allocate(requirements.size, requirements.alignment);
+        if (!range) {
+            return false;
+        }
+
+        allocation->offset = range->offset;
+        allocation->range = range;
+    }
+
+    allocation->memory = block->memory;
+    allocation->size = requirements.size;
+    allocation->block = block;
+    allocation->mapped = block->mapped ? (u8 *) block->mapped + allocation->offset : 0;
+
+    return true;
+}
+
+static bool AllocateFromPool(u32 memory_type, u32 pool, VkMemoryRequirements requirements, VulkanAllocationStrategy strategy, VulkanAllocation *allocation) {
+    VkDeviceSize block_size = VulkanAllocator::block_sizes[memory_type];
+
+    // Big resources would waste most of a block, give them their own memory
+    if (requirements.size > block_size / 2) {
+        VulkanMemoryBlock *block = CreateBlock(memory_type, pool, requirements.size, true, false);
+        if (!block) {
+            return false;
+        }
+
+        VulkanAllocator::dedicated_blocks.push_back(block);
+
+        allocation->memory = block->memory;
+        allocation->offset = 0;
+        allocation->size = requirements.size;
+        allocation->mapped = block->mapped;
+        allocation->block = block;
+        allocation->range = 0;
+
+        return true;
+    }
+
+    for (VulkanMemoryBlock *block : VulkanAllocator::pools[pool]) {
+        if (SubAllocate(block, requirements, strategy, allocation)) {
+            return true;
+        }
+    }
+
+    VulkanMemoryBlock *block = CreateBlock(memory_type, pool, block_size, false, strategy == VULKAN_ALLOCATION_LINEAR);
+    if (!block) {
+        return false;
+    }
+
+    VulkanAllocator::pools[pool].push_back(block);
+
+    return SubAllocate(block, requirements, strategy, allocation);
+}
+
+void VulkanAllocator::Create() {
+    VkPhysicalDeviceMemoryProperties *memory_properties = &VulkanPhysicalDevice::memory_properties;
+
+    for (u32 i = 0; i < memory_properties->memoryTypeCount; ++i) {
+        VkDeviceSize heap_size = memory_properties->memoryHeaps[memory_properties->memoryTypes[i].heapIndex].size;
+
+        // Small heaps (e.g. the 256MB host visible device local one) get smaller blocks
+        VkDeviceSize block_size = DEFAULT_BLOCK_SIZE;
+        while (block_size > heap_size / 8 && block_size > 1024 * 1024) {
+            block_size /= 2;
+        }
+
+        block_sizes[i] = block_size;
+    }
+}
+
+void VulkanAllocator::Destroy() {
+    u32 leaked = 0;
+
+    for (u32 i = 0; i < ARRAY_SIZE(pools); ++i) {
+        for (VulkanMemoryBlock *block : pools[i]) {
+            leaked += block->tlsf.allocation_count + block->linear_count;
+            DestroyBlock(block);
+        }
+        pools[i].clear();
+    }
+
+    leaked += (u32) dedicated_blocks.size();
+    for (VulkanMemoryBlock *block : dedicated_blocks) {
+        DestroyBlock(block);
+    }
+    dedicated_blocks.clear();
+
+    if (leaked) {
+        LogDev("VulkanAllocator destroyed with %u live allocations", leaked);
+    }
+}
+
+static u32 FindMemoryTypeIndex(u32 type_bits, VkMemoryPropertyFlags flags) {
+    for (u32 i = 0; i < VulkanPhysicalDevice::memory_properties.memoryTypeCount; ++i) {
+        if ((type_bits & (1 << i)) && (VulkanPhysicalDevice::memory_properties.memoryTypes[i].propertyFlags & flags) == flags) {
+            return i;
+        }
+    }
+
+    return ~0u;
+}
+
+u32 VulkanAllocator::FindMemoryType(u32 type_bits, VkMemoryPropertyFlags required, VkMemoryPropertyFlags preferred) {
+    u32 index = FindMemoryTypeIndex(type_bits, required | preferred);
+    if (index == ~0u) {
+        index = FindMemoryTypeIndex(type_bits, required);
+    }
+
+    return index;
+}
+
+VulkanAllocation VulkanAllocator::Allocate(VkMemoryRequirements requirements, VkMemoryPropertyFlags required, VkMemoryPropertyFlags preferred, bool image, VulkanAllocationStrategy strategy) {
+    VulkanAllocation allocation;
+
+    u32 type_bits = requirements.memoryTypeBits;
+    while (true) {
+        u32 memory_type = FindMemoryType(type_bits, required, preferred);
+        if (memory_type == ~0u) {
+            LogFatal("Failed to allocate %llu bytes of device memory", (unsigned long long) requirements.size);
+        }
+
+        u32 pool = memory_type * POOLS_PER_TYPE + (image ? 2 : 0) + (strategy == VULKAN_ALLOCATION_LINEAR ? 1 : 0);
+        if (AllocateFromPool(memory_type, pool, requirements, strategy, &allocation)) {
+            allocation.properties = VulkanPhysicalDevice::memory_properties.memoryTypes[memory_type].propertyFlags;
+            return allocation;
+        }
+
+        // Heap is full, try the next memory type that still satisfies the required flags
+        type_bits &= ~(1u << memory_type);
+    }
+}
+
+void VulkanAllocator::Free(VulkanAllocation *allocation) {
+    VulkanMemoryBlock *block = allocation->block;
+    if (!block) {
+        return;
+    }
+
+    TLSFBlock *range = allocation->range;
+    *allocation = {};
+
+    if (block->dedicated) {
+        for (u32 i = 0; i < dedicated_blocks.size(); ++i) {
+            if (dedicated_blocks[i] == block) {
+                dedicated_blocks[i] = dedicated_blocks.back();
+                dedicated_blocks.pop_back();
+                break;
+            }
+        }
+
+        DestroyBlock(block);
+        return;
+    }
+
+    if (block->linear) {
+        block->linear_count--;
+        if (!block->linear_count) {
+            block->linear_head = 0;
+        }
+    } else {
+        block->tlsf.Free(range);
+    }
+
+    if (!BlockEmpty(block)) {
+        return;
+    }
+
+    // Keep one empty block around per pool so that alloc/free patterns don't thrash vkAllocateMemory
+    array<VulkanMemoryBlock *> &pool = pools[block->pool];
+
+    u32 empty_count = 0;
+    for (VulkanMemoryBlock *other : pool) {
+        if (BlockEmpty(other)) {
+            empty_count++;
+        }
+    }
+
+    if (empty_count > 1) {
+        for (u32 i = 0; i < pool.size(); ++i) {
+            if (pool[i] == block) {
+                pool[i] = pool.back();
+                pool.pop_back();
+                break;
+            }
+        }
+
+        DestroyBlock(block);
+    }
+}
+
+VulkanAllocation VulkanAllocator::AllocateBuffer(VkBuffer buffer, VkMemoryPropertyFlags required, VkMemoryPropertyFlags preferred) {
+    VkDevice device = VulkanDevice::handle;
+
+    VkMemoryRequirements requirements;
+    vkGetBufferMemoryRequirements(device, buffer, &requirements);
+
+    VulkanAllocation allocation = Allocate(requirements, required, preferred, false);
+    VK_CHECK(vkBindBufferMemory(device, buffer, allocation.memory, allocation.offset));
+
+    return allocation;
+}
+
+VulkanAllocation VulkanAllocator::AllocateImage(VkImage image, VkMemoryPropertyFlags required, VulkanAllocationStrategy strategy) {
+    VkDevice device = VulkanDevice::handle;
+
+    VkMemoryRequirements requirements;
+    vkGetImageMemoryRequirements(device, image, &requirements);
+
+    VulkanAllocation allocation = Allocate(requirements, required, 0, true, strategy);
+    VK_CHECK(vkBindImageMemory(device, image, allocation.memory, allocation.offset));
+
+    return allocation;
+}
+
+void VulkanAllocator::GetStats(VulkanAllocatorStats *stats) {
+    *stats = {};
+    stats->device_allocation_count = device_allocation_count;
+
+    VkPhysicalDeviceMemoryProperties *memory_properties = &VulkanPhysicalDevice::memory_properties;
+
+    for (u32 i = 0; i < ARRAY_SIZE(pools); ++i) {
+        for (VulkanMemoryBlock *block : pools[i]) {
+            u32 heap = memory_properties->memoryTypes[block->memory_type].heapIndex;
+            VkDeviceSize used = block->linear ? block->linear_head : block->tlsf.used;
+
+            stats->block_count++;
+            stats->allocation_count += block->tlsf.allocation_count + block->linear_count;
+            stats->reserved_bytes += block->size;
+            stats->used_bytes += used;
+            stats->heap_reserved[heap] += block->size;
+            stats->heap_used[heap] += used;
+        }
+    }
+
+    for (VulkanMemoryBlock *block : dedicated_blocks) {
+        u32 heap = memory_properties->memoryTypes[block->memory_type].heapIndex;
+
+        stats->dedicated_count++;
+        stats->allocation_count++;
+        stats->reserved_bytes += block->size;
+        stats->used_bytes += block->size;
+        stats->heap_reserved[heap] += block->size;
+        stats->heap_used[heap] += block->size;
+    }
+}
+
+void VulkanAllocator::LogStats() {
+    VulkanAllocatorStats stats;
+    GetStats(&stats);
+
+    const f64 mb = 1024.0 * 1024.0;
+
+    LogInfo("GPU memory: %u allocations in %u blocks + %u dedicated (%u vkAllocateMemory calls), %.2f/%.2f MB used",
+        stats.allocation_count, stats.block_count, stats.dedicated_count, stats.device_allocation_count,
+        stats.used_bytes / mb, stats.reserved_bytes / mb);
+
+    for (u32 i = 0; i < VulkanPhysicalDevice::memory_properties.memoryHeapCount; ++i) {
+        if (!stats.heap_reserved[i]) {
+            continue;
+        }
+
+        LogInfo("    heap %u: %.2f/%.2f MB used", i, stats.heap_used[i] / mb, stats.heap_reserved[i] / mb);
+    }
+}
@@ -0,0 +1,127 @@
+#ifndef VULKAN_MEMORY_H
+#define VULKAN_MEMORY_H
+
+#include <Vulkan/vulkan.h>
+
+#include "Common.h"
+
+// Two-level segregated fit allocator. It only does the bookkeeping for a range of
+// [0, capacity) bytes, the memory itself is owned by whoever uses it.
+struct TLSFBlock {
+    VkDeviceSize offset;
+    VkDeviceSize size;
+    TLSFBlock *prev_phys;
+    TLSFBlock *next_phys;
+    TLSFBlock *prev_free;
+    TLSFBlock *next_free;
+    bool free;
+};
+
+struct TLSFAllocator {
+    static const u32 SL_LOG2 = 4;
+    static const u32 SL_COUNT = 1 << SL_LOG2;
+    static const u32 FL_SHIFT = SL_LOG2 + 4;
+    static const u32 FL_COUNT = 64 - FL_SHIFT + 1;
+    static const VkDeviceSize SMALL_SIZE = 1ull << FL_SHIFT;
+    static const VkDeviceSize MIN_SPLIT = 16;
+
+    VkDeviceSize capacity = 0;
+    VkDeviceSize used = 0;
+    u32 allocation_count = 0;
+
+    u64 fl_bitmap = 0;
+    u32 sl_bitmap[FL_COUNT] = {};
+    TLSFBlock *free_lists[FL_COUNT][SL_COUNT] = {};
+    TLSFBlock *first = 0;
+
+    void Create(VkDeviceSize capacity);
+    void Destroy();
+
+    // Returns 0 if there is no free range large enough
+    TLSFBlock *Allocate(VkDeviceSize size, VkDeviceSize alignment);
+    void Free(TLSFBlock *block);
+
+    VkDeviceSize LargestFreeBlock();
+
+    void InsertFree(TLSFBlock *block);
+    void RemoveFree(TLSFBlock *block);
+    TLSFBlock *FindFree(VkDeviceSize size);
+    TLSFBlock *Split(TLSFBlock *block, VkDeviceSize size);
+    void Merge(TLSFBlock *block, TLSFBlock *next);
+};
+
+enum VulkanAllocationStrategy {
+    // General purpose sub-allocation, freed individually
+    VULKAN_ALLOCATION_GENERAL,
+    // Bump allocation for resources that are created and destroyed together
+    // (e.g. swapchain sized attachments). A block is rewound once it is empty.
+    VULKAN_ALLOCATION_LINEAR
+};
+
+struct VulkanMemoryBlock {
+    VkDeviceMemory memory;
+    VkDeviceSize size;
+    u32 memory_type;
+    u32 pool;
+    void *mapped;
+    bool dedicated;
+    bool linear;
+
+    TLSFAllocator tlsf;
+
+    VkDeviceSize linear_head;
+    u32 linear_count;
+};
+
+struct VulkanAllocation {
+    VkDeviceMemory memory = VK_NULL_HANDLE;
+    VkDeviceSize offset = 0;
+    VkDeviceSize size = 0;
+    void *mapped = 0;
+    VkMemoryPropertyFlags properties = 0;
+
+    VulkanMemoryBlock *block = 0;
+    TLSFBlock *range = 0;
+};
+
+struct VulkanAllocatorStats {
+    u32 block_count;
+    u32 dedicated_count;
+    u32 allocation_count;
+    u32 device_allocation_count;
+    VkDeviceSize reserved_bytes;
+    VkDeviceSize used_bytes;
+    VkDeviceSize heap_reserved[VK_MAX_MEMORY_HEAPS];
+    VkDeviceSize heap_used[VK_MAX_MEMORY_HEAPS];
+};
+
+// Singleton like VulkanDevice. Owns every VkDeviceMemory the engine allocates and
+// hands out sub-ranges of large blocks, one set of blocks per memory type.
+struct VulkanAllocator {
+    static const VkDeviceSize DEFAULT_BLOCK_SIZE = 64ull * 1024 * 1024;
+
+    // pool index = memory_type * POOLS_PER_TYPE + (image ? 2 : 0) + (linear ? 1 : 0).
+    // Buffers and optimal images never share a block so bufferImageGranularity can be ignored.
+    static const u32 POOLS_PER_TYPE = 4;
+
+    static array<VulkanMemoryBlock *> pools[VK_MAX_MEMORY_TYPES * POOLS_PER_TYPE];
+    static array<VulkanMemoryBlock *> dedicated_blocks;
+    static VkDeviceSize block_sizes[VK_MAX_MEMORY_TYPES];
+    static u32 device_allocation_count;
+
+    static void Create();
+    static void Destroy();
+
+    static VulkanAllocation Allocate(VkMemoryRequirements requirements, VkMemoryPropertyFlags required, VkMemoryPropertyFlags preferred, bool image, VulkanAllocationStrategy strategy=VULKAN_ALLOCATION_GENERAL);
+    static void Free(VulkanAllocation *allocation);
+
+    static VulkanAllocation AllocateBuffer(VkBuffer buffer, VkMemoryPropertyFlags required, VkMemoryPropertyFlags preferred=0);
+    static VulkanAllocation AllocateImage(VkImage image, VkMemoryPropertyFlags required, VulkanAllocationStrategy strategy=VULKAN_ALLOCATION_GENERAL);
+
+    static u32 FindMemoryType(u32 type_bits, VkMemoryPropertyFlags required, VkMemoryPropertyFlags preferred=0);
+
+    static void GetStats(VulkanAllocatorStats *stats);
+    static void LogStats();
+};
+
+#endif
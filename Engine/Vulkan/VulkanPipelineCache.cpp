@@ -0,0 +1,175 @@
+#include "VulkanPipelineCache.h"
+
+#include "VulkanRenderer.h"
+
+#include <filesystem>
+#include <mutex>
+
+VkPipelineCache VulkanPipelineCache::handle = VK_NULL_HANDLE;
+string VulkanPipelineCache::path;
+bool VulkanPipelineCache::warm = false;
+f64 VulkanPipelineCache::creation_ms = 0;
+u32 VulkanPipelineCache::creation_count = 0;
+
+static const u32 CACHE_FILE_MAGIC = 0x48435050; // "PPCH"
+static const u32 CACHE_FILE_VERSION = 1;
+
+// FNV-1a
+static u64 HashData(const u8 *data, u64 size) {
+    u64 hash = 14695981039346656037ull;
+    for (u64 i = 0; i < size; ++i) {
+        hash = (hash ^ data[i]) * 1099511628211ull;
+    }
+    return hash;
+}
+
+static void FillHeader(PipelineCacheFileHeader *header) {
+    VkPhysicalDeviceProperties *properties = &VulkanPhysicalDevice::properties;
+
+    *header = {};
+    header->magic = CACHE_FILE_MAGIC;
+    header->version = CACHE_FILE_VERSION;
+    header->vendor_id = properties->vendorID;
+    header->device_id = properties->deviceID;
+    header->driver_version = properties->driverVersion;
+    memcpy(header->uuid, properties->pipelineCacheUUID, VK_UUID_SIZE);
+}
+
+// Returns the driver data of the file if it was written for this GPU and driver
+static bool ReadCacheFile(const char *path, array<u8> *data) {
+    FILE *f = fopen(path, "rb");
+    if (!f) {
+        return false;
+    }
+
+    PipelineCacheFileHeader header;
+    bool valid = fread(&header, sizeof(header), 1, f) == 1;
+
+    PipelineCacheFileHeader expected;
+    FillHeader(&expected);
+
+    if (valid) {
+        valid = header.magic == expected.magic && header.version == expected.version &&
+                header.vendor_id == expected.vendor_id && header.device_id == expected.device_id &&
+                header.driver_version == expected.driver_version &&
+                memcmp(header.uuid, expected.uuid, VK_UUID_SIZE) == 0;
+
+        if (!valid) {
+            LogDev("Pipeline cache %s is from another GPU or driver, starting cold", path);
+        }
+    }
+
+    // A corrupt size must not turn into a huge allocation
+    if (valid && header.data_size > (1ull << 30)) {
+        LogError("Pipeline cache %s is corrupt, starting cold", path);
+        valid = false;
+    } else if (valid) {
+        data->resize(header.data_size);
+        valid = fread(data->data(), 1, header.data_size, f) == header.data_size &&
+                HashData(data->data(), header.data_size) == header.data_hash;
+
+        // The driver's own header has to agree as well
+        VkPipelineCacheHeaderVersionOne *vulkan_header = (VkPipelineCacheHeaderVersionOne *) data->data();
+        valid = valid && header.data_size >= sizeof(VkPipelineCacheHeaderVersionOne) &&
+                vulkan_header->headerVersion == VK_PIPELINE_CACHE_HEADER_VERSION_ONE &&
+                vulkan_header->vendorID == expected.vendor_id && vulkan_header->deviceID == expected.device_id &&
+                memcmp(vulkan_header->pipelineCacheUUID, expected.uuid, VK_UUID_SIZE) == 0;
+
+        if (!valid) {
+            LogError("Pipeline cache %s is corrupt, starting cold", path);
+        }
+    }
+
+    fclose(f);
+
+    if (!valid) {
+        data->clear();
+    }
+
+    return valid;
+}
+
+void VulkanPipelineCache::Create(const char *path) {
+    VulkanPipelineCache::path = path;
+
+    array<u8> data;
+    warm = ReadCacheFile(path, &data);
+
+    VkPipelineCacheCreateInfo cache_info = { VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO };
+    cache_info.initialDataSize = data.size();
+    cache_info.pInitialData = data.data();
+
+    VK_CHECK(vkCreatePipelineCache(VulkanDevice::handle, &cache_info, 0, &handle));
+
+    if (warm) {
+        LogDev("Loaded pipeline cache %s (%llu bytes)", path, (u64) data.size());
+    }
+
+    creation_ms = 0;
+    creation_count = 0;
+}
+
+void VulkanPipelineCache::Destroy() {
+    VkDevice device = VulkanDevice::handle;
+
+    LogInfo("Created %u pipelines in %.2fms with a %s pipeline cache", creation_count, creation_ms, warm ? "warm" : "cold");
+
+    // Another instance may have written the file since Create, keep what it learned
+    array<u8> disk_data;
+    if (ReadCacheFile(path.c_str(), &disk_data)) {
+        VkPipelineCacheCreateInfo disk_cache_info = { VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO };
+        disk_cache_info.initialDataSize = disk_data.size();
+        disk_cache_info.pInitialData = disk_data.data();
+
+        VkPipelineCache disk_cache;
+        if (vkCreatePipelineCache(device, &disk_cache_info, 0, &disk_cache) == VK_SUCCESS) {
+            vkMergePipelineCaches(device, handle, 1, &disk_cache);
+            vkDestroyPipelineCache(device, disk_cache, 0);
+        }
+    }
+
+    size_t size = 0;
+    VK_CHECK(vkGetPipelineCacheData(device, handle, &size, 0));
+
+    array<u8> data(size);
+    VK_CHECK(vkGetPipelineCacheData(device, handle, &size, data.data()));
+
+    vkDestroyPipelineCache(device, handle, 0);
+    handle = VK_NULL_HANDLE;
+
+    PipelineCacheFileHeader header;
+    FillHeader(&header);
+    header.data_size = size;
+    header.data_hash = HashData(data.data(), size);
+
+    // Written next to the real file and renamed over it, readers see the old or the new file
+    string temp_path = path + ".tmp";
+
+    FILE *f = fopen(temp_path.c_str(), "wb");
+    if (!f) {
+        LogError("Failed to write pipeline cache %s", temp_path.c_str());
+        return;
+    }
+
+    bool written = fwrite(&header, sizeof(header), 1, f) == 1 && fwrite(data.data(), 1, size, f) == size;
+    written = fclose(f) == 0 && written;
+
+    std::error_code error;
+    if (written) {
+        std::filesystem::rename(temp_path, path, error);
+    }
+
+    if (!written || error) {
+        LogError("Failed to write pipeline cache %s", path.c_str());
+        std::filesystem::remove(temp_path, error);
+    }
+}
+
+void VulkanPipelineCache::CountCreation(f64 ms) {
+    // Pipelines are created on worker threads too
+    static std::mutex count_mutex;
+    std::lock_guard<std::mutex> lock(count_mutex);
+
+    creation_ms += ms;
+    creation_count++;
+}
@@ -0,0 +1,42 @@
+#ifndef VULKAN_PIPELINE_CACHE_H
+#define VULKAN_PIPELINE_CACHE_H
+
+#include <Vulkan/vulkan.h>
+
+#include "Common.h"
+
+// Written in front of the driver's cache data. The driver only checks vendor, device and
+// cache UUID, the driver version is checked too, so an updated driver starts cold instead
+// of being handed data it may misread.
+struct PipelineCacheFileHeader {
+    u32 magic;
+    u32 version;
+    u32 vendor_id;
+    u32 device_id;
+    u32 driver_version;
+    u8 uuid[VK_UUID_SIZE];
+    u64 data_size;
+    u64 data_hash;
+};
+
+// Singleton VkPipelineCache shared by every pipeline. Create loads it from disk, Destroy merges
+// it with whatever is on disk by then and replaces the file in one rename, so a crash or a
+// second instance never leaves a torn file behind.
+struct VulkanPipelineCache {
+    static VkPipelineCache handle;
+    static string path;
+    // Create found data that fits this GPU and driver
+    static bool warm;
+
+    // Time spent in vkCreate*Pipelines, logged by Destroy to compare cold and warm starts
+    static f64 creation_ms;
+    static u32 creation_count;
+
+    static void Create(const char *path);
+    static void Destroy();
+
+    // Thread safe
+    static void CountCreation(f64 ms);
+};
+
+#endif
@@ -0,0 +1,161 @@
+#include "VulkanPipelineVariants.h"
+
+#include "Core/JobSystem.h"
+
+#include <condition_variable>
+#include <mutex>
+
+VulkanSwapchain *PipelineVariants::swapchain = 0;
+map<u64, array<PipelineVariant *>> PipelineVariants::variants;
+map<string, Shader *> PipelineVariants::shaders;
+
+// Compiles that have not finished yet, Wait and Destroy sleep on compile_finished
+static u32 pending_compiles = 0;
+static std::mutex compile_mutex;
+static std::condition_variable compile_finished;
+
+// FNV-1a
+static u64 HashBytes(u64 hash, const void *data, u64 size) {
+    const u8 *bytes = (const u8 *) data;
+    for (u64 i = 0; i < size; ++i) {
+        hash = (hash ^ bytes[i]) * 1099511628211ull;
+    }
+    return hash;
+}
+
+static void AppendBytes(array<u8> &key, const void *data, u64 size) {
+    const u8 *bytes = (const u8 *) data;
+    key.insert(key.end(), bytes, bytes + size);
+}
+
+template<typename T>
+static void AppendValue(array<u8> &key, const T &value) {
+    AppendBytes(key, &value, sizeof(value));
+}
+
+// Reused by every lookup, only the main thread builds keys
+static array<u8> lookup_key;
+
+void PipelineVariants::Create(VulkanSwapchain *swapchain) {
+    PipelineVariants::swapchain = swapchain;
+}
+
+void PipelineVariants::Destroy() {
+    {
+        std::unique_lock<std::mutex> lock(compile_mutex);
+        compile_finished.wait(lock, [] { return pending_compiles == 0; });
+    }
+
+    for (auto &&[hash, bucket] : variants) {
+        for (PipelineVariant *variant : bucket) {
+            variant->pipeline.Destroy();
+            delete variant;
+        }
+    }
+
+    for (auto &&[path, shader] : shaders) {
+        shader->Destroy();
+        delete shader;
+    }
+
+    variants.clear();
+    shaders.clear();
+}
+
+Shader *PipelineVariants::LoadShader(const char *path) {
+    Shader *&shader = shaders[path];
+    if (!shader) {
+        shader = new Shader;
+        shader->Create(path);
+    }
+
+    return shader;
+}
+
+void PipelineVariants::BuildKey(const PipelineInfo *info, array<u8> &key) {
+    key.clear();
+
+    // The map has no fixed order, so go through the stages in pipeline order
+    const VkShaderStageFlagBits stages[] = {
+        VK_SHADER_STAGE_VERTEX_BIT, VK_SHADER_STAGE_TESSELLATION_CONTROL_BIT, VK_SHADER_STAGE_TESSELLATION_EVALUATION_BIT,
+        VK_SHADER_STAGE_GEOMETRY_BIT, VK_SHADER_STAGE_FRAGMENT_BIT
+    };
+    for (VkShaderStageFlagBits stage : stages) {
+        auto it = info->shaders.find(stage);
+        if (it != info->shaders.end()) {
+            AppendValue(key, stage);
+            AppendValue(key, it->second->module);
+        }
+    }
+
+    for (const VkDescriptorSetLayoutBinding &binding : info->set_bindings) {
+        AppendValue(key, binding.binding);
+        AppendValue(key, binding.descriptorType);
+        AppendValue(key, binding.descriptorCount);
+        AppendValue(key, binding.stageFlags);
+    }
+
+    for (const VkPushConstantRange &range : info->push_constants) {
+        AppendValue(key, range);
+    }
+
+    AppendValue(key, info->set_layout);
+    AppendValue(key, info->depth_compare_op);
+    AppendValue(key, info->depth_write);
+    AppendValue(key, info->color_write);
+    AppendValue(key, info->depth_target_only);
+    AppendValue(key, info->cull_mode);
+    AppendValue(key, info->polygon_mode);
+    AppendValue(key, info->depth_bias_constant);
+    AppendValue(key, info->depth_bias_slope);
+
+    // Permutations of the same shaders
+    AppendBytes(key, info->specialization.data(), info->specialization.size() * sizeof(u32));
+}
+
+PipelineVariant *PipelineVariants::Prewarm(const PipelineInfo *info) {
+    BuildKey(info, lookup_key);
+
+    // Variants whose keys collide share a bucket, the key itself tells them apart
+    array<PipelineVariant *> &bucket = variants[HashBytes(14695981039346656037ull, lookup_key.data(), lookup_key.size())];
+    for (PipelineVariant *variant : bucket) {
+        if (variant->key == lookup_key) {
+            return variant;
+        }
+    }
+
+    PipelineVariant *variant = new PipelineVariant;
+    variant->info = *info;
+    variant->key = lookup_key;
+    bucket.push_back(variant);
+
+    {
+        std::lock_guard<std::mutex> lock(compile_mutex);
+        pending_compiles++;
+    }
+
+    JobSystem::Submit([variant] {
+        variant->pipeline.Create(swapchain, &variant->info);
+        variant->ready.store(true, std::memory_order_release);
+
+        std::lock_guard<std::mutex> lock(compile_mutex);
+        pending_compiles--;
+        compile_finished.notify_all();
+    });
+
+    return variant;
+}
+
+Pipeline *PipelineVariants::Get(const PipelineInfo *info, Pipeline *fallback) {
+    PipelineVariant *variant = Prewarm(info);
+    return variant->ready.load(std::memory_order_acquire) ? &variant->pipeline : fallback;
+}
+
+Pipeline *PipelineVariants::Wait(const PipelineInfo *info) {
+    PipelineVariant *variant = Prewarm(info);
+
+    std::unique_lock<std::mutex> lock(compile_mutex);
+    compile_finished.wait(lock, [variant] { return variant->ready.load(std::memory_order_acquire); });
+
+    return &variant->pipeline;
+}
@@ -0,0 +1,48 @@
+#ifndef VULKAN_PIPELINE_VARIANTS_H
+#define VULKAN_PIPELINE_VARIANTS_H
+
+#include "Common.h"
+#include "Vulkan/VulkanRenderer.h"
+
+#include <atomic>
+
+// A pipeline built from its own copy of the PipelineInfo, pipeline is only valid once ready
+struct PipelineVariant {
+    PipelineInfo info;
+    // The bytes the variant is looked up by, see BuildKey
+    array<u8> key;
+    Pipeline pipeline;
+    std::atomic<bool> ready = false;
+};
+
+// Graphics pipelines keyed by their PipelineInfo, which holds the whole render state.
+// Variants are compiled as JobSystem tasks, so a variant that is used for the first time never
+// stalls a frame: Get hands out the fallback until it is ready. Prewarm queues the variants
+// known at load, they compile in parallel and are usually done before they are needed.
+//
+// The shaders of a variant are read while it compiles, LoadShader keeps them until Destroy.
+// Only used from the main thread, a compile only writes its own variant.
+struct PipelineVariants {
+    static VulkanSwapchain *swapchain;
+    // Keyed by the hash of the key bytes
+    static map<u64, array<PipelineVariant *>> variants;
+    static map<string, Shader *> shaders;
+
+    static void Create(VulkanSwapchain *swapchain);
+    // Waits for the compiles that are still running
+    static void Destroy();
+
+    static Shader *LoadShader(const char *path);
+
+    // The render state of info as bytes, equal bytes mean the same pipeline
+    static void BuildKey(const PipelineInfo *info, array<u8> &key);
+
+    // Queues the compile unless the variant is known already
+    static PipelineVariant *Prewarm(const PipelineInfo *info);
+    // The variant once it is compiled, until then fallback, which may be 0
+    static Pipeline *Get(const PipelineInfo *info, Pipeline *fallback);
+    // Blocks until the variant is compiled, for pipelines the first frame can not do without
+    static Pipeline *Wait(const PipelineInfo *info);
+};
+
+#endif
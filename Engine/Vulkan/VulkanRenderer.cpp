@@ -1,5 +1,9 @@
 #include "VulkanRenderer.h"
 
+#include "Core/JobSystem.h"
+
+#include <algorithm>
+
 PFN_vkCmdPushDescriptorSetKHR vkCmdPushDescriptorSetFunc = 0;
 
 VulkanContext VulkanContext::Get(bool enable_layers) {
@@ -70,7 +74,10 @@ VkPhysicalDeviceMemoryProperties VulkanPhysicalDevice::memory_properties = {};
 VkPhysicalDeviceProperties VulkanPhysicalDevice::properties = {};
 u32 VulkanPhysicalDevice::graphics = 0;
 u32 VulkanPhysicalDevice::present = 0;
+u32 VulkanPhysicalDevice::transfer = 0;
 VkSampleCountFlagBits VulkanPhysicalDevice::msaa_samples = VK_SAMPLE_COUNT_1_BIT;
+bool VulkanPhysicalDevice::pipeline_statistics = false;
+bool VulkanPhysicalDevice::fill_mode_non_solid = false;
 
 void VulkanPhysicalDevice::Pick(VulkanContext *ctx) {
     u32 device_count;
@@ -79,12 +86,38 @@ void VulkanPhysicalDevice::Pick(VulkanContext *ctx) {
     array<VkPhysicalDevice> devices(device_count);
     VK_CHECK(vkEnumeratePhysicalDevices(VulkanInstance::handle, &device_count, devices.data()));
 
+    // Any GPU that has what we need is accepted (integrated GPUs, lavapipe in CI),
+    // a discrete one wins if there are several
+    u32 best_score = 0;
+
     for (VkPhysicalDevice dev : devices) {
         VkPhysicalDeviceProperties properties;
 
         vkGetPhysicalDeviceProperties(dev, &properties);
 
-        if (properties.deviceType != VK_PHYSICAL_DEVICE_TYPE_DISCRETE_GPU) {
+        u32 score;
+        switch (properties.deviceType) {
+        case VK_PHYSICAL_DEVICE_TYPE_DISCRETE_GPU: score = 4; break;
+        case VK_PHYSICAL_DEVICE_TYPE_INTEGRATED_GPU: score = 3; break;
+        case VK_PHYSICAL_DEVICE_TYPE_VIRTUAL_GPU: score = 2; break;
+        default: score = 1; break;
+        }
+
+        if (score <= best_score) {
+            continue;
+        }
+
+        // GPU driven rendering draws with vkCmdDrawIndexedIndirectCount and reads gl_DrawID
+        VkPhysicalDeviceVulkan11Features features11 = { VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_1_FEATURES };
+        VkPhysicalDeviceVulkan12Features features12 = { VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_2_FEATURES };
+        features11.pNext = &features12;
+
+        VkPhysicalDeviceFeatures2 features = { VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2 };
+        features.pNext = &features11;
+
+        vkGetPhysicalDeviceFeatures2(dev, &features);
+
+        if (!features.features.multiDrawIndirect || !features11.shaderDrawParameters || !features12.drawIndirectCount) {
             continue;
         }
 
@@ -112,11 +145,20 @@ void VulkanPhysicalDevice::Pick(VulkanContext *ctx) {
 
         u32 graphics_index = -1;
         u32 present_index = -1;
+        u32 transfer_index = -1;
+        bool transfer_only = false;
         for (u32 i = 0; i < families.size(); ++i) {
             VkQueueFamilyProperties family = families[i];
 
             if (family.queueFlags & VK_QUEUE_GRAPHICS_BIT) {
                 graphics_index = i;
+            } else if (family.queueFlags & VK_QUEUE_TRANSFER_BIT) {
+                // Prefer the pure copy engine over an async compute family
+                bool only_transfer = !(family.queueFlags & VK_QUEUE_COMPUTE_BIT);
+                if (transfer_index == -1 || (only_transfer && !transfer_only)) {
+                    transfer_index = i;
+                    transfer_only = only_transfer;
+                }
             }
 
             VkBool32 present_support = false;
@@ -133,15 +175,29 @@ void VulkanPhysicalDevice::Pick(VulkanContext *ctx) {
 
         // Set selected device
         LogDev("Found GPU %s", properties.deviceName);
+        best_score = score;
         handle = dev;
         graphics = graphics_index;
         present = present_index;
-        break;
+        transfer = transfer_index != -1 ? transfer_index : graphics_index;
+
+        if (transfer != graphics) {
+            LogDev("Using dedicated transfer queue family %u", transfer);
+        }
+    }
+
+    if (handle == VK_NULL_HANDLE) {
+        LogFatal("Failed to find suitable GPU");
     }
 
     vkGetPhysicalDeviceMemoryProperties(handle, &memory_properties);
     vkGetPhysicalDeviceProperties(handle, &properties);
 
+    VkPhysicalDeviceFeatures features;
+    vkGetPhysicalDeviceFeatures(handle, &features);
+    pipeline_statistics = features.pipelineStatisticsQuery && features.inheritedQueries;
+    fill_mode_non_solid = features.fillModeNonSolid;
+
     VkSampleCountFlags msaa_flags = properties.limits.framebufferColorSampleCounts & properties.limits.framebufferDepthSampleCounts;
 
     VkSampleCountFlagBits samples;
@@ -154,21 +210,25 @@ void VulkanPhysicalDevice::Pick(VulkanContext *ctx) {
     // TODO: enable msaa
     // _instance->msaa_samples = samples;
     msaa_samples = VK_SAMPLE_COUNT_1_BIT;
-
-    if (handle == VK_NULL_HANDLE) {
-        LogFatal("Failed to find suitable GPU");
-    }
 }
 
 VkDevice VulkanDevice::handle = VK_NULL_HANDLE;
 VkQueue VulkanDevice::graphics_queue = VK_NULL_HANDLE;
 VkQueue VulkanDevice::present_queue = VK_NULL_HANDLE;
+VkQueue VulkanDevice::transfer_queue = VK_NULL_HANDLE;
 u32 VulkanDevice::graphics_index = ~0u;
 u32 VulkanDevice::present_index = ~0u;
+u32 VulkanDevice::transfer_index = ~0u;
+VulkanTimeline VulkanDevice::graphics_timeline;
+VulkanTimeline VulkanDevice::transfer_timeline;
 
 void VulkanDevice::Create(VulkanContext *ctx) {
     VkPhysicalDeviceFeatures features_core = {};
     features_core.sampleRateShading = VK_TRUE;
+    features_core.multiDrawIndirect = VK_TRUE;
+    features_core.pipelineStatisticsQuery = VulkanPhysicalDevice::pipeline_statistics;
+    features_core.inheritedQueries = VulkanPhysicalDevice::pipeline_statistics;
+    features_core.fillModeNonSolid = VulkanPhysicalDevice::fill_mode_non_solid;
 
     VkPhysicalDeviceVulkan13Features features13 = { VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_3_FEATURES };
 	features13.dynamicRendering = VK_TRUE;
@@ -177,23 +237,35 @@ void VulkanDevice::Create(VulkanContext *ctx) {
     VkPhysicalDeviceVulkan12Features features12 = { VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_2_FEATURES };
     features12.shaderInt8 = VK_TRUE;
     features12.uniformAndStorageBuffer8BitAccess = VK_TRUE;
-
-    const u32 queue_create_info_count = 2;
-    VkDeviceQueueCreateInfo queue_create_infos[queue_create_info_count];
+    features12.drawIndirectCount = VK_TRUE;
+    features12.timelineSemaphore = VK_TRUE;
+    // BindlessDescriptors
+    features12.descriptorIndexing = VK_TRUE;
+    features12.runtimeDescriptorArray = VK_TRUE;
+    features12.descriptorBindingPartiallyBound = VK_TRUE;
+    features12.descriptorBindingUpdateUnusedWhilePending = VK_TRUE;
+    features12.descriptorBindingStorageBufferUpdateAfterBind = VK_TRUE;
+    features12.descriptorBindingSampledImageUpdateAfterBind = VK_TRUE;
+    features12.shaderSampledImageArrayNonUniformIndexing = VK_TRUE;
+
+    VkPhysicalDeviceVulkan11Features features11 = { VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_1_FEATURES };
+    features11.shaderDrawParameters = VK_TRUE;
+
+    // Every family may only appear once in the create infos
+    set<u32> queue_families = { VulkanPhysicalDevice::graphics, VulkanPhysicalDevice::present, VulkanPhysicalDevice::transfer };
+
+    u32 queue_create_info_count = 0;
+    VkDeviceQueueCreateInfo queue_create_infos[3];
 
     f32 queue_priority = 1.0f;
 
-    VkDeviceQueueCreateInfo graphics_queue_info = { VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO };
-    graphics_queue_info.queueFamilyIndex = VulkanPhysicalDevice::graphics;
-    graphics_queue_info.queueCount = 1;
-    graphics_queue_info.pQueuePriorities = &queue_priority;
-    queue_create_infos[0] = graphics_queue_info;
-    
-    VkDeviceQueueCreateInfo present_queue_info = { VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO };
-    present_queue_info.queueFamilyIndex = VulkanPhysicalDevice::present;
-    present_queue_info.queueCount = 1;
-    present_queue_info.pQueuePriorities = &queue_priority;
-    queue_create_infos[1] = present_queue_info;
+    for (u32 family : queue_families) {
+        VkDeviceQueueCreateInfo queue_info = { VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO };
+        queue_info.queueFamilyIndex = family;
+        queue_info.queueCount = 1;
+        queue_info.pQueuePriorities = &queue_priority;
+        queue_create_infos[queue_create_info_count++] = queue_info;
+    }
 
     VkDeviceCreateInfo device_info = { VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO };
     device_info.ppEnabledExtensionNames = ctx->device_extensions.data();
@@ -206,6 +278,7 @@ void VulkanDevice::Create(VulkanContext *ctx) {
     device_info.pNext = &features13;
 
     features13.pNext = &features12;
+    features12.pNext = &features11;
 
     VkDevice device;
     VK_CHECK(vkCreateDevice(VulkanPhysicalDevice::handle, &device_info, 0, &device));
@@ -214,14 +287,38 @@ void VulkanDevice::Create(VulkanContext *ctx) {
 
     vkGetDeviceQueue(device, VulkanPhysicalDevice::present, 0, &present_queue);
 
+    vkGetDeviceQueue(device, VulkanPhysicalDevice::transfer, 0, &transfer_queue);
+
     handle = device;
     graphics_index = VulkanPhysicalDevice::graphics;
     present_index = VulkanPhysicalDevice::present;
+    transfer_index = VulkanPhysicalDevice::transfer;
 
     vkCmdPushDescriptorSetFunc = (PFN_vkCmdPushDescriptorSetKHR) vkGetDeviceProcAddr(device, "vkCmdPushDescriptorSetKHR");
+
+    // Both are the same queue without a separate transfer family, each timeline still counts its own submissions
+    graphics_timeline.Create(graphics_queue);
+    transfer_timeline.Create(transfer_queue);
+
+    VulkanAllocator::Create();
+    VulkanUploader::Create();
+    // The arena registers its vertex buffer
+    BindlessDescriptors::Create();
+    GeometryArena::Create();
+    // Shared by every pipeline created from here on
+    VulkanPipelineCache::Create("pipeline_cache.bin");
 }
 
 void VulkanDevice::Destroy() {
+    VulkanPipelineCache::Destroy();
+    VulkanUploader::Destroy();
+    // The deferred destroys that are left release bindless slots and memory
+    graphics_timeline.Destroy();
+    transfer_timeline.Destroy();
+    GeometryArena::Destroy();
+    BindlessDescriptors::Destroy();
+    VulkanAllocator::Destroy();
+
     vkDestroyDevice(handle, 0);
 }
 
@@ -274,18 +371,7 @@ void VulkanCommandBuffers::Reset(u32 index) {
     vkResetCommandBuffer(buffers[index], 0);
 }
 
-static u32 FindMemoryType(u32 type_bits, VkMemoryPropertyFlags flags) {
-    for (u32 i = 0; i < VulkanPhysicalDevice::memory_properties.memoryTypeCount; ++i) {
-        if ((type_bits & (1 << i)) && (VulkanPhysicalDevice::memory_properties.memoryTypes[i].propertyFlags & flags) == flags) {
-            return i;
-        }
-    }
-
-    LogFatal("Failed to find suitable memory type");
-    return 0;
-}
-
-void VulkanImage::Create(VkFormat format, u32 width, u32 height, u32 mip_levels, VkSampleCountFlagBits samples, VkImageUsageFlags usage) {
+void VulkanImage::Create(VkFormat format, u32 width, u32 height, u32 mip_levels, VkSampleCountFlagBits samples, VkImageUsageFlags usage, VulkanAllocationStrategy strategy, u32 layers) {
     VkImageCreateInfo image_info = { VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO };
     image_info.imageType = VK_IMAGE_TYPE_2D;
     image_info.format = format;
@@ -293,7 +379,7 @@ void VulkanImage::Create(VkFormat format, u32 width, u32 height, u32 mip_levels,
     image_info.extent.height = height;
     image_info.extent.depth = 1;
     image_info.mipLevels = mip_levels;
-    image_info.arrayLayers = 1;
+    image_info.arrayLayers = layers;
     image_info.samples = samples;
     image_info.tiling = VK_IMAGE_TILING_OPTIMAL;
     image_info.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
@@ -302,27 +388,18 @@ void VulkanImage::Create(VkFormat format, u32 width, u32 height, u32 mip_levels,
     VkDevice device = VulkanDevice::handle;
     VK_CHECK(vkCreateImage(device, &image_info, 0, &handle));
 
-    VkMemoryRequirements memory_requirements;
-    vkGetImageMemoryRequirements(device, handle, &memory_requirements);
-
-
-    VkMemoryAllocateInfo allocate_info = { VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO };
-    allocate_info.allocationSize = memory_requirements.size;
-    allocate_info.memoryTypeIndex = FindMemoryType(memory_requirements.memoryTypeBits, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
-
-    VK_CHECK(vkAllocateMemory(device, &allocate_info, 0, &memory));
-    VK_CHECK(vkBindImageMemory(device, handle, memory, 0));
+    allocation = VulkanAllocator::AllocateImage(handle, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, strategy);
 
     VkImageAspectFlags aspect_mask = (format == VK_FORMAT_D32_SFLOAT) ? VK_IMAGE_ASPECT_DEPTH_BIT : VK_IMAGE_ASPECT_COLOR_BIT;
 
     VkImageViewCreateInfo view_info = { VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO };
     view_info.image = handle;
-    view_info.viewType = VK_IMAGE_VIEW_TYPE_2D;
+    view_info.viewType = layers > 1 ? VK_IMAGE_VIEW_TYPE_2D_ARRAY : VK_IMAGE_VIEW_TYPE_2D;
     view_info.format = format;
     view_info.subresourceRange.aspectMask = aspect_mask;
     view_info.subresourceRange.baseMipLevel = 0;
     view_info.subresourceRange.levelCount = mip_levels;
-    view_info.subresourceRange.layerCount = 1;
+    view_info.subresourceRange.layerCount = layers;
 
     VK_CHECK(vkCreateImageView(device, &view_info, 0, &view));
 }
@@ -332,7 +409,7 @@ void VulkanImage::Destroy() {
 
     vkDestroyImageView(device, view, 0);
     vkDestroyImage(device, handle, 0);
-    vkFreeMemory(device, memory, 0);
+    VulkanAllocator::Free(&allocation);
 }
 
 VkSurfaceFormatKHR VulkanSwapchain::ChooseFormat() {
@@ -353,7 +430,7 @@ VkSurfaceFormatKHR VulkanSwapchain::ChooseFormat() {
     return formats[0];
 }
 
-VkPresentModeKHR VulkanSwapchain::ChooseSwapPresentMode(bool vsync) {
+bool VulkanSwapchain::IsPresentModeSupported(VkPresentModeKHR present_mode) {
     VkPhysicalDevice device = VulkanPhysicalDevice::handle;
 
     u32 present_mode_count;
@@ -362,24 +439,27 @@ VkPresentModeKHR VulkanSwapchain::ChooseSwapPresentMode(bool vsync) {
     array<VkPresentModeKHR> present_modes(present_mode_count);
     VK_CHECK(vkGetPhysicalDeviceSurfacePresentModesKHR(device, VulkanInstance::surface, &present_mode_count, present_modes.data()));
 
-    VkPresentModeKHR mode = VK_PRESENT_MODE_FIFO_KHR;
-    if (vsync) {
-        return mode;
-    }
-
     for (u32 i = 0; i < present_modes.size(); ++i) {
-        if (present_modes[i] == VK_PRESENT_MODE_MAILBOX_KHR) {
-            mode = present_modes[i];
-        } else if (present_modes[i] == VK_PRESENT_MODE_IMMEDIATE_KHR && mode != VK_PRESENT_MODE_MAILBOX_KHR) {
-            mode = present_modes[i];
+        if (present_modes[i] == present_mode) {
+            return true;
         }
     }
 
-    return mode;
+    return false;
+}
+
+VkPresentModeKHR VulkanSwapchain::ChooseSwapPresentMode(VkPresentModeKHR requested) {
+    if (IsPresentModeSupported(requested)) {
+        return requested;
+    }
+
+    LogInfo("Present mode %d is not supported, using FIFO", requested);
+    return VK_PRESENT_MODE_FIFO_KHR;
 }
 
-void VulkanSwapchain::Create(bool vsync) {
-    this->vsync = vsync;
+void VulkanSwapchain::Create(VkPresentModeKHR present_mode) {
+    this->present_mode = ChooseSwapPresentMode(present_mode);
+    requested_present_mode = this->present_mode;
 
     VkSurfaceCapabilitiesKHR capabilities;
     VK_CHECK(vkGetPhysicalDeviceSurfaceCapabilitiesKHR(VulkanPhysicalDevice::handle, VulkanInstance::surface, &capabilities));
@@ -391,7 +471,14 @@ void VulkanSwapchain::Create(bool vsync) {
 
     VkSwapchainCreateInfoKHR swap_chain_info = { VK_STRUCTURE_TYPE_SWAPCHAIN_CREATE_INFO_KHR };
     swap_chain_info.surface = VulkanInstance::surface;
+    // MAILBOX needs a spare image to replace, the other modes keep the queue short
     swap_chain_info.minImageCount = capabilities.minImageCount;
+    if (this->present_mode == VK_PRESENT_MODE_MAILBOX_KHR) {
+        swap_chain_info.minImageCount++;
+        if (capabilities.maxImageCount) {
+            swap_chain_info.minImageCount = std::min(swap_chain_info.minImageCount, capabilities.maxImageCount);
+        }
+    }
     swap_chain_info.imageFormat = format;
     swap_chain_info.imageColorSpace = surface_format.colorSpace;
     swap_chain_info.imageExtent = extent;
@@ -399,7 +486,7 @@ void VulkanSwapchain::Create(bool vsync) {
     swap_chain_info.imageUsage = VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT;
     swap_chain_info.preTransform = VK_SURFACE_TRANSFORM_IDENTITY_BIT_KHR;
     swap_chain_info.compositeAlpha = VK_COMPOSITE_ALPHA_OPAQUE_BIT_KHR;
-    swap_chain_info.presentMode = ChooseSwapPresentMode(vsync);
+    swap_chain_info.presentMode = this->present_mode;
 
     if (VulkanDevice::graphics_index == VulkanDevice::present_index) {
         swap_chain_info.imageSharingMode = VK_SHARING_MODE_EXCLUSIVE;
@@ -434,9 +521,11 @@ void VulkanSwapchain::Create(bool vsync) {
         VK_CHECK(vkCreateImageView(VulkanDevice::handle, &view_info, 0, &color_views[i]));
     }
 
+    // Swapchain sized attachments are always recreated together, so they can be bump allocated
     depth_image.Create(
         VK_FORMAT_D32_SFLOAT, extent.width, extent.height, 1,
-        VulkanPhysicalDevice::msaa_samples, VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT
+        VulkanPhysicalDevice::msaa_samples, VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT | VK_IMAGE_USAGE_SAMPLED_BIT,
+        VULKAN_ALLOCATION_LINEAR
     );
 }
 
@@ -452,18 +541,28 @@ void VulkanSwapchain::Destroy() {
     vkDestroySwapchainKHR(VulkanDevice::handle, handle, 0);
 }
 
-void VulkanSwapchain::CheckResize() {
+void VulkanSwapchain::SetPresentMode(VkPresentModeKHR present_mode) {
+    requested_present_mode = ChooseSwapPresentMode(present_mode);
+}
+
+bool VulkanSwapchain::CheckRecreate() {
     VkSurfaceCapabilitiesKHR capabilities;
     VK_CHECK(vkGetPhysicalDeviceSurfaceCapabilitiesKHR(VulkanPhysicalDevice::handle, VulkanInstance::surface, &capabilities));
 
-    if (capabilities.currentExtent.width != extent.width || capabilities.currentExtent.height != extent.height) {
-        Destroy();
-        Create(vsync);
+    bool resized = capabilities.currentExtent.width != extent.width || capabilities.currentExtent.height != extent.height;
+    if (!resized && requested_present_mode == present_mode) {
+        return false;
+    }
 
-        extent = capabilities.currentExtent;
+    // Nothing may use the images anymore
+    VK_CHECK(vkDeviceWaitIdle(VulkanDevice::handle));
 
-        VK_CHECK(vkDeviceWaitIdle(VulkanDevice::handle));
-    }
+    Destroy();
+    Create(requested_present_mode);
+
+    extent = capabilities.currentExtent;
+
+    return true;
 }
 
 VkSemaphore CreateSemaphore(VkSemaphoreCreateFlags flags=0) {
@@ -479,53 +578,187 @@ void DestroySemaphore(VkSemaphore handle) {
     vkDestroySemaphore(VulkanDevice::handle, handle, 0);
 }
 
-VkFence CreateFence(VkFenceCreateFlags flags=0) {
-    VkFenceCreateInfo fence_info = { VK_STRUCTURE_TYPE_FENCE_CREATE_INFO };
-    fence_info.flags = flags;
+void FrameAllocator::Create(VkDeviceSize frame_size, u32 frame_count) {
+    VkDevice device = VulkanDevice::handle;
+    VkPhysicalDeviceLimits *limits = &VulkanPhysicalDevice::properties.limits;
 
-    VkFence handle;
-    VK_CHECK(vkCreateFence(VulkanDevice::handle, &fence_info, 0, &handle));
-    return handle;
+    alignment = limits->minStorageBufferOffsetAlignment;
+    if (limits->minUniformBufferOffsetAlignment > alignment) {
+        alignment = limits->minUniformBufferOffsetAlignment;
+    }
+
+    this->frame_size = (frame_size + alignment - 1) & ~(alignment - 1);
+    this->frame_count = frame_count;
+    frame = 0;
+    head = 0;
+
+    VkBufferCreateInfo buffer_info = { VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO };
+    buffer_info.size = this->frame_size * frame_count;
+    buffer_info.usage = VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT;
+    buffer_info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+
+    VK_CHECK(vkCreateBuffer(device, &buffer_info, 0, &buffer));
+
+    // Device local + host visible if possible, the GPU reads this memory every frame
+    allocation = VulkanAllocator::AllocateBuffer(
+        buffer, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT
+    );
 }
 
-void DestroyFence(VkFence handle) {
-    vkDestroyFence(VulkanDevice::handle, handle, 0);
+void FrameAllocator::Destroy() {
+    vkDestroyBuffer(VulkanDevice::handle, buffer, 0);
+    VulkanAllocator::Free(&allocation);
 }
 
-void RenderPass::Create(VulkanSwapchain *swapchain) {
-    this->swapchain = swapchain;
+void FrameAllocator::Reset(u32 frame) {
+    this->frame = frame;
+    head = 0;
+}
+
+void *FrameAllocator::Allocate(VkDeviceSize size, VkDeviceSize *offset) {
+    VkDeviceSize start = (head + alignment - 1) & ~(alignment - 1);
+    if (start + size > frame_size) {
+        LogFatal("Frame allocator out of memory (%llu bytes per frame)", (unsigned long long) frame_size);
+    }
+
+    head = start + size;
+    *offset = frame * frame_size + start;
 
-    frames_in_flight = (u32) swapchain->color_images.size();
+    return (u8 *) allocation.mapped + *offset;
+}
+
+VkDescriptorBufferInfo FrameAllocator::Push(void *data, VkDeviceSize size) {
+    VkDescriptorBufferInfo buffer_info;
+    buffer_info.buffer = buffer;
+    buffer_info.range = size;
+
+    void *dst = Allocate(size, &buffer_info.offset);
+    memcpy(dst, data, size);
+
+    return buffer_info;
+}
+
+// The per image state follows the image count of the swapchain
+static void CreateImageSync(RenderPass *render_pass) {
+    u32 image_count = (u32) render_pass->swapchain->color_images.size();
+
+    render_pass->render_finished_semaphores.resize(image_count);
+    for (u32 i = 0; i < image_count; ++i) {
+        render_pass->render_finished_semaphores[i] = CreateSemaphore();
+    }
+
+    render_pass->image_values.assign(image_count, 0);
+}
+
+static void DestroyImageSync(RenderPass *render_pass) {
+    for (VkSemaphore semaphore : render_pass->render_finished_semaphores) {
+        DestroySemaphore(semaphore);
+    }
+
+    render_pass->render_finished_semaphores.clear();
+    render_pass->image_values.clear();
+}
+
+void RenderPass::Create(VulkanSwapchain *swapchain, u32 frames_in_flight) {
+    this->swapchain = swapchain;
+    this->frames_in_flight = frames_in_flight;
 
     graphics_command_pool.Create(VulkanDevice::graphics_index);
     graphics_command_buffers.Create(&graphics_command_pool, frames_in_flight);
 
+    // Needs the job system to exist, every job thread records with its own pools
+    thread_count = JobSystem::thread_count;
+    thread_pools.resize(frames_in_flight * thread_count);
+    for (ThreadCommandPool &thread_pool : thread_pools) {
+        thread_pool.pool.Create(VulkanDevice::graphics_index);
+    }
+
     image_available_semaphores.resize(frames_in_flight);
-    render_finished_semaphores.resize(frames_in_flight);
-    in_flight_fences.resize(frames_in_flight);
+    frame_values.assign(frames_in_flight, 0);
+    input_times.assign(frames_in_flight, 0.0);
 
     for (u32 i = 0; i < frames_in_flight; ++i) {
         image_available_semaphores[i] = CreateSemaphore();
-        render_finished_semaphores[i] = CreateSemaphore();
-        in_flight_fences[i] = CreateFence(VK_FENCE_CREATE_SIGNALED_BIT);
     }
+
+    CreateImageSync(this);
+
+    // Large enough for the matrices and culling inputs of ~100k instances
+    frame_allocator.Create(16 * 1024 * 1024, frames_in_flight);
 }
 
 void RenderPass::Destroy() {
-    for (u32 i = 0; i < swapchain->color_images.size(); ++i) {
+    for (u32 i = 0; i < frames_in_flight; ++i) {
         DestroySemaphore(image_available_semaphores[i]);
-        DestroySemaphore(render_finished_semaphores[i]);
-        DestroyFence(in_flight_fences[i]);
     }
 
+    DestroyImageSync(this);
+
+    frame_allocator.Destroy();
+
+    // Destroying the pool frees its buffers
+    for (ThreadCommandPool &thread_pool : thread_pools) {
+        thread_pool.pool.Destroy();
+    }
+    thread_pools.clear();
+
     graphics_command_buffers.Destroy();
     graphics_command_pool.Destroy();
 }
 
+void RenderPass::WaitForInput() {
+    if (low_latency) {
+        VulkanDevice::graphics_timeline.Wait(VulkanDevice::graphics_timeline.submitted);
+    }
+
+    CountLatency();
+
+    input_time = glfwGetTime();
+}
+
+void RenderPass::CountLatency() {
+    f64 now = glfwGetTime();
+
+    // Only notices a finished frame when it looks, so the latency is at most this late
+    for (u32 i = 0; i < frames_in_flight; ++i) {
+        if (input_times[i] && VulkanDevice::graphics_timeline.IsComplete(frame_values[i])) {
+            RenderStats::CountLatency((now - input_times[i]) * 1000.0);
+            input_times[i] = 0.0;
+        }
+    }
+}
+
 VkCommandBuffer RenderPass::BeginFrame() {
-    swapchain->CheckResize();
+    if (swapchain->CheckRecreate()) {
+        DestroyImageSync(this);
+        CreateImageSync(this);
+    }
+
+    VulkanTimeline *timeline = &VulkanDevice::graphics_timeline;
+
+    timeline->Wait(frame_values[current_frame]);
+    CountLatency();
+
+    // Resources retired by the frames the GPU finished
+    timeline->Collect();
+
+    // The frame slot is free, the frame built now belongs to the last sampled input
+    input_times[current_frame] = input_time;
+    input_time = 0.0;
+
+    // The GPU is done with everything this frame slot wrote last time
+    frame_allocator.Reset(current_frame);
+
+    for (u32 i = 0; i < thread_count; ++i) {
+        ThreadCommandPool *thread_pool = &thread_pools[current_frame * thread_count + i];
+        if (thread_pool->used) {
+            thread_pool->pool.Reset();
+            thread_pool->used = 0;
+        }
+    }
 
-    VK_CHECK(vkWaitForFences(VulkanDevice::handle, 1, &in_flight_fences[current_frame], VK_TRUE, UINT64_MAX));
+    // Hands finished transfer queue uploads over to the graphics queue
+    VulkanUploader::Update();
 
     VkResult result = vkAcquireNextImageKHR(
         VulkanDevice::handle, swapchain->handle,
@@ -535,8 +768,9 @@ VkCommandBuffer RenderPass::BeginFrame() {
     if (result != VK_SUCCESS && result != VK_SUBOPTIMAL_KHR) {
         LogFatal("Failed to acquire swap chain image");
     }
-    
-    VK_CHECK(vkResetFences(VulkanDevice::handle, 1, &in_flight_fences[current_frame]));
+
+    // With more images than frames in flight an older frame may still render into it
+    timeline->Wait(image_values[current_image]);
 
     graphics_command_buffers.Reset(current_frame);
     graphics_command_buffers.Begin(current_frame, VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT);
@@ -547,22 +781,27 @@ VkCommandBuffer RenderPass::BeginFrame() {
 void RenderPass::EndFrame() {
     graphics_command_buffers.End(current_frame);
 
-    VkPipelineStageFlags submit_stage_mask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
+    // Uploads queued during the frame have to land on the queue before the frame that uses them
+    VulkanUploader::Flush();
+
+    VkSemaphoreSubmitInfo wait_info = { VK_STRUCTURE_TYPE_SEMAPHORE_SUBMIT_INFO };
+    wait_info.semaphore = image_available_semaphores[current_frame];
+    wait_info.stageMask = VK_PIPELINE_STAGE_2_COLOR_ATTACHMENT_OUTPUT_BIT;
+
+    VkSemaphoreSubmitInfo signal_info = { VK_STRUCTURE_TYPE_SEMAPHORE_SUBMIT_INFO };
+    signal_info.semaphore = render_finished_semaphores[current_image];
+    signal_info.stageMask = VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT;
 
-    VkSubmitInfo submit_info = { VK_STRUCTURE_TYPE_SUBMIT_INFO };
-    submit_info.waitSemaphoreCount = 1;
-    submit_info.pWaitSemaphores = &image_available_semaphores[current_frame];
-    submit_info.pWaitDstStageMask = &submit_stage_mask;
-    submit_info.commandBufferCount = 1;
-    submit_info.pCommandBuffers = &graphics_command_buffers.buffers[current_frame];
-    submit_info.signalSemaphoreCount = 1;
-    submit_info.pSignalSemaphores = &render_finished_semaphores[current_frame];
+    VulkanTimeline *timeline = &VulkanDevice::graphics_timeline;
 
-    VK_CHECK(vkQueueSubmit(VulkanDevice::graphics_queue, 1, &submit_info, in_flight_fences[current_frame]));
+    u64 value = timeline->Submit(graphics_command_buffers.buffers[current_frame], { &wait_info, 1 }, { &signal_info, 1 });
+    frame_values[current_frame] = value;
+    image_values[current_image] = value;
+    timeline->EndFrame(value);
 
     VkPresentInfoKHR present_info = { VK_STRUCTURE_TYPE_PRESENT_INFO_KHR };
     present_info.waitSemaphoreCount = 1;
-    present_info.pWaitSemaphores = &render_finished_semaphores[current_frame];
+    present_info.pWaitSemaphores = &render_finished_semaphores[current_image];
     present_info.swapchainCount = 1;
     present_info.pSwapchains = &swapchain->handle;
     present_info.pImageIndices = &current_image;
@@ -575,61 +814,84 @@ void RenderPass::EndFrame() {
     current_frame = (current_frame + 1) % frames_in_flight;
 }
 
-void RenderPass::Begin() {
+void RenderPass::Begin(bool clear, bool secondary) {
     VkCommandBuffer graphics_command_buffer = graphics_command_buffers.buffers[current_frame];
 
+    VkAttachmentLoadOp load_op = clear ? VK_ATTACHMENT_LOAD_OP_CLEAR : VK_ATTACHMENT_LOAD_OP_LOAD;
+
     VkRenderingAttachmentInfo color_attachment = { VK_STRUCTURE_TYPE_RENDERING_ATTACHMENT_INFO };
     color_attachment.imageView = swapchain->color_views.at(current_image);
     color_attachment.imageLayout = VK_IMAGE_LAYOUT_ATTACHMENT_OPTIMAL;
-    color_attachment.loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR;
+    color_attachment.loadOp = load_op;
     color_attachment.storeOp = VK_ATTACHMENT_STORE_OP_STORE;
     color_attachment.clearValue.color = { 0.0f, 0.0f, 0.0f, 1.0f };
 
     VkRenderingAttachmentInfo depth_attachment = { VK_STRUCTURE_TYPE_RENDERING_ATTACHMENT_INFO };
     depth_attachment.imageView = swapchain->depth_image.view;
     depth_attachment.imageLayout = VK_IMAGE_LAYOUT_DEPTH_ATTACHMENT_OPTIMAL;
-    depth_attachment.loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR;
-    depth_attachment.storeOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
+    depth_attachment.loadOp = load_op;
+    // Kept for the Hi-Z pyramid and for rendering that continues after it
+    depth_attachment.storeOp = VK_ATTACHMENT_STORE_OP_STORE;
     depth_attachment.clearValue.depthStencil = { 1.0f, 0 };
 
     VkRenderingInfo rendering_info = { VK_STRUCTURE_TYPE_RENDERING_INFO };
+    rendering_info.flags = secondary ? VK_RENDERING_CONTENTS_SECONDARY_COMMAND_BUFFERS_BIT : 0;
     rendering_info.renderArea.extent = swapchain->extent;
     rendering_info.layerCount = 1;
     rendering_info.colorAttachmentCount = 1;
     rendering_info.pColorAttachments = &color_attachment;
     rendering_info.pDepthAttachment = &depth_attachment;
 
-    VkImageMemoryBarrier2 color_image_barrier = { VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER_2 };
-    color_image_barrier.srcStageMask = VK_PIPELINE_STAGE_2_FRAGMENT_SHADER_BIT;
-    color_image_barrier.srcAccessMask = VK_ACCESS_NONE;
-    color_image_barrier.dstStageMask = VK_PIPELINE_STAGE_2_COLOR_ATTACHMENT_OUTPUT_BIT;
-    color_image_barrier.dstAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT;
-    color_image_barrier.oldLayout = VK_IMAGE_LAYOUT_UNDEFINED;
-    color_image_barrier.newLayout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
-    color_image_barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
-    color_image_barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
-    color_image_barrier.image = swapchain->color_images.at(current_image);
-    color_image_barrier.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
-    color_image_barrier.subresourceRange.baseMipLevel = 0;
-    color_image_barrier.subresourceRange.levelCount = 1;
-    color_image_barrier.subresourceRange.baseArrayLayer = 0;
-    color_image_barrier.subresourceRange.layerCount = 1;
-    
-    VkDependencyInfo dependency_info = {};
-    dependency_info.sType = VK_STRUCTURE_TYPE_DEPENDENCY_INFO;
-    dependency_info.pNext = NULL;
-    dependency_info.dependencyFlags = VK_DEPENDENCY_BY_REGION_BIT;
-    dependency_info.memoryBarrierCount = 0;
-    dependency_info.pMemoryBarriers = NULL;
-    dependency_info.bufferMemoryBarrierCount = 0;
-    dependency_info.pBufferMemoryBarriers = NULL;
-    dependency_info.imageMemoryBarrierCount = 1;
-    dependency_info.pImageMemoryBarriers = &color_image_barrier;
-    
-    vkCmdPipelineBarrier2(graphics_command_buffer, &dependency_info);
+    // Continued rendering finds both attachments in the layouts the first Begin left them in
+    if (clear) {
+        VkImageMemoryBarrier2 image_barriers[2] = {};
+
+        VkImageMemoryBarrier2 *color_image_barrier = &image_barriers[0];
+        color_image_barrier->sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER_2;
+        color_image_barrier->srcStageMask = VK_PIPELINE_STAGE_2_FRAGMENT_SHADER_BIT;
+        color_image_barrier->srcAccessMask = VK_ACCESS_NONE;
+        color_image_barrier->dstStageMask = VK_PIPELINE_STAGE_2_COLOR_ATTACHMENT_OUTPUT_BIT;
+        color_image_barrier->dstAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT;
+        color_image_barrier->oldLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+        color_image_barrier->newLayout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
+        color_image_barrier->srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+        color_image_barrier->dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+        color_image_barrier->image = swapchain->color_images.at(current_image);
+        color_image_barrier->subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+        color_image_barrier->subresourceRange.levelCount = 1;
+        color_image_barrier->subresourceRange.layerCount = 1;
+
+        // The previous frame may still be reading the depth for its Hi-Z pyramid
+        VkImageMemoryBarrier2 *depth_image_barrier = &image_barriers[1];
+        depth_image_barrier->sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER_2;
+        depth_image_barrier->srcStageMask = VK_PIPELINE_STAGE_2_LATE_FRAGMENT_TESTS_BIT | VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT;
+        depth_image_barrier->srcAccessMask = VK_ACCESS_NONE;
+        depth_image_barrier->dstStageMask = VK_PIPELINE_STAGE_2_EARLY_FRAGMENT_TESTS_BIT | VK_PIPELINE_STAGE_2_LATE_FRAGMENT_TESTS_BIT;
+        depth_image_barrier->dstAccessMask = VK_ACCESS_2_DEPTH_STENCIL_ATTACHMENT_READ_BIT | VK_ACCESS_2_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
+        depth_image_barrier->oldLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+        depth_image_barrier->newLayout = VK_IMAGE_LAYOUT_DEPTH_ATTACHMENT_OPTIMAL;
+        depth_image_barrier->srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+        depth_image_barrier->dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+        depth_image_barrier->image = swapchain->depth_image.handle;
+        depth_image_barrier->subresourceRange.aspectMask = VK_IMAGE_ASPECT_DEPTH_BIT;
+        depth_image_barrier->subresourceRange.levelCount = 1;
+        depth_image_barrier->subresourceRange.layerCount = 1;
+
+        VkDependencyInfo dependency_info = { VK_STRUCTURE_TYPE_DEPENDENCY_INFO };
+        dependency_info.dependencyFlags = VK_DEPENDENCY_BY_REGION_BIT;
+        dependency_info.imageMemoryBarrierCount = ARRAY_SIZE(image_barriers);
+        dependency_info.pImageMemoryBarriers = image_barriers;
+
+        vkCmdPipelineBarrier2(graphics_command_buffer, &dependency_info);
+    }
 
     vkCmdBeginRendering(graphics_command_buffer, &rendering_info);
 
+    // Secondaries set their own, state is not inherited
+    if (secondary) {
+        return;
+    }
+
     VkViewport viewport = { 0.0f, 0.0f, (f32) swapchain->extent.width, (f32) swapchain->extent.height, 0.0f, 1.0f };
     VkRect2D scissor = { { 0, 0 }, swapchain->extent };
 
@@ -637,11 +899,65 @@ void RenderPass::Begin() {
     vkCmdSetScissor(graphics_command_buffer, 0, 1, &scissor);
 }
 
-void RenderPass::End() {
+VkCommandBuffer RenderPass::BeginSecondary(u32 thread) {
+    ThreadCommandPool *thread_pool = &thread_pools[current_frame * thread_count + thread];
+
+    if (thread_pool->used == thread_pool->secondary_buffers.size()) {
+        VkCommandBufferAllocateInfo command_buffer_info = { VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO };
+        command_buffer_info.commandPool = thread_pool->pool.handle;
+        command_buffer_info.level = VK_COMMAND_BUFFER_LEVEL_SECONDARY;
+        command_buffer_info.commandBufferCount = 1;
+
+        VkCommandBuffer command_buffer;
+        VK_CHECK(vkAllocateCommandBuffers(VulkanDevice::handle, &command_buffer_info, &command_buffer));
+
+        thread_pool->secondary_buffers.push_back(command_buffer);
+    }
+
+    VkCommandBuffer command_buffer = thread_pool->secondary_buffers[thread_pool->used++];
+
+    // Has to match the attachments of Begin and the pipelines drawn with
+    VkCommandBufferInheritanceRenderingInfo inheritance_rendering_info = { VK_STRUCTURE_TYPE_COMMAND_BUFFER_INHERITANCE_RENDERING_INFO };
+    inheritance_rendering_info.colorAttachmentCount = 1;
+    inheritance_rendering_info.pColorAttachmentFormats = &swapchain->format;
+    inheritance_rendering_info.depthAttachmentFormat = VK_FORMAT_D32_SFLOAT;
+    inheritance_rendering_info.rasterizationSamples = VulkanPhysicalDevice::msaa_samples;
+
+    VkCommandBufferInheritanceInfo inheritance_info = { VK_STRUCTURE_TYPE_COMMAND_BUFFER_INHERITANCE_INFO };
+    inheritance_info.pNext = &inheritance_rendering_info;
+    // The statistics query of RenderStats is active while the secondaries execute
+    if (VulkanPhysicalDevice::pipeline_statistics) {
+        inheritance_info.pipelineStatistics = RenderStats::PIPELINE_STATISTICS;
+    }
+
+    VkCommandBufferBeginInfo begin_info = { VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO };
+    begin_info.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT | VK_COMMAND_BUFFER_USAGE_RENDER_PASS_CONTINUE_BIT;
+    begin_info.pInheritanceInfo = &inheritance_info;
+
+    VK_CHECK(vkBeginCommandBuffer(command_buffer, &begin_info));
+
+    VkViewport viewport = { 0.0f, 0.0f, (f32) swapchain->extent.width, (f32) swapchain->extent.height, 0.0f, 1.0f };
+    VkRect2D scissor = { { 0, 0 }, swapchain->extent };
+
+    vkCmdSetViewport(command_buffer, 0, 1, &viewport);
+    vkCmdSetScissor(command_buffer, 0, 1, &scissor);
+
+    return command_buffer;
+}
+
+void RenderPass::EndSecondary(VkCommandBuffer cmd_buf) {
+    VK_CHECK(vkEndCommandBuffer(cmd_buf));
+}
+
+void RenderPass::End(bool present) {
     VkCommandBuffer graphics_command_buffer = graphics_command_buffers.buffers[current_frame];
 
     vkCmdEndRendering(graphics_command_buffer);
 
+    if (!present) {
+        return;
+    }
+
     VkImageMemoryBarrier2 image_barrier = { VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER_2 };
     image_barrier.srcStageMask = VK_PIPELINE_STAGE_2_COLOR_ATTACHMENT_OUTPUT_BIT;
     image_barrier.srcAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT;
@@ -695,6 +1011,8 @@ void Shader::Create(const char *path) {
     shader_info.codeSize = ReadShaderFile(path, (u8 **) &shader_info.pCode);
 
     VK_CHECK(vkCreateShaderModule(VulkanDevice::handle, &shader_info, 0, &module));
+
+    free((void *) shader_info.pCode);
 }
 
 void Shader::Destroy() {
@@ -725,27 +1043,68 @@ void PipelineInfo::AddPushConstant(VkShaderStageFlags stage, u32 size) {
     push_constants.push_back(push_constant_range);
 }
 
-void Pipeline::Create(VulkanSwapchain *swapchain, PipelineInfo *info) {
+void PipelineInfo::Specialize(u32 constant_id, u32 value) {
+    if (constant_id >= specialization.size()) {
+        specialization.resize(constant_id + 1, 0);
+    }
+
+    specialization[constant_id] = value;
+}
+
+// Points specialization_info at the constants of the info, 0 without constants
+static VkSpecializationInfo *GetSpecializationInfo(PipelineInfo *info, array<VkSpecializationMapEntry> *entries, VkSpecializationInfo *specialization_info) {
+    if (info->specialization.empty()) {
+        return 0;
+    }
+
+    for (u32 i = 0; i < info->specialization.size(); ++i) {
+        entries->push_back({ i, i * (u32) sizeof(u32), sizeof(u32) });
+    }
+
+    specialization_info->mapEntryCount = (u32) entries->size();
+    specialization_info->pMapEntries = entries->data();
+    specialization_info->dataSize = info->specialization.size() * sizeof(u32);
+    specialization_info->pData = info->specialization.data();
+
+    return specialization_info;
+}
+
+static void CreatePipelineLayout(PipelineInfo *info, VkDescriptorSetLayout *descriptor_set_layout, VkPipelineLayout *layout) {
     VkDevice device = VulkanDevice::handle;
 
-    VkDescriptorSetLayoutCreateInfo set_create_info = { VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO };
-    set_create_info.flags = VK_DESCRIPTOR_SET_LAYOUT_CREATE_PUSH_DESCRIPTOR_BIT_KHR;
-    set_create_info.bindingCount = (u32) info->set_bindings.size();
-    set_create_info.pBindings = info->set_bindings.data();
+    // Only layouts the pipeline creates are destroyed with it
+    *descriptor_set_layout = VK_NULL_HANDLE;
+    VkDescriptorSetLayout set_layout = info->set_layout;
 
-    VK_CHECK(vkCreateDescriptorSetLayout(device, &set_create_info, 0, &descriptor_set_layout));
+    if (!set_layout) {
+        VkDescriptorSetLayoutCreateInfo set_create_info = { VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO };
+        set_create_info.flags = VK_DESCRIPTOR_SET_LAYOUT_CREATE_PUSH_DESCRIPTOR_BIT_KHR;
+        set_create_info.bindingCount = (u32) info->set_bindings.size();
+        set_create_info.pBindings = info->set_bindings.data();
+
+        VK_CHECK(vkCreateDescriptorSetLayout(device, &set_create_info, 0, descriptor_set_layout));
+        set_layout = *descriptor_set_layout;
+    }
 
     VkPipelineLayoutCreateInfo layout_info = { VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO };
     layout_info.setLayoutCount = 1;
-    layout_info.pSetLayouts = &descriptor_set_layout;
+    layout_info.pSetLayouts = &set_layout;
     layout_info.pushConstantRangeCount = info->push_constants.size();
     layout_info.pPushConstantRanges = info->push_constants.data();
 
-    VK_CHECK(vkCreatePipelineLayout(device, &layout_info, 0, &layout));
+    VK_CHECK(vkCreatePipelineLayout(device, &layout_info, 0, layout));
+}
+
+void Pipeline::Create(VulkanSwapchain *swapchain, PipelineInfo *info) {
+    VkDevice device = VulkanDevice::handle;
+
+    CreatePipelineLayout(info, &descriptor_set_layout, &layout);
 
     VkPipelineRenderingCreateInfo rendering_info = { VK_STRUCTURE_TYPE_PIPELINE_RENDERING_CREATE_INFO };
-    rendering_info.colorAttachmentCount = 1;
-    rendering_info.pColorAttachmentFormats = &swapchain->format;
+    if (!info->depth_target_only) {
+        rendering_info.colorAttachmentCount = 1;
+        rendering_info.pColorAttachmentFormats = &swapchain->format;
+    }
     rendering_info.depthAttachmentFormat = VK_FORMAT_D32_SFLOAT;
 
     array<VkDynamicState> dynamic_states = {
@@ -768,24 +1127,33 @@ void Pipeline::Create(VulkanSwapchain *swapchain, PipelineInfo *info) {
     viewport_info.scissorCount = 1;
 
     VkPipelineRasterizationStateCreateInfo rasterization_info = { VK_STRUCTURE_TYPE_PIPELINE_RASTERIZATION_STATE_CREATE_INFO };
-    rasterization_info.polygonMode = VK_POLYGON_MODE_FILL;
-    rasterization_info.cullMode = VK_CULL_MODE_BACK_BIT;
+    rasterization_info.polygonMode = info->polygon_mode;
+    rasterization_info.cullMode = info->cull_mode;
     rasterization_info.frontFace = VK_FRONT_FACE_COUNTER_CLOCKWISE;
     rasterization_info.lineWidth = 1.0f;
+    rasterization_info.depthBiasEnable = info->depth_bias_constant != 0.0f || info->depth_bias_slope != 0.0f;
+    rasterization_info.depthBiasConstantFactor = info->depth_bias_constant;
+    rasterization_info.depthBiasSlopeFactor = info->depth_bias_slope;
 
     // TODO: MSAA
     VkPipelineMultisampleStateCreateInfo multisample_info = { VK_STRUCTURE_TYPE_PIPELINE_MULTISAMPLE_STATE_CREATE_INFO };
     multisample_info.rasterizationSamples = VulkanPhysicalDevice::msaa_samples;
     multisample_info.minSampleShading = 1.0f;
     multisample_info.sampleShadingEnable = VK_TRUE;
+    if (info->depth_target_only) {
+        multisample_info.rasterizationSamples = VK_SAMPLE_COUNT_1_BIT;
+        multisample_info.sampleShadingEnable = VK_FALSE;
+    }
 
     VkPipelineDepthStencilStateCreateInfo depth_stencil_info = { VK_STRUCTURE_TYPE_PIPELINE_DEPTH_STENCIL_STATE_CREATE_INFO };
     depth_stencil_info.depthTestEnable = VK_TRUE;
-    depth_stencil_info.depthWriteEnable = VK_TRUE;
-    depth_stencil_info.depthCompareOp = VK_COMPARE_OP_LESS;
+    depth_stencil_info.depthWriteEnable = info->depth_write;
+    depth_stencil_info.depthCompareOp = info->depth_compare_op;
 
     VkPipelineColorBlendAttachmentState color_blend_attachment = {};
-    color_blend_attachment.colorWriteMask = VK_COLOR_COMPONENT_R_BIT | VK_COLOR_COMPONENT_G_BIT | VK_COLOR_COMPONENT_B_BIT | VK_COLOR_COMPONENT_A_BIT;
+    if (info->color_write) {
+        color_blend_attachment.colorWriteMask = VK_COLOR_COMPONENT_R_BIT | VK_COLOR_COMPONENT_G_BIT | VK_COLOR_COMPONENT_B_BIT | VK_COLOR_COMPONENT_A_BIT;
+    }
     color_blend_attachment.blendEnable = VK_TRUE;
     color_blend_attachment.srcColorBlendFactor = VK_BLEND_FACTOR_SRC_ALPHA;
     color_blend_attachment.dstColorBlendFactor = VK_BLEND_FACTOR_ONE_MINUS_SRC_ALPHA;
@@ -796,7 +1164,11 @@ void Pipeline::Create(VulkanSwapchain *swapchain, PipelineInfo *info) {
 
     VkPipelineColorBlendStateCreateInfo color_blend_info = { VK_STRUCTURE_TYPE_PIPELINE_COLOR_BLEND_STATE_CREATE_INFO };
     color_blend_info.pAttachments = &color_blend_attachment;
-    color_blend_info.attachmentCount = 1;
+    color_blend_info.attachmentCount = info->depth_target_only ? 0 : 1;
+
+    array<VkSpecializationMapEntry> specialization_entries;
+    VkSpecializationInfo specialization_info = {};
+    VkSpecializationInfo *specialization = GetSpecializationInfo(info, &specialization_entries, &specialization_info);
 
     array<VkPipelineShaderStageCreateInfo> shaders;
 
@@ -805,6 +1177,7 @@ void Pipeline::Create(VulkanSwapchain *swapchain, PipelineInfo *info) {
         stage_info.stage = stage;
         stage_info.module = shader->module;
         stage_info.pName = "main";
+        stage_info.pSpecializationInfo = specialization;
 
         shaders.push_back(stage_info);
     }
@@ -823,7 +1196,9 @@ void Pipeline::Create(VulkanSwapchain *swapchain, PipelineInfo *info) {
     pipeline_info.pDynamicState = &dynamic_state_info;
     pipeline_info.layout = layout;
 
-    VK_CHECK(vkCreateGraphicsPipelines(device, cache, 1, &pipeline_info, 0, &handle));
+    f64 creation_begin = glfwGetTime();
+    VK_CHECK(vkCreateGraphicsPipelines(device, VulkanPipelineCache::handle, 1, &pipeline_info, 0, &handle));
+    VulkanPipelineCache::CountCreation((glfwGetTime() - creation_begin) * 1000.0);
 }
 
 void Pipeline::Destroy() {
@@ -834,182 +1209,345 @@ void Pipeline::Destroy() {
     vkDestroyDescriptorSetLayout(device, descriptor_set_layout, 0);
 }
 
-static void CreateVulkanBuffer(VkDeviceSize size, VkBufferUsageFlags usage, VkMemoryPropertyFlags properties, VkBuffer *buffer, VkDeviceMemory *memory) {
+void ComputePipeline::Create(PipelineInfo *info) {
     VkDevice device = VulkanDevice::handle;
-    
-    VkBufferCreateInfo info = {};
-    info.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
-    info.size = size;
-    info.usage = usage;
-    info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
 
-    if (vkCreateBuffer(device, &info, 0, buffer) != VK_SUCCESS) {
-        LogFatal("Failed to create vertex buffer");
-    }
+    CreatePipelineLayout(info, &descriptor_set_layout, &layout);
 
-    VkMemoryRequirements mem_reqs;
-    vkGetBufferMemoryRequirements(device, *buffer, &mem_reqs);
+    array<VkSpecializationMapEntry> specialization_entries;
+    VkSpecializationInfo specialization_info = {};
 
-    VkMemoryAllocateInfo alloc_info = {};
-    alloc_info.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
-    alloc_info.allocationSize = mem_reqs.size;
-    alloc_info.memoryTypeIndex = FindMemoryType(mem_reqs.memoryTypeBits, properties);
+    VkPipelineShaderStageCreateInfo stage_info = { VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO };
+    stage_info.stage = VK_SHADER_STAGE_COMPUTE_BIT;
+    stage_info.module = info->shaders.at(VK_SHADER_STAGE_COMPUTE_BIT)->module;
+    stage_info.pName = "main";
+    stage_info.pSpecializationInfo = GetSpecializationInfo(info, &specialization_entries, &specialization_info);
 
-    if (vkAllocateMemory(device, &alloc_info, 0, memory) != VK_SUCCESS) {
-        LogFatal("Failed to allocate vertex buffer memory");
-    }
+    VkComputePipelineCreateInfo pipeline_info = { VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO };
+    pipeline_info.stage = stage_info;
+    pipeline_info.layout = layout;
 
-    vkBindBufferMemory(device, *buffer, *memory, 0);
+    f64 creation_begin = glfwGetTime();
+    VK_CHECK(vkCreateComputePipelines(device, VulkanPipelineCache::handle, 1, &pipeline_info, 0, &handle));
+    VulkanPipelineCache::CountCreation((glfwGetTime() - creation_begin) * 1000.0);
 }
 
-static void CopyBuffer(VkBuffer src, VkBuffer dst, VkDeviceSize size, VkCommandPool command_pool) {
+void ComputePipeline::Destroy() {
     VkDevice device = VulkanDevice::handle;
-    VkQueue graphics_queue = VulkanDevice::graphics_queue;
-    
-    VkCommandBufferAllocateInfo info = {};
-    info.sType              = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
-    info.level              = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
-    info.commandPool        = command_pool;
-    info.commandBufferCount = 1;
-
-    VkCommandBuffer command_buffer;
-    vkAllocateCommandBuffers(device, &info, &command_buffer);
-    
-    VkCommandBufferBeginInfo begin_info = {};
-    begin_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
-    begin_info.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
-
-    vkBeginCommandBuffer(command_buffer, &begin_info);
-
-    VkBufferCopy region;
-    region.srcOffset = 0;
-    region.dstOffset = 0;
-    region.size      = size;
-    vkCmdCopyBuffer(command_buffer, src, dst, 1, &region);
 
-    vkEndCommandBuffer(command_buffer);
+    vkDestroyPipeline(device, handle, 0);
+    vkDestroyPipelineLayout(device, layout, 0);
+    vkDestroyDescriptorSetLayout(device, descriptor_set_layout, 0);
+}
 
-    VkSubmitInfo submit = {};
-    submit.sType                = VK_STRUCTURE_TYPE_SUBMIT_INFO;
-    submit.commandBufferCount   = 1;
-    submit.pCommandBuffers      = &command_buffer;
+static void CreateVulkanBuffer(VkDeviceSize size, VkBufferUsageFlags usage, VkMemoryPropertyFlags properties, VkBuffer *buffer, VulkanAllocation *allocation, VkMemoryPropertyFlags preferred=0) {
+    VkDevice device = VulkanDevice::handle;
+    
+    VkBufferCreateInfo info = {};
+    info.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+    info.size = size;
+    info.usage = usage;
+    info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
 
-    vkQueueSubmit(graphics_queue, 1, &submit, VK_NULL_HANDLE);
-    vkQueueWaitIdle(graphics_queue);
+    if (vkCreateBuffer(device, &info, 0, buffer) != VK_SUCCESS) {
+        LogFatal("Failed to create vertex buffer");
+    }
 
-    vkFreeCommandBuffers(device, command_pool, 1, &command_buffer);
+    *allocation = VulkanAllocator::AllocateBuffer(*buffer, properties, preferred);
 }
 
-void StorageBuffer::Create(void *data, VkDeviceSize size) {
-    Create(size);
+void StorageBuffer::Create(void *data, VkDeviceSize size, BufferMode mode) {
+    Create(size, mode);
     SetData(data, size);
 }
 
-void StorageBuffer::Create(VkDeviceSize size) {
+void StorageBuffer::Create(VkDeviceSize size, BufferMode mode) {
     this->size = size;
+    this->mode = mode;
 
-    VkDevice device = VulkanDevice::handle;
+    if (mode == BUFFER_STATIC) {
+        const VkMemoryPropertyFlags host_flags = VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
 
-    CreateVulkanBuffer(size, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, &buffer, &memory);
+        CreateVulkanBuffer(size, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, &buffer, &allocation, host_flags);
 
-    vkMapMemory(device, memory, 0, size, 0, &mapped);
+        // Write straight into VRAM when it is mappable (resizable BAR / UMA), upload otherwise
+        mapped = (allocation.properties & host_flags) == host_flags ? allocation.mapped : 0;
+    } else {
+        CreateVulkanBuffer(size, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, &buffer, &allocation);
+
+        mapped = allocation.mapped;
+    }
 }
 
 void StorageBuffer::Destroy() {
     VkDevice device = VulkanDevice::handle;
 
-    vkUnmapMemory(device, memory);
     vkDestroyBuffer(device, buffer, 0);
-    vkFreeMemory(device, memory, 0);
+    VulkanAllocator::Free(&allocation);
 }
 
 void StorageBuffer::SetData(void *data, VkDeviceSize size) {
-    memcpy(mapped, data, size);
+    if (mapped) {
+        memcpy(mapped, data, size);
+    } else {
+        VulkanUploader::UploadBuffer(buffer, 0, data, size);
+    }
 }
 
-void IndexBuffer::Create(u32 *data, u32 count, VkCommandPool command_pool) {
+void IndexBuffer::Create(u32 *data, u32 count) {
     this->count = count;
 
-    VkDevice device = VulkanDevice::handle;
-
     VkDeviceSize size = (u64)count * sizeof(u32);
 
-    VkBuffer staging_buffer;
-    VkDeviceMemory staging_memory;
+    CreateVulkanBuffer(size, VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_INDEX_BUFFER_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, &buffer, &allocation);
 
-    CreateVulkanBuffer(size, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, &staging_buffer, &staging_memory);
-
-    void *mapped;
-    vkMapMemory(device, staging_memory, 0, size, 0, &mapped);
-    memcpy(mapped, data, size);
-    vkUnmapMemory(device, staging_memory);
-
-    CreateVulkanBuffer(size, VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_INDEX_BUFFER_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, &buffer, &memory);
-
-    CopyBuffer(staging_buffer, buffer, size, command_pool);
-
-    vkDestroyBuffer(device, staging_buffer, 0);
-    vkFreeMemory(device, staging_memory, 0);
+    // Only queued here, the copy is submitted with the next VulkanUploader::Flush
+    VulkanUploader::UploadBuffer(buffer, 0, data, size);
 }
 
 void IndexBuffer::Destroy() {
     VkDevice device = VulkanDevice::handle;
     
     vkDestroyBuffer(device, buffer, 0);
-    vkFreeMemory(device, memory, 0);
+    VulkanAllocator::Free(&allocation);
 }
 
-VkQueryPool RenderStats::query_pool = VK_NULL_HANDLE;
+array<RenderStatsFrame> RenderStats::frames;
+u32 RenderStats::frame = 0;
+array<u32> RenderStats::open_scopes;
+array<GPUScopeTime> RenderStats::scope_times;
+bool RenderStats::collect_statistics = true;
 f64 RenderStats::mspf_cpu = 0;
 f64 RenderStats::mspf_gpu = 0;
+f64 RenderStats::mspf_passes[RENDER_STATS_PASS_COUNT] = {};
+f64 RenderStats::mspf_cascades[MAX_SHADOW_CASCADES] = {};
+f64 RenderStats::ms_latency = 0;
+f64 RenderStats::overdraw = 0;
 u64 RenderStats::draw_calls = 0;
 u64 RenderStats::triangles = 0;
+u64 RenderStats::visible_objects = 0;
+u64 RenderStats::culled_objects = 0;
+u64 RenderStats::early_instances = 0;
+u64 RenderStats::late_instances = 0;
+u64 RenderStats::occluded_instances = 0;
 f64 RenderStats::cpu_frame_time_begin = 0;
 
 #ifndef MAG_DIST
-void RenderStats::Create() {
-    VkQueryPoolCreateInfo query_pool_info = { VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO };
-    query_pool_info.queryType = VK_QUERY_TYPE_TIMESTAMP;
-    query_pool_info.queryCount = 2;
+void RenderStats::Create(u32 frames_in_flight) {
+    frames.resize(frames_in_flight);
+    frame = 0;
+
+    for (RenderStatsFrame &stats_frame : frames) {
+        VkQueryPoolCreateInfo query_pool_info = { VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO };
+        query_pool_info.queryType = VK_QUERY_TYPE_TIMESTAMP;
+        query_pool_info.queryCount = TIMESTAMP_COUNT;
 
-    VK_CHECK(vkCreateQueryPool(VulkanDevice::handle, &query_pool_info, 0, &query_pool));
+        VK_CHECK(vkCreateQueryPool(VulkanDevice::handle, &query_pool_info, 0, &stats_frame.query_pool));
+
+        if (VulkanPhysicalDevice::pipeline_statistics) {
+            VkQueryPoolCreateInfo statistics_pool_info = { VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO };
+            statistics_pool_info.queryType = VK_QUERY_TYPE_PIPELINE_STATISTICS;
+            statistics_pool_info.queryCount = 1;
+            statistics_pool_info.pipelineStatistics = PIPELINE_STATISTICS;
+
+            VK_CHECK(vkCreateQueryPool(VulkanDevice::handle, &statistics_pool_info, 0, &stats_frame.statistics_pool));
+        }
+    }
 }
 
 void RenderStats::Destroy() {
-    vkDestroyQueryPool(VulkanDevice::handle, query_pool, 0);
+    for (RenderStatsFrame &stats_frame : frames) {
+        vkDestroyQueryPool(VulkanDevice::handle, stats_frame.query_pool, 0);
+        vkDestroyQueryPool(VulkanDevice::handle, stats_frame.statistics_pool, 0);
+    }
+
+    frames.clear();
+    scope_times.clear();
 }
 
-void RenderStats::Begin(VkCommandBuffer cmd_buf) {
+void RenderStats::Begin(VkCommandBuffer cmd_buf, u32 frame) {
     draw_calls = 0;
     triangles = 0;
+    visible_objects = 0;
+    culled_objects = 0;
+    early_instances = 0;
+    late_instances = 0;
+    occluded_instances = 0;
     cpu_frame_time_begin = glfwGetTime() * 1000;
 
-    vkCmdResetQueryPool(cmd_buf, query_pool, 0, 2);
-    vkCmdWriteTimestamp(cmd_buf, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, query_pool, 0);
+    RenderStats::frame = frame;
+    RenderStatsFrame *stats_frame = &frames[frame];
+
+    if (stats_frame->recorded) {
+        ReadFrame(stats_frame);
+    }
+
+    stats_frame->scopes.clear();
+    stats_frame->statistics_samples = 0;
+    stats_frame->recorded = true;
+    open_scopes.clear();
+
+    vkCmdResetQueryPool(cmd_buf, stats_frame->query_pool, 0, TIMESTAMP_COUNT);
+    if (stats_frame->statistics_pool) {
+        vkCmdResetQueryPool(cmd_buf, stats_frame->statistics_pool, 0, 1);
+    }
+    vkCmdWriteTimestamp(cmd_buf, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, stats_frame->query_pool, 0);
 }
 
 void RenderStats::EndGPU(VkCommandBuffer cmd_buf) {
-    vkCmdWriteTimestamp(cmd_buf, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, query_pool, 1);
+    vkCmdWriteTimestamp(cmd_buf, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, frames[frame].query_pool, 1);
 }
 
 void RenderStats::EndCPU() {
     f64 cpu_frame_time_end = glfwGetTime() * 1000;
     f64 cpu_frame_time_delta = cpu_frame_time_end - cpu_frame_time_begin;
     mspf_cpu = mspf_cpu * 0.95 + cpu_frame_time_delta * 0.05;
+}
 
-    u64 query_results[2];
-    
-    VK_CHECK(vkGetQueryPoolResults(
-        VulkanDevice::handle, query_pool,
-        0, 2, sizeof(query_results), query_results,
-        sizeof(query_results[0]), VK_QUERY_RESULT_64_BIT | VK_QUERY_RESULT_WAIT_BIT
-    ));
+void RenderStats::ReadFrame(RenderStatsFrame *stats_frame) {
+    // The frame is done, so every query that was written is available. Passes and scopes
+    // that did not run were never written and are not available, nothing waits for them.
+    u32 query_count = SCOPE_TIMESTAMPS + (u32) stats_frame->scopes.size() * 2;
+    u64 results[TIMESTAMP_COUNT][2];
+
+    VkResult result = vkGetQueryPoolResults(
+        VulkanDevice::handle, stats_frame->query_pool,
+        0, query_count, query_count * sizeof(results[0]), results,
+        sizeof(results[0]), VK_QUERY_RESULT_64_BIT | VK_QUERY_RESULT_WITH_AVAILABILITY_BIT
+    );
+    if (result != VK_SUCCESS && result != VK_NOT_READY) {
+        LogFatal("Failed to read the timestamps of a frame");
+    }
 
     f64 timestamp_period = VulkanPhysicalDevice::properties.limits.timestampPeriod;
-    f64 gpu_frame_time_begin = f64(query_results[0]) * timestamp_period * 1e-6;
-    f64 gpu_frame_time_end = f64(query_results[1]) * timestamp_period * 1e-6;
-    f64 gpu_frame_time_delta = gpu_frame_time_end - gpu_frame_time_begin;
-    mspf_gpu = mspf_gpu * 0.95 + gpu_frame_time_delta * 0.05;
+    auto Duration = [&](u32 begin, u32 end) {
+        return (results[begin][1] && results[end][1]) ? f64(results[end][0] - results[begin][0]) * timestamp_period * 1e-6 : 0.0;
+    };
+
+    if (results[0][1] && results[1][1]) {
+        mspf_gpu = mspf_gpu * 0.95 + Duration(0, 1) * 0.05;
+    }
+
+    for (u32 cascade = 0; cascade < MAX_SHADOW_CASCADES; ++cascade) {
+        u32 begin = 2 + PASS_TIMESTAMPS + cascade * 2;
+        mspf_cascades[cascade] = mspf_cascades[cascade] * 0.95 + Duration(begin, begin + 1) * 0.05;
+    }
+
+    for (u32 pass = 0; pass < RENDER_STATS_PASS_COUNT; ++pass) {
+        f64 pass_time = 0.0;
+
+        for (u32 phase = 0; phase < MAX_PASS_PHASES; ++phase) {
+            u32 begin = 2 + (phase * RENDER_STATS_PASS_COUNT + pass) * 2;
+            pass_time += Duration(begin, begin + 1);
+        }
+
+        mspf_passes[pass] = mspf_passes[pass] * 0.95 + pass_time * 0.05;
+    }
+
+    // Smoothed while the same scope is at the same place, a new scope starts from its first time
+    array<GPUScopeTime> times;
+    times.reserve(stats_frame->scopes.size());
+
+    for (u32 i = 0; i < stats_frame->scopes.size(); ++i) {
+        GPUScopeQuery *scope = &stats_frame->scopes[i];
+
+        GPUScopeTime time;
+        time.name = scope->name;
+        time.depth = scope->depth;
+        time.ms = Duration(scope->query, scope->query + 1);
+
+        if (i < scope_times.size() && scope_times[i].depth == time.depth && !strcmp(scope_times[i].name, time.name)) {
+            time.ms = scope_times[i].ms * 0.95 + time.ms * 0.05;
+        }
+
+        times.push_back(time);
+    }
+
+    scope_times = std::move(times);
+
+    if (stats_frame->statistics_pool && stats_frame->statistics_samples) {
+        u64 fragment_invocations[2];
+
+        vkGetQueryPoolResults(
+            VulkanDevice::handle, stats_frame->statistics_pool,
+            0, 1, sizeof(fragment_invocations), fragment_invocations,
+            sizeof(fragment_invocations), VK_QUERY_RESULT_64_BIT | VK_QUERY_RESULT_WITH_AVAILABILITY_BIT
+        );
+
+        if (fragment_invocations[1]) {
+            f64 frame_overdraw = f64(fragment_invocations[0]) / f64(stats_frame->statistics_samples);
+            overdraw = overdraw * 0.95 + frame_overdraw * 0.05;
+        }
+    }
+}
+
+void RenderStats::BeginPass(VkCommandBuffer cmd_buf, RenderStatsPass pass, u32 phase) {
+    vkCmdWriteTimestamp(cmd_buf, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, frames[frame].query_pool, 2 + (phase * RENDER_STATS_PASS_COUNT + pass) * 2);
+}
+
+void RenderStats::EndPass(VkCommandBuffer cmd_buf, RenderStatsPass pass, u32 phase) {
+    vkCmdWriteTimestamp(cmd_buf, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, frames[frame].query_pool, 2 + (phase * RENDER_STATS_PASS_COUNT + pass) * 2 + 1);
+}
+
+void RenderStats::BeginCascade(VkCommandBuffer cmd_buf, u32 cascade) {
+    vkCmdWriteTimestamp(cmd_buf, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, frames[frame].query_pool, 2 + PASS_TIMESTAMPS + cascade * 2);
+}
+
+void RenderStats::EndCascade(VkCommandBuffer cmd_buf, u32 cascade) {
+    vkCmdWriteTimestamp(cmd_buf, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, frames[frame].query_pool, 2 + PASS_TIMESTAMPS + cascade * 2 + 1);
+}
+
+void RenderStats::BeginScope(VkCommandBuffer cmd_buf, const char *name) {
+    RenderStatsFrame *stats_frame = &frames[frame];
+
+    u32 index = (u32) stats_frame->scopes.size();
+    open_scopes.push_back(index);
+
+    if (index >= MAX_SCOPES) {
+        return;
+    }
+
+    GPUScopeQuery scope;
+    scope.name = name;
+    scope.depth = (u32) open_scopes.size() - 1;
+    scope.query = SCOPE_TIMESTAMPS + index * 2;
+    stats_frame->scopes.push_back(scope);
+
+    vkCmdWriteTimestamp(cmd_buf, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, stats_frame->query_pool, scope.query);
+}
+
+void RenderStats::EndScope(VkCommandBuffer cmd_buf) {
+    u32 index = open_scopes.back();
+    open_scopes.pop_back();
+
+    if (index >= MAX_SCOPES) {
+        return;
+    }
+
+    vkCmdWriteTimestamp(cmd_buf, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, frames[frame].query_pool, frames[frame].scopes[index].query + 1);
+}
+
+void RenderStats::LogScopes() {
+    for (GPUScopeTime &time : scope_times) {
+        LogInfo("%*s%s: %.3fms", time.depth * 2, "", time.name, time.ms);
+    }
+}
+
+void RenderStats::BeginStatistics(VkCommandBuffer cmd_buf) {
+    RenderStatsFrame *stats_frame = &frames[frame];
+
+    if (stats_frame->statistics_pool && collect_statistics) {
+        vkCmdBeginQuery(cmd_buf, stats_frame->statistics_pool, 0, 0);
+    }
+}
+
+void RenderStats::EndStatistics(VkCommandBuffer cmd_buf, u64 samples) {
+    RenderStatsFrame *stats_frame = &frames[frame];
+
+    if (stats_frame->statistics_pool && collect_statistics) {
+        vkCmdEndQuery(cmd_buf, stats_frame->statistics_pool, 0);
+        stats_frame->statistics_samples = samples;
+    }
 }
 
 void RenderStats::DrawCall() {
@@ -1020,18 +1558,49 @@ void RenderStats::CountTriangles(u64 count) {
     triangles += count;
 }
 
+void RenderStats::CountCulling(u64 visible, u64 culled) {
+    visible_objects += visible;
+    culled_objects += culled;
+}
+
+void RenderStats::CountOcclusion(u64 early, u64 late, u64 occluded) {
+    early_instances += early;
+    late_instances += late;
+    occluded_instances += occluded;
+}
+
+void RenderStats::CountLatency(f64 ms) {
+    ms_latency = ms_latency * 0.95 + ms * 0.05;
+}
+
 void RenderStats::SetTitle(GLFWwindow *window) {
-    char title[256];
-    sprintf(title, "cpu: %.2fms, gpu: %.2fms, render calls: %llu, triangles: %llu", mspf_cpu, mspf_gpu, draw_calls, triangles);
+    char title[384];
+    snprintf(title, sizeof(title), "cpu: %.2fms, gpu: %.2fms, latency: %.2fms, depth pass: %.2fms, color pass: %.2fms, shadows: %.2f/%.2f/%.2f/%.2fms, overdraw: %.2f, render calls: %llu, triangles: %llu, visible: %llu, culled: %llu, early: %llu, late: %llu, occluded: %llu",
+        mspf_cpu, mspf_gpu, ms_latency, mspf_passes[RENDER_STATS_DEPTH_PASS], mspf_passes[RENDER_STATS_COLOR_PASS],
+        mspf_cascades[0], mspf_cascades[1], mspf_cascades[2], mspf_cascades[3], overdraw,
+        draw_calls, triangles, visible_objects, culled_objects, early_instances, late_instances, occluded_instances);
     glfwSetWindowTitle(window, title);
 }
 #else
-void RenderStats::Create() {}
+void RenderStats::Create(u32 frames_in_flight) {}
 void RenderStats::Destroy() {}
-void RenderStats::Begin(VkCommandBuffer cmd_buf);
-void RenderStats::EndGPU(VkCommandBuffer cmd_buf);
-void RenderStats::EndCPU(VkCommandBuffer cmd_buf);
+void RenderStats::Begin(VkCommandBuffer cmd_buf, u32 frame) {}
+void RenderStats::EndGPU(VkCommandBuffer cmd_buf) {}
+void RenderStats::EndCPU() {}
+void RenderStats::ReadFrame(RenderStatsFrame *stats_frame) {}
 void RenderStats::DrawCall() {}
 void RenderStats::CountTriangles(u64 count) {}
+void RenderStats::CountCulling(u64 visible, u64 culled) {}
+void RenderStats::CountOcclusion(u64 early, u64 late, u64 occluded) {}
+void RenderStats::CountLatency(f64 ms) {}
+void RenderStats::BeginPass(VkCommandBuffer cmd_buf, RenderStatsPass pass, u32 phase) {}
+void RenderStats::EndPass(VkCommandBuffer cmd_buf, RenderStatsPass pass, u32 phase) {}
+void RenderStats::BeginCascade(VkCommandBuffer cmd_buf, u32 cascade) {}
+void RenderStats::EndCascade(VkCommandBuffer cmd_buf, u32 cascade) {}
+void RenderStats::BeginScope(VkCommandBuffer cmd_buf, const char *name) {}
+void RenderStats::EndScope(VkCommandBuffer cmd_buf) {}
+void RenderStats::LogScopes() {}
+void RenderStats::BeginStatistics(VkCommandBuffer cmd_buf) {}
+void RenderStats::EndStatistics(VkCommandBuffer cmd_buf, u64 samples) {}
 void RenderStats::SetTitle(GLFWwindow *window) {}
 #endif
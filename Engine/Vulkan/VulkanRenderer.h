@@ -11,6 +11,12 @@
 #include <glm/glm.hpp>
 
 #include "Common.h"
+#include "VulkanMemory.h"
+#include "VulkanUpload.h"
+#include "VulkanGeometry.h"
+#include "VulkanBindless.h"
+#include "VulkanPipelineCache.h"
+#include "VulkanTimeline.h"
 
 #define VK_CHECK(call) \
     if (call != VK_SUCCESS) { \
@@ -39,7 +45,14 @@ struct VulkanPhysicalDevice {
     static VkPhysicalDeviceProperties properties;
     static u32 graphics;
     static u32 present;
+    // Equal to graphics if the GPU has no separate transfer family
+    static u32 transfer;
     static VkSampleCountFlagBits msaa_samples;
+    // Pipeline statistics queries that stay active across secondary command buffers,
+    // RenderStats counts shaded fragments with them
+    static bool pipeline_statistics;
+    // Line and point polygon modes, for wireframe pipelines
+    static bool fill_mode_non_solid;
 
     static VulkanPhysicalDevice *Get();
     static void Pick(VulkanContext *ctx);
@@ -50,8 +63,13 @@ struct VulkanDevice {
     static VkDevice handle;
     static VkQueue graphics_queue;
     static VkQueue present_queue;
+    static VkQueue transfer_queue;
     static u32 graphics_index;
     static u32 present_index;
+    static u32 transfer_index;
+    // One per queue, graphics_timeline also keeps the deferred destroys of the frames
+    static VulkanTimeline graphics_timeline;
+    static VulkanTimeline transfer_timeline;
 
     static VulkanDevice *Get();
     static void Create(VulkanContext *ctx);
@@ -83,9 +101,10 @@ struct VulkanCommandBuffers {
 struct VulkanImage {
     VkImage handle;
     VkImageView view;
-    VkDeviceMemory memory;
+    VulkanAllocation allocation;
 
-    void Create(VkFormat format, u32 width, u32 height, u32 mip_levels, VkSampleCountFlagBits samples, VkImageUsageFlags usage);
+    // With more than one layer the view is a 2D array of all of them
+    void Create(VkFormat format, u32 width, u32 height, u32 mip_levels, VkSampleCountFlagBits samples, VkImageUsageFlags usage, VulkanAllocationStrategy strategy=VULKAN_ALLOCATION_GENERAL, u32 layers=1);
     void Destroy();
 };
 
@@ -96,15 +115,56 @@ struct VulkanSwapchain {
     array<VkImage> color_images;
     array<VkImageView> color_views;
     VulkanImage depth_image;
-    bool vsync;
+    // FIFO waits for vertical blank, MAILBOX replaces the queued image and IMMEDIATE tears.
+    // Unsupported modes fall back to FIFO when they are requested.
+    VkPresentModeKHR present_mode;
+    VkPresentModeKHR requested_present_mode;
     
     VkSurfaceFormatKHR ChooseFormat();
-    VkPresentModeKHR ChooseSwapPresentMode(bool vsync); 
+    static bool IsPresentModeSupported(VkPresentModeKHR present_mode);
+    // The requested mode if the surface supports it, FIFO otherwise, which it always does
+    VkPresentModeKHR ChooseSwapPresentMode(VkPresentModeKHR requested); 
 
-    void Create(bool vsync);
+    void Create(VkPresentModeKHR present_mode=VK_PRESENT_MODE_FIFO_KHR);
     void Destroy();
 
-    void CheckResize();
+    // Takes effect with the next CheckRecreate
+    void SetPresentMode(VkPresentModeKHR present_mode);
+
+    // Recreates the swapchain when the window was resized or another present mode was
+    // requested, returns true if it did. The image count may change.
+    bool CheckRecreate();
+};
+
+// Linear allocator for GPU data that only lives for one frame (scene constants, per draw
+// and per instance data). One mapped buffer is split into one partition per frame in flight,
+// a partition is rewound once the fence of its frame has signaled, so the CPU never
+// overwrites data the GPU is still reading.
+struct FrameAllocator {
+    VkBuffer buffer;
+    VulkanAllocation allocation;
+    VkDeviceSize frame_size;
+    VkDeviceSize alignment;
+    u32 frame_count;
+    u32 frame;
+    VkDeviceSize head;
+
+    void Create(VkDeviceSize frame_size, u32 frame_count);
+    void Destroy();
+
+    void Reset(u32 frame);
+
+    // Returns where to write size bytes to, offset is relative to the start of buffer
+    void *Allocate(VkDeviceSize size, VkDeviceSize *offset);
+    VkDescriptorBufferInfo Push(void *data, VkDeviceSize size);
+};
+
+// Secondary command buffers of one recording thread for one frame in flight. The pool is
+// reset as a whole once the frame's fence is signaled, buffers are allocated on demand.
+struct ThreadCommandPool {
+    VulkanCommandPool pool;
+    array<VkCommandBuffer> secondary_buffers;
+    u32 used = 0;
 };
 
 struct RenderPass {
@@ -112,23 +172,59 @@ struct RenderPass {
     VulkanCommandPool graphics_command_pool;
     VulkanCommandBuffers graphics_command_buffers;
 
+    // frames_in_flight * JobSystem::thread_count, indexed by frame first
+    array<ThreadCommandPool> thread_pools;
+    u32 thread_count = 0;
+
+    // Per frame in flight, binary because acquire can not signal a timeline semaphore
     array<VkSemaphore> image_available_semaphores;
+    // Per frame in flight, the graphics timeline value of the frame's last submission, 0 if none
+    array<u64> frame_values;
+    // Per swapchain image, present waits for the image's own semaphore
     array<VkSemaphore> render_finished_semaphores;
-    array<VkFence> in_flight_fences;
+    // Value of the frame that last rendered into each swapchain image, the driver may hand
+    // out images in any order, so a frame waits for the image it acquired to be done
+    array<u64> image_values;
 
+    FrameAllocator frame_allocator;
+
+    // How far the CPU may run ahead of the GPU, independent of the swapchain image count.
+    // Every frame in flight adds up to a frame of input latency.
     u32 frames_in_flight = 0;
     u32 current_image = 0;
     // need this because current_image is overwritten by vkAcquireNextImageKHR
     u32 current_frame = 0;
 
+    // WaitForInput waits for the GPU to finish every submitted frame, the frame is then
+    // built from input that is a whole GPU frame fresher, at the cost of CPU/GPU overlap
+    bool low_latency = false;
+    // glfwGetTime of the last WaitForInput, and of the input of every frame in flight.
+    // 0 without WaitForInput and once the latency of the frame was counted.
+    f64 input_time = 0.0;
+    array<f64> input_times;
+
     VkCommandBuffer BeginFrame();
     void EndFrame();
 
-    void Create(VulkanSwapchain *swapchain);
+    void Create(VulkanSwapchain *swapchain, u32 frames_in_flight=2);
     void Destroy();
 
-    void Begin();
-    void End();
+    // Call right before the input of the next frame is sampled. Also notes the time for
+    // the latency in RenderStats.
+    void WaitForInput();
+    // Counts the latency of the frames the GPU has finished
+    void CountLatency();
+
+    // clear=false continues rendering into the attachments of the last Begin, present=false
+    // leaves them as attachments so rendering can continue after compute work. With
+    // secondary=true the rendering may only contain vkCmdExecuteCommands.
+    void Begin(bool clear=true, bool secondary=false);
+    void End(bool present=true);
+
+    // Secondary command buffer that continues the rendering of Begin, viewport and scissor
+    // are set. Can be called from any job thread, each thread records into its own pool.
+    VkCommandBuffer BeginSecondary(u32 thread);
+    void EndSecondary(VkCommandBuffer cmd_buf);
 };
 
 struct Shader {
@@ -148,31 +244,69 @@ struct PipelineInfo {
     map<VkShaderStageFlagBits, Shader *> shaders;
     array<VkDescriptorSetLayoutBinding> set_bindings;
     array<VkPushConstantRange> push_constants;
+    // Set 0 of the pipeline instead of a push descriptor set made from set_bindings,
+    // e.g. BindlessDescriptors::set_layout. Not owned by the pipeline.
+    VkDescriptorSetLayout set_layout = VK_NULL_HANDLE;
+    // A pass after a depth pre-pass tests with VK_COMPARE_OP_EQUAL and writes no depth,
+    // depth only pipelines have no fragment shader and write no color
+    VkCompareOp depth_compare_op = VK_COMPARE_OP_LESS;
+    bool depth_write = true;
+    bool color_write = true;
+    // Renders into a single sampled depth attachment, e.g. a shadow map
+    bool depth_target_only = false;
+    VkCullModeFlags cull_mode = VK_CULL_MODE_BACK_BIT;
+    // Anything but FILL needs VulkanPhysicalDevice::fill_mode_non_solid
+    VkPolygonMode polygon_mode = VK_POLYGON_MODE_FILL;
+    // Slope scaled depth bias, off while both are 0
+    f32 depth_bias_constant = 0.0f;
+    f32 depth_bias_slope = 0.0f;
+    // Specialization constants of every stage, constant_id is the index. 32 bit each, bools
+    // are VkBool32. Constants that are not set keep the default of the shader.
+    array<u32> specialization;
     
     void AddShader(VkShaderStageFlagBits stage, Shader *shader);
     void AddBinding(VkShaderStageFlags stage, VkDescriptorType type);
     void AddPushConstant(VkShaderStageFlags stage, u32 size);
+    // Ids below constant_id that were never set get 0
+    void Specialize(u32 constant_id, u32 value);
 };
 
 struct Pipeline {
     VkPipeline handle;
     VkPipelineLayout layout;
     VkDescriptorSetLayout descriptor_set_layout;
-    // TODO: cache
-    VkPipelineCache cache = 0;
 
     void Create(VulkanSwapchain *swapchain, PipelineInfo *info);
     void Destroy();
 };
 
+struct ComputePipeline {
+    VkPipeline handle;
+    VkPipelineLayout layout;
+    VkDescriptorSetLayout descriptor_set_layout;
+
+    void Create(PipelineInfo *info);
+    void Destroy();
+};
+
+enum BufferMode {
+    // Rewritten by the CPU (e.g. every frame), host visible and persistently mapped
+    BUFFER_DYNAMIC,
+    // Written once, lives in device local memory. Uses host visible device local memory
+    // if the GPU exposes it, otherwise the data goes through VulkanUploader.
+    BUFFER_STATIC
+};
+
 struct StorageBuffer {
     VkBuffer buffer;
-    VkDeviceMemory memory;
+    VulkanAllocation allocation;
+    // 0 for static buffers that are not host visible
     void *mapped;
     VkDeviceSize size;
+    BufferMode mode;
 
-    void Create(void *data, VkDeviceSize size);
-    void Create(VkDeviceSize size);
+    void Create(void *data, VkDeviceSize size, BufferMode mode=BUFFER_DYNAMIC);
+    void Create(VkDeviceSize size, BufferMode mode=BUFFER_DYNAMIC);
     void Destroy();
 
     void SetData(void *data, VkDeviceSize size);
@@ -180,35 +314,147 @@ struct StorageBuffer {
 
 struct IndexBuffer {
     VkBuffer buffer;
-    VkDeviceMemory memory;
+    VulkanAllocation allocation;
     u32 count;
 
-    void Create(u32 *data, u32 count, VkCommandPool command_pool);
+    void Create(u32 *data, u32 count);
     void Destroy();
 };
 
+enum RenderStatsPass {
+    RENDER_STATS_DEPTH_PASS,
+    RENDER_STATS_COLOR_PASS,
+    RENDER_STATS_PASS_COUNT
+};
+
+// A named timing begun with RenderStats::BeginScope, query is its begin timestamp and
+// query + 1 its end
+struct GPUScopeQuery {
+    const char *name;
+    u32 depth;
+    u32 query;
+};
+
+// A scope of a finished frame in the order it was begun, depth 0 is outermost
+struct GPUScopeTime {
+    const char *name;
+    u32 depth;
+    f64 ms;
+};
+
+// Queries of one frame in flight. They are read when the frame slot comes around again,
+// RenderPass::BeginFrame waited for the slot's frame then, so the read never blocks.
+struct RenderStatsFrame {
+    VkQueryPool query_pool = VK_NULL_HANDLE;
+    // Only with VulkanPhysicalDevice::pipeline_statistics
+    VkQueryPool statistics_pool = VK_NULL_HANDLE;
+    array<GPUScopeQuery> scopes;
+    // 0 if the statistics query did not run
+    u64 statistics_samples = 0;
+    // The pools are undefined before their first reset
+    bool recorded = false;
+};
+
 struct RenderStats {
-    static VkQueryPool query_pool;
+    // Occlusion culling phases a pass can be split into
+    static const u32 MAX_PASS_PHASES = 2;
+    static const u32 MAX_SHADOW_CASCADES = 4;
+    static const u32 MAX_SCOPES = 32;
+    // Frame begin and end, then a begin and end per pass and phase, per shadow cascade and per scope
+    static const u32 PASS_TIMESTAMPS = RENDER_STATS_PASS_COUNT * MAX_PASS_PHASES * 2;
+    static const u32 SCOPE_TIMESTAMPS = 2 + PASS_TIMESTAMPS + MAX_SHADOW_CASCADES * 2;
+    static const u32 TIMESTAMP_COUNT = SCOPE_TIMESTAMPS + MAX_SCOPES * 2;
+    static const VkQueryPipelineStatisticFlags PIPELINE_STATISTICS = VK_QUERY_PIPELINE_STATISTIC_FRAGMENT_SHADER_INVOCATIONS_BIT;
+
+    // One per frame in flight, GPU times are frames_in_flight frames old when they are read
+    static array<RenderStatsFrame> frames;
+    static u32 frame;
+    // Indices into the frame's scopes of the scopes that were begun but not ended
+    static array<u32> open_scopes;
+    // Scopes of the last frame that was read back
+    static array<GPUScopeTime> scope_times;
+    // Counts shaded fragments for the overdraw, costs a little on some GPUs
+    static bool collect_statistics;
+
 	static f64 mspf_cpu;
     static f64 mspf_gpu;
+    // Summed over the phases
+    static f64 mspf_passes[RENDER_STATS_PASS_COUNT];
+    static f64 mspf_cascades[MAX_SHADOW_CASCADES];
+    // Input sampling until the GPU finished the frame, as seen by the CPU. Presentation and
+    // scan out are not part of it.
+    static f64 ms_latency;
+    // Fragment shader invocations per sample of the frame, 1 means every sample was shaded once
+    static f64 overdraw;
     static u64 draw_calls;
     static u64 triangles;
+    // Instances and meshes tested by the CPU frustum culling
+    static u64 visible_objects;
+    static u64 culled_objects;
+    // Instances drawn by the two Hi-Z culling phases and instances hidden by occluders. The
+    // GPU counts are read back a few frames late, the software rasterizer adds its own.
+    static u64 early_instances;
+    static u64 late_instances;
+    static u64 occluded_instances;
 
     static f64 cpu_frame_time_begin;
 
-    static void Create();
+    static void Create(u32 frames_in_flight);
     static void Destroy();
 
-    static void Begin(VkCommandBuffer cmd_buf);
+    // Right after RenderPass::BeginFrame, reads the queries the frame slot wrote last time
+    static void Begin(VkCommandBuffer cmd_buf, u32 frame);
     static void EndGPU(VkCommandBuffer cmd_buf);
     static void EndCPU();
+    static void ReadFrame(RenderStatsFrame *stats_frame);
+
+    // Around the draws of one pass and phase, written into the secondaries of the first and
+    // last chunk. Safe to call from the job threads.
+    static void BeginPass(VkCommandBuffer cmd_buf, RenderStatsPass pass, u32 phase);
+    static void EndPass(VkCommandBuffer cmd_buf, RenderStatsPass pass, u32 phase);
+
+    // Around everything a shadow cascade renders, outside of rendering
+    static void BeginCascade(VkCommandBuffer cmd_buf, u32 cascade);
+    static void EndCascade(VkCommandBuffer cmd_buf, u32 cascade);
+
+    // Named timings that nest, use GPU_SCOPE. Main thread and primary command buffer only,
+    // outside of rendering that only executes secondaries. name has to outlive the frame.
+    // Scopes past MAX_SCOPES in a frame are not timed.
+    static void BeginScope(VkCommandBuffer cmd_buf, const char *name);
+    static void EndScope(VkCommandBuffer cmd_buf);
+    static void LogScopes();
+
+    // Outside of rendering, around every rendering of the frame. samples is the number of
+    // samples of the attachments, the overdraw is relative to it.
+    static void BeginStatistics(VkCommandBuffer cmd_buf);
+    static void EndStatistics(VkCommandBuffer cmd_buf, u64 samples);
 
     static void DrawCall();
     static void CountTriangles(u64 count);
+    static void CountCulling(u64 visible, u64 culled);
+    static void CountOcclusion(u64 early, u64 late, u64 occluded);
+    static void CountLatency(f64 ms);
 
     static void SetTitle(GLFWwindow *window);
 };
 
+// Ends the scope when it goes out of C++ scope
+struct GPUScope {
+    VkCommandBuffer cmd_buf;
+
+    GPUScope(VkCommandBuffer cmd_buf, const char *name) : cmd_buf(cmd_buf) {
+        RenderStats::BeginScope(cmd_buf, name);
+    }
+    ~GPUScope() {
+        RenderStats::EndScope(cmd_buf);
+    }
+};
+
+#define GPU_SCOPE_CONCAT_(a, b) a##b
+#define GPU_SCOPE_CONCAT(a, b) GPU_SCOPE_CONCAT_(a, b)
+// GPU_SCOPE(cmd_buf, "Shadows") times the rest of the enclosing block
+#define GPU_SCOPE(cmd_buf, name) GPUScope GPU_SCOPE_CONCAT(gpu_scope_, __LINE__)(cmd_buf, name)
+
 // Meh
 extern PFN_vkCmdPushDescriptorSetKHR vkCmdPushDescriptorSetFunc;
 
@@ -0,0 +1,129 @@
+#include "VulkanTimeline.h"
+
+#include "VulkanRenderer.h"
+
+void VulkanTimeline::Create(VkQueue queue) {
+    this->queue = queue;
+    submitted = 0;
+    completed = 0;
+
+    VkSemaphoreTypeCreateInfo type_info = { VK_STRUCTURE_TYPE_SEMAPHORE_TYPE_CREATE_INFO };
+    type_info.semaphoreType = VK_SEMAPHORE_TYPE_TIMELINE;
+    type_info.initialValue = 0;
+
+    VkSemaphoreCreateInfo semaphore_info = { VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO };
+    semaphore_info.pNext = &type_info;
+
+    VK_CHECK(vkCreateSemaphore(VulkanDevice::handle, &semaphore_info, 0, &semaphore));
+}
+
+void VulkanTimeline::Destroy() {
+    Wait(submitted);
+
+    // Nothing is submitted anymore, frames that were never ended included
+    for (TimelineDeferral &deferral : deferrals) {
+        deferral.destroy();
+    }
+    deferrals.clear();
+
+    vkDestroySemaphore(VulkanDevice::handle, semaphore, 0);
+    semaphore = VK_NULL_HANDLE;
+}
+
+u64 VulkanTimeline::Submit(VkCommandBuffer cmd_buf, span<const VkSemaphoreSubmitInfo> waits, span<const VkSemaphoreSubmitInfo> signals) {
+    if (signals.size() > MAX_SIGNALS) {
+        LogFatal("VulkanTimeline: %d signal semaphores, at most %d", (u32) signals.size(), MAX_SIGNALS);
+    }
+
+    u64 value = submitted + 1;
+
+    VkSemaphoreSubmitInfo signal_infos[MAX_SIGNALS + 1];
+    u32 signal_count = 0;
+    for (const VkSemaphoreSubmitInfo &signal : signals) {
+        signal_infos[signal_count++] = signal;
+    }
+
+    VkSemaphoreSubmitInfo *timeline_signal = &signal_infos[signal_count++];
+    *timeline_signal = { VK_STRUCTURE_TYPE_SEMAPHORE_SUBMIT_INFO };
+    timeline_signal->semaphore = semaphore;
+    timeline_signal->value = value;
+    timeline_signal->stageMask = VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT;
+
+    VkCommandBufferSubmitInfo command_buffer_info = { VK_STRUCTURE_TYPE_COMMAND_BUFFER_SUBMIT_INFO };
+    command_buffer_info.commandBuffer = cmd_buf;
+
+    VkSubmitInfo2 submit_info = { VK_STRUCTURE_TYPE_SUBMIT_INFO_2 };
+    submit_info.waitSemaphoreInfoCount = (u32) waits.size();
+    submit_info.pWaitSemaphoreInfos = waits.data();
+    submit_info.commandBufferInfoCount = cmd_buf ? 1 : 0;
+    submit_info.pCommandBufferInfos = &command_buffer_info;
+    submit_info.signalSemaphoreInfoCount = signal_count;
+    submit_info.pSignalSemaphoreInfos = signal_infos;
+
+    VK_CHECK(vkQueueSubmit2(queue, 1, &submit_info, VK_NULL_HANDLE));
+
+    submitted = value;
+    return value;
+}
+
+bool VulkanTimeline::IsComplete(u64 value) {
+    if (value <= completed) {
+        return true;
+    }
+
+    VK_CHECK(vkGetSemaphoreCounterValue(VulkanDevice::handle, semaphore, &completed));
+    return value <= completed;
+}
+
+void VulkanTimeline::Wait(u64 value) {
+    if (IsComplete(value)) {
+        return;
+    }
+
+    VkSemaphoreWaitInfo wait_info = { VK_STRUCTURE_TYPE_SEMAPHORE_WAIT_INFO };
+    wait_info.semaphoreCount = 1;
+    wait_info.pSemaphores = &semaphore;
+    wait_info.pValues = &value;
+
+    VK_CHECK(vkWaitSemaphores(VulkanDevice::handle, &wait_info, UINT64_MAX));
+    completed = value;
+}
+
+VkSemaphoreSubmitInfo VulkanTimeline::WaitInfo(u64 value, VkPipelineStageFlags2 stage) {
+    VkSemaphoreSubmitInfo wait_info = { VK_STRUCTURE_TYPE_SEMAPHORE_SUBMIT_INFO };
+    wait_info.semaphore = semaphore;
+    wait_info.value = value;
+    wait_info.stageMask = stage;
+
+    return wait_info;
+}
+
+void VulkanTimeline::Defer(std::function<void()> destroy, u64 value) {
+    deferrals.push_back({ value, std::move(destroy) });
+}
+
+void VulkanTimeline::EndFrame(u64 value) {
+    for (TimelineDeferral &deferral : deferrals) {
+        if (deferral.value == END_OF_FRAME) {
+            deferral.value = value;
+        }
+    }
+}
+
+void VulkanTimeline::Collect() {
+    if (deferrals.empty()) {
+        return;
+    }
+
+    VK_CHECK(vkGetSemaphoreCounterValue(VulkanDevice::handle, semaphore, &completed));
+
+    u32 kept = 0;
+    for (u32 i = 0; i < deferrals.size(); ++i) {
+        if (deferrals[i].value <= completed) {
+            deferrals[i].destroy();
+        } else {
+            deferrals[kept++] = std::move(deferrals[i]);
+        }
+    }
+    deferrals.resize(kept);
+}
@@ -0,0 +1,58 @@
+#ifndef VULKAN_TIMELINE_H
+#define VULKAN_TIMELINE_H
+
+#include <Vulkan/vulkan.h>
+
+#include <functional>
+
+#include "Common.h"
+
+// Runs once the timeline reached value
+struct TimelineDeferral {
+    u64 value;
+    std::function<void()> destroy;
+};
+
+// The timeline semaphore of one queue. Every submission signals the next value of a counter,
+// so "submission N is done" is a single number: the CPU polls or waits for a value instead of
+// a fence per submission, and other queues wait for it with WaitInfo. Binary semaphores are
+// only left for swapchain acquire and present, which do not take timeline semaphores.
+//
+// Defer keeps resources alive until the GPU is done with them instead of idling the device.
+// Only used from the main thread.
+struct VulkanTimeline {
+    // Held back until EndFrame gives it the value of the frame being recorded
+    static const u64 END_OF_FRAME = ~0ull;
+    static const u32 MAX_SIGNALS = 3;
+
+    VkSemaphore semaphore = VK_NULL_HANDLE;
+    VkQueue queue = VK_NULL_HANDLE;
+    // Value of the last submission, and the highest value the GPU was seen to reach
+    u64 submitted = 0;
+    u64 completed = 0;
+
+    array<TimelineDeferral> deferrals;
+
+    void Create(VkQueue queue);
+    // Waits for everything that was submitted and runs the deferrals that are left
+    void Destroy();
+
+    // Returns the value the submission signals once cmd_buf finished, signals are binary
+    // semaphores for other consumers, at most MAX_SIGNALS
+    u64 Submit(VkCommandBuffer cmd_buf, span<const VkSemaphoreSubmitInfo> waits = {}, span<const VkSemaphoreSubmitInfo> signals = {});
+
+    bool IsComplete(u64 value);
+    void Wait(u64 value);
+    // Lets a submission to another queue wait for value
+    VkSemaphoreSubmitInfo WaitInfo(u64 value, VkPipelineStageFlags2 stage);
+
+    // destroy runs on a later Collect once the GPU reached value. The default is for resources
+    // that commands recorded earlier in the current frame may still refer to. destroy must not Defer.
+    void Defer(std::function<void()> destroy, u64 value = END_OF_FRAME);
+    // Called with the value of the frame's submission
+    void EndFrame(u64 value);
+    // Runs the deferrals the GPU is done with, never blocks
+    void Collect();
+};
+
+#endif
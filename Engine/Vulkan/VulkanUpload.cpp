@@ -0,0 +1,352 @@
+#include "VulkanUpload.h"
+
+#include "VulkanRenderer.h"
+
+VkBuffer VulkanUploader::staging_buffer = VK_NULL_HANDLE;
+VulkanAllocation VulkanUploader::staging_allocation = {};
+u64 VulkanUploader::ring_head = 0;
+u64 VulkanUploader::ring_tail = 0;
+bool VulkanUploader::dedicated_queue = false;
+VkCommandPool VulkanUploader::command_pool = VK_NULL_HANDLE;
+VkCommandPool VulkanUploader::acquire_command_pool = VK_NULL_HANDLE;
+UploadBatch VulkanUploader::batches[VulkanUploader::BATCH_COUNT] = {};
+u32 VulkanUploader::current_batch = 0;
+u64 VulkanUploader::completed_ticket = 0;
+u64 VulkanUploader::ready_ticket = 0;
+
+static VkCommandPool CreateUploadCommandPool(u32 queue_family_index, VkCommandBuffer *command_buffers, u32 count) {
+    VkDevice device = VulkanDevice::handle;
+
+    VkCommandPoolCreateInfo command_pool_info = { VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO };
+    command_pool_info.flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT | VK_COMMAND_POOL_CREATE_TRANSIENT_BIT;
+    command_pool_info.queueFamilyIndex = queue_family_index;
+
+    VkCommandPool pool;
+    VK_CHECK(vkCreateCommandPool(device, &command_pool_info, 0, &pool));
+
+    VkCommandBufferAllocateInfo command_buffer_info = { VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO };
+    command_buffer_info.commandPool = pool;
+    command_buffer_info.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+    command_buffer_info.commandBufferCount = count;
+
+    VK_CHECK(vkAllocateCommandBuffers(device, &command_buffer_info, command_buffers));
+
+    return pool;
+}
+
+void VulkanUploader::Create() {
+    VkDevice device = VulkanDevice::handle;
+
+    dedicated_queue = VulkanDevice::transfer_index != VulkanDevice::graphics_index;
+
+    VkBufferCreateInfo buffer_info = { VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO };
+    buffer_info.size = STAGING_SIZE;
+    buffer_info.usage = VK_BUFFER_USAGE_TRANSFER_SRC_BIT;
+    buffer_info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+
+    VK_CHECK(vkCreateBuffer(device, &buffer_info, 0, &staging_buffer));
+    staging_allocation = VulkanAllocator::AllocateBuffer(staging_buffer, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
+
+    VkCommandBuffer command_buffers[BATCH_COUNT];
+    VkCommandBuffer acquire_command_buffers[BATCH_COUNT];
+
+    command_pool = CreateUploadCommandPool(VulkanDevice::transfer_index, command_buffers, BATCH_COUNT);
+    if (dedicated_queue) {
+        acquire_command_pool = CreateUploadCommandPool(VulkanDevice::graphics_index, acquire_command_buffers, BATCH_COUNT);
+    }
+
+    for (u32 i = 0; i < BATCH_COUNT; ++i) {
+        UploadBatch *batch = &batches[i];
+        *batch = {};
+        batch->command_buffer = command_buffers[i];
+        batch->state = UPLOAD_BATCH_IDLE;
+
+        if (dedicated_queue) {
+            batch->acquire_command_buffer = acquire_command_buffers[i];
+        }
+    }
+
+    ring_head = 0;
+    ring_tail = 0;
+    current_batch = 0;
+    completed_ticket = 0;
+    ready_ticket = 0;
+    batches[0].ticket = 1;
+}
+
+static void CompleteTransfer(UploadBatch *batch);
+static void WaitBatch(UploadBatch *batch);
+
+void VulkanUploader::Destroy() {
+    VkDevice device = VulkanDevice::handle;
+
+    Flush();
+    for (u32 i = 1; i <= BATCH_COUNT; ++i) {
+        WaitBatch(&batches[(current_batch + i) % BATCH_COUNT]);
+    }
+
+    vkDestroyCommandPool(device, command_pool, 0);
+    if (dedicated_queue) {
+        vkDestroyCommandPool(device, acquire_command_pool, 0);
+    }
+
+    vkDestroyBuffer(device, staging_buffer, 0);
+    VulkanAllocator::Free(&staging_allocation);
+}
+
+static void SubmitAcquire(UploadBatch *batch) {
+    VkCommandBuffer command_buffer = batch->acquire_command_buffer;
+
+    for (VkBufferMemoryBarrier2 &barrier : batch->ownership_barriers) {
+        barrier.srcStageMask = VK_PIPELINE_STAGE_2_NONE;
+        barrier.srcAccessMask = VK_ACCESS_2_NONE;
+        barrier.dstStageMask = VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT;
+        barrier.dstAccessMask = VK_ACCESS_2_MEMORY_READ_BIT;
+    }
+
+    VkCommandBufferBeginInfo begin_info = { VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO };
+    begin_info.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+
+    VK_CHECK(vkResetCommandBuffer(command_buffer, 0));
+    VK_CHECK(vkBeginCommandBuffer(command_buffer, &begin_info));
+
+    VkDependencyInfo dependency_info = { VK_STRUCTURE_TYPE_DEPENDENCY_INFO };
+    dependency_info.bufferMemoryBarrierCount = (u32) batch->ownership_barriers.size();
+    dependency_info.pBufferMemoryBarriers = batch->ownership_barriers.data();
+
+    vkCmdPipelineBarrier2(command_buffer, &dependency_info);
+
+    VK_CHECK(vkEndCommandBuffer(command_buffer));
+
+    // The transfer already finished when we get here, so this wait never stalls the graphics queue
+    VkSemaphoreSubmitInfo wait_info = VulkanDevice::transfer_timeline.WaitInfo(batch->transfer_value, VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT);
+
+    batch->acquire_value = VulkanDevice::graphics_timeline.Submit(command_buffer, { &wait_info, 1 });
+
+    batch->ownership_barriers.clear();
+    batch->state = UPLOAD_BATCH_ACQUIRING;
+
+    if (batch->ticket > VulkanUploader::ready_ticket) {
+        VulkanUploader::ready_ticket = batch->ticket;
+    }
+}
+
+static void CompleteTransfer(UploadBatch *batch) {
+    VulkanUploader::ring_tail = batch->ring_end;
+
+    if (batch->ticket > VulkanUploader::completed_ticket) {
+        VulkanUploader::completed_ticket = batch->ticket;
+    }
+
+    if (VulkanUploader::dedicated_queue) {
+        SubmitAcquire(batch);
+    } else {
+        batch->state = UPLOAD_BATCH_IDLE;
+    }
+}
+
+static void CompleteAcquire(UploadBatch *batch) {
+    batch->state = UPLOAD_BATCH_IDLE;
+}
+
+static void WaitBatch(UploadBatch *batch) {
+    if (batch->state == UPLOAD_BATCH_TRANSFERRING) {
+        VulkanDevice::transfer_timeline.Wait(batch->transfer_value);
+        CompleteTransfer(batch);
+    }
+
+    if (batch->state == UPLOAD_BATCH_ACQUIRING) {
+        VulkanDevice::graphics_timeline.Wait(batch->acquire_value);
+        CompleteAcquire(batch);
+    }
+}
+
+static UploadBatch *OldestTransferringBatch() {
+    // Batches are used round robin, so the oldest one comes right after the current one
+    for (u32 i = 1; i <= VulkanUploader::BATCH_COUNT; ++i) {
+        UploadBatch *batch = &VulkanUploader::batches[(VulkanUploader::current_batch + i) % VulkanUploader::BATCH_COUNT];
+        if (batch->state == UPLOAD_BATCH_TRANSFERRING) {
+            return batch;
+        }
+    }
+
+    return 0;
+}
+
+void VulkanUploader::Update() {
+    for (u32 i = 1; i <= BATCH_COUNT; ++i) {
+        UploadBatch *batch = &batches[(current_batch + i) % BATCH_COUNT];
+
+        if (batch->state == UPLOAD_BATCH_TRANSFERRING) {
+            // Transfers finish in order, everything after this one is still running too
+            if (!VulkanDevice::transfer_timeline.IsComplete(batch->transfer_value)) {
+                break;
+            }
+
+            CompleteTransfer(batch);
+        }
+
+        if (batch->state == UPLOAD_BATCH_ACQUIRING && VulkanDevice::graphics_timeline.IsComplete(batch->acquire_value)) {
+            CompleteAcquire(batch);
+        }
+    }
+}
+
+static u64 RingAllocate(VkDeviceSize size) {
+    const u64 ring_size = VulkanUploader::STAGING_SIZE;
+
+    while (true) {
+        u64 start = (VulkanUploader::ring_head + 15) & ~15ull;
+
+        // Never wrap in the middle of a copy
+        if ((start % ring_size) + size > ring_size) {
+            start += ring_size - (start % ring_size);
+        }
+
+        if (start + size - VulkanUploader::ring_tail <= ring_size) {
+            VulkanUploader::ring_head = start + size;
+            return start % ring_size;
+        }
+
+        // The ring is full. Either the copies we recorded so far are holding it, or older
+        // batches are still being executed on the GPU.
+        UploadBatch *oldest = OldestTransferringBatch();
+        if (oldest) {
+            VulkanDevice::transfer_timeline.Wait(oldest->transfer_value);
+            CompleteTransfer(oldest);
+        } else {
+            VulkanUploader::Flush();
+        }
+    }
+}
+
+static UploadBatch *BeginBatch() {
+    UploadBatch *batch = &VulkanUploader::batches[VulkanUploader::current_batch];
+
+    if (batch->state == UPLOAD_BATCH_IDLE) {
+        VkCommandBufferBeginInfo begin_info = { VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO };
+        begin_info.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+
+        VK_CHECK(vkResetCommandBuffer(batch->command_buffer, 0));
+        VK_CHECK(vkBeginCommandBuffer(batch->command_buffer, &begin_info));
+
+        batch->state = UPLOAD_BATCH_RECORDING;
+    }
+
+    return batch;
+}
+
+void VulkanUploader::UploadBuffer(VkBuffer dst, VkDeviceSize dst_offset, const void *data, VkDeviceSize size) {
+    const u8 *src = (const u8 *) data;
+
+    while (size) {
+        VkDeviceSize chunk_size = size < MAX_CHUNK_SIZE ? size : MAX_CHUNK_SIZE;
+
+        // Allocate before BeginBatch, making room in the ring may flush the current batch
+        u64 staging_offset = RingAllocate(chunk_size);
+        memcpy((u8 *) staging_allocation.mapped + staging_offset, src, chunk_size);
+
+        UploadBatch *batch = BeginBatch();
+
+        VkBufferCopy region;
+        region.srcOffset = staging_offset;
+        region.dstOffset = dst_offset;
+        region.size = chunk_size;
+        vkCmdCopyBuffer(batch->command_buffer, staging_buffer, dst, 1, &region);
+
+        if (dedicated_queue) {
+            VkBufferMemoryBarrier2 barrier = { VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER_2 };
+            barrier.srcQueueFamilyIndex = VulkanDevice::transfer_index;
+            barrier.dstQueueFamilyIndex = VulkanDevice::graphics_index;
+            barrier.buffer = dst;
+            barrier.offset = dst_offset;
+            barrier.size = chunk_size;
+
+            batch->ownership_barriers.push_back(barrier);
+        }
+
+        batch->ring_end = ring_head;
+
+        src += chunk_size;
+        dst_offset += chunk_size;
+        size -= chunk_size;
+    }
+}
+
+u64 VulkanUploader::Flush() {
+    UploadBatch *batch = &batches[current_batch];
+
+    if (batch->state != UPLOAD_BATCH_RECORDING) {
+        return batch->ticket - 1;
+    }
+
+    VkDependencyInfo dependency_info = { VK_STRUCTURE_TYPE_DEPENDENCY_INFO };
+
+    VkMemoryBarrier2 memory_barrier = { VK_STRUCTURE_TYPE_MEMORY_BARRIER_2 };
+
+    if (dedicated_queue) {
+        // Release half of the queue family ownership transfer, SubmitAcquire records the other half
+        for (VkBufferMemoryBarrier2 &barrier : batch->ownership_barriers) {
+            barrier.srcStageMask = VK_PIPELINE_STAGE_2_COPY_BIT;
+            barrier.srcAccessMask = VK_ACCESS_2_TRANSFER_WRITE_BIT;
+            barrier.dstStageMask = VK_PIPELINE_STAGE_2_NONE;
+            barrier.dstAccessMask = VK_ACCESS_2_NONE;
+        }
+
+        dependency_info.bufferMemoryBarrierCount = (u32) batch->ownership_barriers.size();
+        dependency_info.pBufferMemoryBarriers = batch->ownership_barriers.data();
+    } else {
+        // Same queue as rendering, make the copies visible to everything submitted after this batch
+        memory_barrier.srcStageMask = VK_PIPELINE_STAGE_2_COPY_BIT;
+        memory_barrier.srcAccessMask = VK_ACCESS_2_TRANSFER_WRITE_BIT;
+        memory_barrier.dstStageMask = VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT;
+        memory_barrier.dstAccessMask = VK_ACCESS_2_MEMORY_READ_BIT;
+
+        dependency_info.memoryBarrierCount = 1;
+        dependency_info.pMemoryBarriers = &memory_barrier;
+    }
+
+    vkCmdPipelineBarrier2(batch->command_buffer, &dependency_info);
+
+    VK_CHECK(vkEndCommandBuffer(batch->command_buffer));
+
+    batch->transfer_value = VulkanDevice::transfer_timeline.Submit(batch->command_buffer);
+
+    batch->state = UPLOAD_BATCH_TRANSFERRING;
+
+    u64 ticket = batch->ticket;
+    if (!dedicated_queue) {
+        ready_ticket = ticket;
+    }
+
+    current_batch = (current_batch + 1) % BATCH_COUNT;
+
+    // The next batch is the oldest one, it has to be done before it can be recorded again
+    UploadBatch *next = &batches[current_batch];
+    WaitBatch(next);
+    next->ticket = ticket + 1;
+
+    return ticket;
+}
+
+void VulkanUploader::Wait(u64 ticket) {
+    while (completed_ticket < ticket) {
+        UploadBatch *oldest = OldestTransferringBatch();
+        if (!oldest) {
+            break;
+        }
+
+        VulkanDevice::transfer_timeline.Wait(oldest->transfer_value);
+        CompleteTransfer(oldest);
+    }
+}
+
+bool VulkanUploader::IsComplete(u64 ticket) {
+    Update();
+
+    return completed_ticket >= ticket;
+}
+
+bool VulkanUploader::IsReady(u64 ticket) {
+    return ready_ticket >= ticket;
+}
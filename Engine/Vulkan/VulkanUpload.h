@@ -0,0 +1,84 @@
+#ifndef VULKAN_UPLOAD_H
+#define VULKAN_UPLOAD_H
+
+#include <Vulkan/vulkan.h>
+
+#include "Common.h"
+#include "VulkanMemory.h"
+
+enum UploadBatchState {
+    UPLOAD_BATCH_IDLE,
+    UPLOAD_BATCH_RECORDING,
+    // Copies are executing on the transfer queue
+    UPLOAD_BATCH_TRANSFERRING,
+    // Ownership acquire was submitted to the graphics queue (dedicated transfer queue only)
+    UPLOAD_BATCH_ACQUIRING
+};
+
+struct UploadBatch {
+    VkCommandBuffer command_buffer;
+    // VulkanDevice::transfer_timeline value of the copies
+    u64 transfer_value;
+    u64 ticket;
+    // Ring position after the last copy of this batch, the ring tail moves here once the batch retires
+    u64 ring_end;
+    UploadBatchState state;
+
+    // Only used with a dedicated transfer queue: the copied ranges have to be released by the
+    // transfer family and acquired by the graphics family before they can be used for rendering
+    array<VkBufferMemoryBarrier2> ownership_barriers;
+    VkCommandBuffer acquire_command_buffer;
+    // VulkanDevice::graphics_timeline value of the acquire
+    u64 acquire_value;
+};
+
+// Singleton that streams data into device local resources. Data is copied into a
+// persistently mapped staging ring and the copies are batched into one submission,
+// so loading N meshes costs one vkQueueSubmit instead of N vkQueueWaitIdle calls.
+//
+// Copies run on VulkanDevice::transfer_queue. If that is a separate family, every batch
+// releases its buffers to the graphics family. Update() hands finished batches over to the
+// graphics queue without stalling rendering, the acquire waits on the transfer timeline. If there is no
+// separate family the copies go to the graphics queue and are ready as soon as they are flushed.
+//
+// Every submitted batch gets a ticket. A resource may be used for rendering once
+// IsReady(ticket) returns true.
+struct VulkanUploader {
+    static const VkDeviceSize STAGING_SIZE = 32ull * 1024 * 1024;
+    static const VkDeviceSize MAX_CHUNK_SIZE = STAGING_SIZE / 4;
+    static const u32 BATCH_COUNT = 4;
+
+    static VkBuffer staging_buffer;
+    static VulkanAllocation staging_allocation;
+    // Monotonic ring positions, the offset into the staging buffer is position % STAGING_SIZE
+    static u64 ring_head;
+    static u64 ring_tail;
+
+    static bool dedicated_queue;
+    static VkCommandPool command_pool;
+    static VkCommandPool acquire_command_pool;
+    static UploadBatch batches[BATCH_COUNT];
+    static u32 current_batch;
+    // Highest ticket whose copies have finished on the GPU
+    static u64 completed_ticket;
+    // Highest ticket that can be used by work submitted to the graphics queue from now on
+    static u64 ready_ticket;
+
+    static void Create();
+    static void Destroy();
+
+    // Queues a copy of size bytes from data to dst at dst_offset. data can be freed right away.
+    static void UploadBuffer(VkBuffer dst, VkDeviceSize dst_offset, const void *data, VkDeviceSize size);
+
+    // Submits all queued copies without waiting and returns the ticket of the submission
+    static u64 Flush();
+    static void Wait(u64 ticket);
+    static bool IsComplete(u64 ticket);
+    static bool IsReady(u64 ticket);
+
+    // Retires finished batches and hands them to the graphics queue, never blocks.
+    // Called once per frame before the frame is submitted.
+    static void Update();
+};
+
+#endif
@@ -2,6 +2,7 @@
 
 #include "Core/Camera.h"
 #include "Core/Input.h"
+#include "Core/JobSystem.h"
 #include "Core/Sound.h"
 #include "Core/Window.h"
 #include "Engine.h"
@@ -9,6 +10,7 @@
 #include "Vulkan/VulkanRenderer.h"
 #include "Graphics/Model.h"
 #include "Graphics/SceneRenderer.h"
+#include "Graphics/Portals.h"
 
 #define GLM_FORCE_RADIANS
 #define GLM_FORCE_DEFAULT_ALIGNED_GENTYPES
@@ -43,6 +45,8 @@ struct Door {
 	Model *model_door;
 	Sound *sound_door_open;
 	Sound *sound_door_close;
+	CellGraph *cells = 0;
+	u32 portal = 0;
 
 	Door(Model *model_wall_door, Model *model_door) : model_wall_door(model_wall_door), model_door(model_door) {
 		model_wall_door->transformation = glm::toMat4(glm::quat(glm::radians(glm::vec3(0.0f, 0.0f, 0.0f))));
@@ -72,6 +76,11 @@ struct Door {
 			}
 		}
 
+		// The doorway can be seen through until the door is fully shut
+		if (cells) {
+			cells->SetPortalOpen(portal, open || open_degree > 0.0f);
+		}
+
 		renderer->RenderModel(model_wall_door);
 		renderer->RenderModel(model_door);
 	}
@@ -96,6 +105,9 @@ int main() {
 
 	InitSound();
 
+    // Before the render pass, it creates command pools for every job thread
+    JobSystem::Create();
+
 #ifdef MAG_DEBUG
     VulkanContext context = VulkanContext::Get(true);
 #else
@@ -108,22 +120,44 @@ int main() {
     VulkanDevice::Create(&context);
 
     VulkanSwapchain swapchain;
-    swapchain.Create(true);
+    swapchain.Create(VK_PRESENT_MODE_FIFO_KHR);
 
     RenderPass render_pass;
     render_pass.Create(&swapchain);
 
+    // Before anything creates pipelines, the compiles run on the job system
+    PipelineVariants::Create(&swapchain);
+
 	SceneRenderer *renderer = new SceneRenderer(&swapchain, &render_pass);
 
-	Model *model_wall_door = ModelImporter::Load("Game/Assets/Models/village/Stucco_Doorway_Wide_Tall.obj", render_pass.graphics_command_pool.handle);
-	Model *model_door = ModelImporter::Load("Game/Assets/Models/village/Wall_Prop_Door_Ornate.obj", render_pass.graphics_command_pool.handle);
-	Model *model_floor = ModelImporter::Load("Game/Assets/Models/village/Stone_Floor_2.obj", render_pass.graphics_command_pool.handle);
-	Model *model_waterwheel = ModelImporter::Load("Game/Assets/Models/village/Waterwheel_1.obj", render_pass.graphics_command_pool.handle);
-	Model *model_well = ModelImporter::Load("Game/Assets/Models/village/Prop_Well_1.obj", render_pass.graphics_command_pool.handle);
-	Model *model_wall_window = ModelImporter::Load("Game/Assets/Models/village/Kit_Window_Upper_Straight.obj", render_pass.graphics_command_pool.handle);
+	Model *model_wall_door = ModelImporter::Load("Game/Assets/Models/village/Stucco_Doorway_Wide_Tall.obj");
+	Model *model_door = ModelImporter::Load("Game/Assets/Models/village/Wall_Prop_Door_Ornate.obj");
+	Model *model_floor = ModelImporter::Load("Game/Assets/Models/village/Stone_Floor_2.obj");
+	Model *model_waterwheel = ModelImporter::Load("Game/Assets/Models/village/Waterwheel_1.obj");
+	Model *model_well = ModelImporter::Load("Game/Assets/Models/village/Prop_Well_1.obj");
+	// Large flat walls, shading them per vertex looks the same
+	Model *model_wall_window = ModelImporter::Load("Game/Assets/Models/village/Kit_Window_Upper_Straight.obj", SHADING_PER_VERTEX);
+
+	VulkanAllocator::LogStats();
 
 	model_well->transformation = glm::translate(glm::mat4(1.0f), glm::vec3(2.0f, 0.0f, 2.0f));
 
+	// Large and flat, cheap to rasterize for the CPU occlusion culling
+	model_wall_door->occluder = true;
+	model_door->occluder = true;
+	model_wall_window->occluder = true;
+
+	// Moving models, their shadows are not cached
+	model_door->dynamic = true;
+	model_waterwheel->dynamic = true;
+
+	array<glm::mat4> floor_transforms;
+	for (int x = 1; x < 5; x++) {
+		for (int z = -3; z < 7; z++) {
+			floor_transforms.push_back(glm::translate(glm::mat4(1.0f), glm::vec3(x, 0.0f, z)));
+		}
+	}
+
 	SceneData scene_data;
 
 	FreeCamera camera(glm::vec3(0.0));
@@ -135,17 +169,29 @@ int main() {
 	dir_light.diffuse = glm::vec4(1.0f);
 	scene_data.dir_light = dir_light;
 
+	array<PointLight> point_lights;
+
 	PointLight point_light;
 	point_light.pos = glm::vec3(-10.0f, 2.0f, -10.0f);
 	point_light.ambient = glm::vec4(0.2f);
 	point_light.diffuse = glm::vec4(1.0f);
-
-	scene_data.point_lights[0] = point_light;
-	scene_data.num_point_lights = 1;
+	point_light.radius = 20.0f;
+	point_lights.push_back(point_light);
+
+	// Small warm lights over the floor tiles, only the clusters they reach shade with them
+	for (const glm::mat4 &transform : floor_transforms) {
+		PointLight tile_light;
+		tile_light.pos = glm::vec3(transform[3]) + glm::vec3(0.0f, 0.5f, 0.0f);
+		tile_light.ambient = glm::vec4(0.0f);
+		tile_light.diffuse = glm::vec4(0.6f, 0.4f, 0.2f, 1.0f);
+		tile_light.radius = 1.5f;
+		point_lights.push_back(tile_light);
+	}
 
 	bool show_editor = false;
 	bool show_render_stats = false;
-	bool wireframe = false;
+	// The village is open around the doorway wall, so the cells leak. Off by default, P toggles.
+	bool portal_culling = false;
 
 	f64 last_time = glfwGetTime();
 	f32 delta_time = 0.0f;
@@ -154,7 +200,48 @@ int main() {
 
 	Door door(model_wall_door, model_door);
 
+	// Two cells split by the plane of the door, the doorway is the portal between them
+	CellGraph cells;
+	{
+		glm::vec3 door_center, door_extent;
+		TransformAABB(model_door->transformation, model_door->bounds_min, model_door->bounds_max, &door_center, &door_extent);
+
+		u32 axis = 0;
+		if (door_extent.y < door_extent[axis]) axis = 1;
+		if (door_extent.z < door_extent[axis]) axis = 2;
+
+		glm::vec3 front_min = glm::vec3(-100.0f), front_max = glm::vec3(100.0f);
+		glm::vec3 back_min = glm::vec3(-100.0f), back_max = glm::vec3(100.0f);
+		front_min[axis] = door_center[axis];
+		back_max[axis] = door_center[axis];
+
+		u32 front = cells.AddCell(front_min, front_max);
+		u32 back = cells.AddCell(back_min, back_max);
+
+		door.cells = &cells;
+		door.portal = cells.AddPortal(front, back, model_door->transformation, model_door->bounds_min, model_door->bounds_max);
+	}
+
+	// Static objects find their cell once
+	s32 well_cell = cells.FindCell(glm::vec3(model_well->transformation[3]));
+	s32 waterwheel_cell = cells.FindCell(glm::vec3(2.0f, 1.0f, -2.0f));
+	s32 wall_window_cell = cells.FindCell(glm::vec3(0.0f, 0.0f, 2.0f));
+
+	array<s32> floor_cells;
+	for (const glm::mat4 &transform : floor_transforms) {
+		floor_cells.push_back(cells.FindCell(glm::vec3(transform[3])));
+	}
+	array<glm::mat4> visible_floor_transforms;
+
+	auto InView = [&](s32 cell, Model *model, const glm::mat4 &transform) {
+		return !portal_culling || cells.IsVisible(cell, transform, model->bounds_min, model->bounds_max);
+	};
+
     while (engine.running) {
+		// Polls the input of this frame, with low_latency once the GPU has caught up
+		render_pass.WaitForInput();
+        engine.Update();
+
         while (!engine.events.empty()) {
             Event event = engine.events.front();
             engine.events.pop();
@@ -170,12 +257,47 @@ int main() {
 						if (event.button == (int)KeyCode::E) {
 							door.OpenOrClose();
 						}
+						if (event.button == (int)KeyCode::P) {
+							portal_culling = !portal_culling;
+						}
+						if (event.button == (int)KeyCode::Z) {
+							renderer->depth_prepass = !renderer->depth_prepass;
+						}
+						if (event.button == (int)KeyCode::X) {
+							renderer->wireframe = !renderer->wireframe;
+						}
+						if (event.button == (int)KeyCode::L) {
+							render_pass.low_latency = !render_pass.low_latency;
+						}
+						if (event.button == (int)KeyCode::M) {
+							// Next supported of FIFO, MAILBOX and IMMEDIATE
+							const VkPresentModeKHR present_modes[] = { VK_PRESENT_MODE_FIFO_KHR, VK_PRESENT_MODE_MAILBOX_KHR, VK_PRESENT_MODE_IMMEDIATE_KHR };
+							u32 current = 0;
+							for (u32 i = 0; i < ARRAY_SIZE(present_modes); ++i) {
+								if (present_modes[i] == swapchain.present_mode) {
+									current = i;
+								}
+							}
+							for (u32 step = 1; step < ARRAY_SIZE(present_modes); ++step) {
+								VkPresentModeKHR mode = present_modes[(current + step) % ARRAY_SIZE(present_modes)];
+								if (swapchain.IsPresentModeSupported(mode)) {
+									swapchain.SetPresentMode(mode);
+									break;
+								}
+							}
+						}
+						if (event.button == (int)KeyCode::V) {
+							renderer->debug_view = (SceneDebugView) ((renderer->debug_view + 1) % SCENE_DEBUG_VIEW_COUNT);
+						}
 						if (event.button == (int)KeyCode::F11) {
 							engine.window->ToggleFullscreen();
 						}
 						if (event.button == (int)KeyCode::F3) {
 							show_render_stats = !show_render_stats;
 						}
+						if (event.button == (int)KeyCode::F2) {
+							RenderStats::LogScopes();
+						}
 						if (event.button == (int)KeyCode::F4) {
 							show_editor = !show_editor;
 							if (show_editor) {
@@ -201,30 +323,39 @@ int main() {
 
         camera.Update(engine.window, delta_time);
 		Input::Update(engine.window);
-        engine.Update();
 
 		scene_data.projection = camera.projection;
 		scene_data.view = camera.view;
 
+		cells.Update(camera.projection * camera.view, glm::vec3(glm::inverse(camera.view)[3]));
+
 		renderer->Begin();
 
 		renderer->SetSceneData(&scene_data);
-		renderer->RenderModel(model_well);
+		renderer->RenderPointLights(point_lights);
+		if (InView(well_cell, model_well, model_well->transformation)) {
+			renderer->RenderModel(model_well);
+		}
 
 		model_waterwheel->transformation = TranslateRotateScale(glm::vec3(2.0f, 1.0f, -2.0f), glm::vec3(waterwheel_angle, 0.0f, 0.0f), glm::vec3(0.5f));
-		renderer->RenderModel(model_waterwheel);
+		if (InView(waterwheel_cell, model_waterwheel, model_waterwheel->transformation)) {
+			renderer->RenderModel(model_waterwheel);
+		}
         waterwheel_angle += 10.0f * delta_time;
 
         glm::mat4 wtr = TranslateRotate(glm::vec3(0.0f, 0.0f, 2.0f), glm::vec3(0.0f, -90.0f, 0.0f));
 		model_wall_window->transformation = wtr;
-		renderer->RenderModel(model_wall_window);
+		if (InView(wall_window_cell, model_wall_window, wtr)) {
+			renderer->RenderModel(model_wall_window);
+		}
 
-        for (int x = 1; x < 5; x++) {
-            for (int z = -3; z < 7; z++) {
-				model_floor->transformation = glm::translate(glm::mat4(1.0f), glm::vec3(x, 0.0f, z));
-				renderer->RenderModel(model_floor);
-            }
-        }
+		visible_floor_transforms.clear();
+		for (u32 i = 0; i < floor_transforms.size(); ++i) {
+			if (InView(floor_cells[i], model_floor, floor_transforms[i])) {
+				visible_floor_transforms.push_back(floor_transforms[i]);
+			}
+		}
+		renderer->RenderModelInstanced(model_floor, visible_floor_transforms);
 
         door.Render(renderer, delta_time);
 
@@ -243,12 +374,15 @@ int main() {
 	delete model_wall_window;
 	delete renderer;
 
+    PipelineVariants::Destroy();
     render_pass.Destroy();
 
     swapchain.Destroy();
     VulkanDevice::Destroy();
     VulkanInstance::Destroy();
 
+    JobSystem::Destroy();
+
 	DeinitSound();
 
 	return 0;
@@ -2,4 +2,10 @@ C:\VulkanSDK\1.3.275.0\Bin\glslc.exe Engine\assets\shaders\lowpoly3d.vert -o Eng
 C:\VulkanSDK\1.3.275.0\Bin\glslc.exe Engine\assets\shaders\lowpoly3d.frag -o Engine\assets\shaders\lowpoly3d.frag.spv
 C:\VulkanSDK\1.3.275.0\Bin\glslc.exe Engine\assets\shaders\simple.vert -o Engine\assets\shaders\simple.vert.spv
 C:\VulkanSDK\1.3.275.0\Bin\glslc.exe Engine\assets\shaders\simple.frag -o Engine\assets\shaders\simple.frag.spv
+C:\VulkanSDK\1.3.275.0\Bin\glslc.exe Engine\assets\shaders\cull.comp -o Engine\assets\shaders\cull.comp.spv
+C:\VulkanSDK\1.3.275.0\Bin\glslc.exe Engine\assets\shaders\compact.comp -o Engine\assets\shaders\compact.comp.spv
+C:\VulkanSDK\1.3.275.0\Bin\glslc.exe Engine\assets\shaders\hiz.comp -o Engine\assets\shaders\hiz.comp.spv
+C:\VulkanSDK\1.3.275.0\Bin\glslc.exe Engine\assets\shaders\cluster.comp -o Engine\assets\shaders\cluster.comp.spv
+C:\VulkanSDK\1.3.275.0\Bin\glslc.exe Engine\assets\shaders\depth.vert -o Engine\assets\shaders\depth.vert.spv
+C:\VulkanSDK\1.3.275.0\Bin\glslc.exe Engine\assets\shaders\shadow.vert -o Engine\assets\shaders\shadow.vert.spv
 pause
\ No newline at end of file